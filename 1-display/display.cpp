@@ -70,7 +70,59 @@ PhongLightModel phong(RGBColor(240, 240, 240), RGBColor(230, 230, 230),
 // ReNow helper
 ReNowHelper helper;
 
-int main() {
+// Build indexed mesh of `proc` for vertex cache locality, and report it.
+IndexedMesh buildOptimizedMesh(const OBJProcessor &proc, const string &name) {
+  IndexedMesh mesh = buildIndexedMesh(proc);
+  float acmr = vertexCacheMissRatio(mesh.indices, mesh.vertices.size());
+  optimizeVertexCache(mesh);
+  cout << "[" << name << "] " << proc.fs().size() * 3 << " -> "
+       << mesh.vertices.size() << " vertices, ACMR " << acmr << " -> "
+       << vertexCacheMissRatio(mesh.indices, mesh.vertices.size()) << endl;
+  return mesh;
+}
+
+// A level of detail of a mesh, ready to draw.
+struct MeshLevel {
+  GL_OBJECT_ID VAO, VBuf, IBuf, instBuf;
+  size_t indexCount;
+};
+
+// Load levels of detail of .obj at `path` from their binary caches, or build
+// and cache them, and perpare to draw them.
+vector<MeshLevel> loadMeshLevels(const string &path, const string &name,
+                                 vec3 &boundsMin, vec3 &boundsMax) {
+  vector<CachedMesh> lods = loadCachedMeshLODs(
+      path,
+      [&](const OBJProcessor &proc) { return buildOptimizedMesh(proc, name); },
+      4, 0.25f, "optimized");
+  vector<MeshLevel> levels;
+  for (size_t i = 0; i < lods.size(); i++) {
+    MeshLevel level = {helper.createVAO(), helper.createVBO(),
+                       helper.createVBO(), helper.createVBO(),
+                       lods[i].indexCount()};
+    helper.switchVAO(level.VAO);
+    helper.prepareIndexedMesh(level.VBuf, level.IBuf, lods[i]);
+    helper.prepareInstanceAttributes(level.instBuf);
+    levels.push_back(level);
+    cout << "[" << name << "] LOD " << i << ": " << lods[i].indexCount() / 3
+         << " triangles" << (lods[i].mapped() ? " from mesh cache" : "")
+         << endl;
+  }
+  boundsMin = lods[0].boundsMin(), boundsMax = lods[0].boundsMax();
+  return levels;
+}
+
+// Sizes on screen (pixels across) to switch to coarser ones of `levels`.
+vector<float> lodSizes(const vector<MeshLevel> &levels) {
+  const vector<float> sizes = {256, 128, 64};
+  return vector<float>(sizes.begin(),
+                       sizes.begin() + std::min(sizes.size(),
+                                                levels.size() - 1));
+}
+
+// Run with `--profile [csvPath]` to report frame times, and log them to
+// csvPath if given.
+int main(int argc, char **argv) {
   consoleLogWelcome();
 
   // initialize
@@ -83,6 +135,10 @@ int main() {
   glfwSetKeyCallback(window, keyboardCallback);
   // take over management
   helper = ReNowHelper(window);
+  if (argc >= 2 && string(argv[1]) == "--profile") {
+    helper.profiler().enable(argc >= 3 ? argv[2] : "");
+  }
+  FrameProfiler &profiler = helper.profiler();
 
   // organize the program
   GL_SHADER_ID vShader =
@@ -92,36 +148,52 @@ int main() {
   GL_PROGRAM_ID mainProgram = helper.createProgram(vShader, fShader);
   helper.switchProgram(mainProgram);
 
-  // start loading objects
-  GL_OBJECT_ID sphereVAO = helper.createVAO(), cubeVAO = helper.createVAO();
-  GL_OBJECT_ID sphereVBuf = helper.createVBO(), sphereNBuf = helper.createVBO();
-  GL_OBJECT_ID cubeVBuf = helper.createVBO(), cubeNBuf = helper.createVBO();
-
-  cout << ">>> Start loading model .obj file, this might take a while..."
-       << endl;
-  // load the sphere and perpare to draw it
-  helper.switchVAO(sphereVAO);
-  OBJProcessor sphereOBJProc(readFileText("./model/UnitSphere.obj"));
-  vector<float> sphereVs = analyzeFtoV(sphereOBJProc, "fs");
-  vector<float> sphereVns = analyzeFtoV(sphereOBJProc, "fns");
-  helper.prepareAttributes(vector<APrepInfo>{
-      {sphereVBuf, &(sphereVs[0]), sphereVs.size(), "aPosition", 3, GL_FLOAT},
-      {sphereNBuf, &(sphereVns[0]), sphereVns.size(), "aNormal", 3, GL_FLOAT},
-  });
-
-  // load the cube and perpare to draw it
-  helper.switchVAO(cubeVAO);
-  OBJProcessor cubeOBJProc(readFileText("./model/UnitCube.obj"));
-  vector<float> cubeVs = analyzeFtoV(cubeOBJProc, "fs");
-  vector<float> cubeVns = analyzeFtoV(cubeOBJProc, "fns");
-  helper.prepareAttributes(vector<APrepInfo>{
-      {cubeVBuf, &(cubeVs[0]), cubeVs.size(), "aPosition", 3, GL_FLOAT},
-      {cubeNBuf, &(cubeVns[0]), cubeVns.size(), "aNormal", 3, GL_FLOAT},
-  });
+  // uniform locations, resolved once
+  const GL_UNIFORM_LOC uLightPosition =
+      helper.getUniformLocation("uLightPosition");
+  const GL_UNIFORM_LOC uAmbientProduct =
+      helper.getUniformLocation("uAmbientProduct");
+  const GL_UNIFORM_LOC uDiffuseProduct =
+      helper.getUniformLocation("uDiffuseProduct");
+  const GL_UNIFORM_LOC uSpecularProduct =
+      helper.getUniformLocation("uSpecularProduct");
+  const GL_UNIFORM_LOC uShiness = helper.getUniformLocation("uShiness");
+  const GL_UNIFORM_LOC uWorldMatrix = helper.getUniformLocation("uWorldMatrix");
+  const GL_UNIFORM_LOC uViewProjectionMatrix =
+      helper.getUniformLocation("uViewProjectionMatrix");
+  const GL_UNIFORM_LOC uNormalMatrix =
+      helper.getUniformLocation("uNormalMatrix");
+
+  // load the sphere and the cube and perpare to draw them
+  cout << ">>> Start loading model .obj file." << endl;
+  vec3 sphereMin, sphereMax, cubeMin, cubeMax;
+  vector<MeshLevel> sphereLevels = loadMeshLevels(
+      "./model/UnitSphere.obj", "UnitSphere", sphereMin, sphereMax);
+  vector<MeshLevel> cubeLevels =
+      loadMeshLevels("./model/UnitCube.obj", "UnitCube", cubeMin, cubeMax);
+
+  // place instances in scene, visible ones of a mesh level drawn in one call
+  Scene scene;
+  size_t sphereId = scene.addMesh(sphereMin, sphereMax,
+                                  lodSizes(sphereLevels)),
+         cubeId = scene.addMesh(cubeMin, cubeMax, lodSizes(cubeLevels));
+  const vector<MeshLevel> *meshLevels[] = {&sphereLevels, &cubeLevels};
+  scene.addInstance(sphereId,
+                    scalem(vec3(0.2, 0.2, 0.2)) * translate(0, 0, 1.0),
+                    normalizeRGBColor(RGBColor(29, 156, 215)));
+  scene.addInstance(cubeId,
+                    scalem(vec3(0.1, 0.1, 0.1)) * translate(0.5, 1.5, -1.0),
+                    normalizeRGBColor(RGBColor(127, 127, 127)));
+  vector<InstanceBuffer> visible; // of each mesh level
+
+  const mat4 perspectiveMat =
+      glm::perspective(radians(fovy), aspect, near, far);
 
   cout << ">>> Start rendering." << endl;
   // main loop
   while (!glfwWindowShouldClose(window)) {
+    profiler.beginFrame();
+    profiler.beginPass("update");
     // handler frame-level keyboard event
     keyboardHandler();
 
@@ -130,42 +202,50 @@ int main() {
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     helper.switchProgram(mainProgram);
 
-    // transform matrics
-    mat4 worldMat = camera.getLookAt();
-    mat4 perspectiveMat = glm::perspective(radians(fovy), aspect, near, far);
-
-    helper.prepareUniforms(vector<UPrepInfo>{
-        // Phong light model things
-        {"uLightPosition", lightPos, "3fv"},
-        {"uAmbientProduct", phong.ambientProduct(), "4fv"},
-        {"uDiffuseProduct", phong.diffuseProduct(), "4fv"},
-        {"uSpecularProduct", phong.specularProduct(), "4fv"},
-        {"uShiness", phong.materialShiness(), "1f"},
-        // transform matrics
-        {"uPerspectiveMatrix", perspectiveMat, "Matrix4fv"},
-        {"uWorldMatrix", worldMat, "Matrix4fv"},
-    });
-
-    // draw the sphere
-    helper.prepareUniforms(vector<UPrepInfo>{
-        {"uColor", normalizeRGBColor(RGBColor(29, 156, 215)), "4fv"},
-        {"uModelMatrix", scalem(vec3(0.2, 0.2, 0.2)) * translate(0, 0, 1.0),
-         "Matrix4fv"},
-    });
-    helper.switchVAO(sphereVAO);
-    glDrawArrays(GL_TRIANGLES, 0, sphereOBJProc.getEffectiveVertexCount());
-
-    // draw the cube
-    helper.prepareUniforms(vector<UPrepInfo>{
-        {"uColor", normalizeRGBColor(RGBColor(127, 127, 127)), "4fv"},
-        {"uModelMatrix",
-         scalem(vec3(0.1, 0.1, 0.1)) * translate(0.5, 1.5, -1.0), "Matrix4fv"},
-    });
-    helper.switchVAO(cubeVAO);
-    glDrawArrays(GL_TRIANGLES, 0, cubeOBJProc.getEffectiveVertexCount());
+    // Phong light model things
+    helper.setUniform(uLightPosition, lightPos);
+    helper.setUniform(uAmbientProduct, phong.ambientProduct());
+    helper.setUniform(uDiffuseProduct, phong.diffuseProduct());
+    helper.setUniform(uSpecularProduct, phong.specularProduct());
+    helper.setUniform(uShiness, phong.materialShiness());
+    // transform matrics, the products computed once here
+    mat4 worldMat = camera.getLookAt(),
+         viewProjectionMat = perspectiveMat * worldMat;
+    helper.setUniform(uWorldMatrix, worldMat);
+    helper.setUniform(uViewProjectionMatrix, viewProjectionMat);
+    helper.setUniform(uNormalMatrix,
+                      glm::transpose(glm::inverse(mat3(worldMat))));
+
+    profiler.endPass();
+
+    // keep instances in view only, at levels by their size on screen
+    profiler.beginPass("cull");
+    scene.cull(viewProjectionMat, visible, WINDOW_HEIGHT);
+    profiler.endPass();
+
+    // draw the spheres and the cubes
+    profiler.beginPass("draw");
+    for (size_t mesh : {sphereId, cubeId}) {
+      const vector<MeshLevel> &levels = *meshLevels[mesh];
+      for (size_t i = 0; i < levels.size(); i++) {
+        InstanceBuffer &instances =
+            visible[scene.visibleIndex(mesh, (int)i)];
+        if (instances.size() == 0) {
+          continue;
+        }
+        helper.updateInstances(levels[i].instBuf, instances);
+        helper.switchVAO(levels[i].VAO);
+        helper.drawElementsInstanced(GL_TRIANGLES, levels[i].indexCount,
+                                     instances.size());
+      }
+    }
+    profiler.endPass();
 
+    profiler.beginPass("present");
     glfwSwapBuffers(window);
     glfwPollEvents();
+    profiler.endPass();
+    profiler.endFrame();
   }
 
   // cleaning
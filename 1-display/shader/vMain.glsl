@@ -2,19 +2,18 @@
 
 attribute vec4 aPosition; // vertex position
 attribute vec3 aNormal; // normal vector
+attribute mat4 aModelMatrix; // object coordinate, per instance
+attribute vec4 aColor; // per instance
 
 uniform mat4 uWorldMatrix; // world coordinate
-uniform mat4 uModelMatrix; // object coordinate
-uniform mat4 uPerspectiveMatrix; // perspective
+uniform mat4 uViewProjectionMatrix; // perspective * world
+uniform mat3 uNormalMatrix; // transpose(inverse(world)), by CPU
 
 // Phong light model
 uniform vec3 uLightPosition;
 uniform float uShiness;
 uniform vec4 uAmbientProduct, uDiffuseProduct, uSpecularProduct;
 
-// attribute vec4 aColor;
-uniform vec4 uColor;
-
 varying vec4 vColor;
 varying vec4 vLight;
 
@@ -27,9 +26,8 @@ void main() {
 	vec3 L = normalize(lightPos - posToWorld);
 	vec3 E = -normalize(posToWorld);
 	vec3 H = normalize(L + E);
-	vec4 NN = vec4(aNormal, 1.0);
 	// avoid normal change
-	vec3 N = normalize((mat3(transpose(inverse(uWorldMatrix))) * NN.xyz).xyz);
+	vec3 N = normalize(uNormalMatrix * aNormal);
 	// calculate 3 components
 	vec4 ambient = uAmbientProduct;
 	float Kd = max(dot(L, N), 0.0);
@@ -40,9 +38,9 @@ void main() {
 		specular = vec4(0.0, 0.0, 0.0, 1.0);
 	}
 
-	gl_Position = uPerspectiveMatrix * uWorldMatrix * uModelMatrix * aPosition;
+	gl_Position = uViewProjectionMatrix * aModelMatrix * aPosition;
 
 	// convey to fragment shader
-	vColor = uColor;
+	vColor = aColor;
 	vLight = vec4((ambient + diffuse + specular).rgb, 1.0);
 }
\ No newline at end of file
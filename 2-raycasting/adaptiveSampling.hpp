@@ -0,0 +1,140 @@
+#pragma once
+
+// Adaptive image-space sampling for Ray Casting
+// by z0gSh1u (Zhuo Xu) @ https://github.com/z0gSh1u/seu-viz
+// Rays of a tile are first cast on a coarse grid. A grid cell whose corner
+// colors differ by more than a threshold is split in 4 by casting more rays,
+// recursively, and pixels of the remaining (smooth) cells are interpolated
+// bilinearly from their corners instead of cast.
+
+#ifndef ADAPTIVESAMPLING_HPP_
+#define ADAPTIVESAMPLING_HPP_
+
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include "../framework/ReNow.hpp"
+#include "../framework/Utils.hpp"
+#include "footprint.hpp"
+
+using std::function;
+
+namespace zx {
+
+// Pixels of a tile being cast adaptively.
+class _AdaptiveTile {
+private:
+  const Tile &_tile;
+  float _threshold;
+  const function<RGBAColor(int u, int v)> &_cast;
+  int _w;
+  vector<RGBAColor> _colors;
+  vector<bool> _isCast;
+  int _rays = 0;
+
+  int _index(int u, int v) const { return (v - _tile.v0) * _w + u - _tile.u0; }
+
+  const RGBAColor &_castOnce(int u, int v) {
+    int i = _index(u, v);
+    if (!_isCast[i]) {
+      _colors[i] = _cast(u, v);
+      _isCast[i] = true;
+      _rays++;
+    }
+    return _colors[i];
+  }
+
+  // Largest difference of any channel among the corners of a cell.
+  float _cornerDifference(int u0, int v0, int u1, int v1) {
+    const RGBAColor &a = _castOnce(u0, v0), &b = _castOnce(u1, v0),
+                    &c = _castOnce(u0, v1), &d = _castOnce(u1, v1);
+    RGBAColor low = glm::min(glm::min(a, b), glm::min(c, d)),
+              high = glm::max(glm::max(a, b), glm::max(c, d));
+    RGBAColor diff = high - low;
+    return std::max(std::max(diff.r, diff.g), std::max(diff.b, diff.a));
+  }
+
+public:
+  _AdaptiveTile(const Tile &tile, float threshold,
+                const function<RGBAColor(int u, int v)> &cast)
+      : _tile(tile), _threshold(threshold), _cast(cast),
+        _w(tile.u1 - tile.u0) {
+    size_t size = (size_t)_w * (tile.v1 - tile.v0);
+    _colors.resize(size);
+    _isCast.assign(size, false);
+  }
+
+  // Cast corners of cell [u0, u1] x [v0, v1], and then cast or interpolate
+  // its other pixels.
+  void refine(int u0, int v0, int u1, int v1) {
+    float difference = _cornerDifference(u0, v0, u1, v1);
+    if (u1 - u0 <= 1 && v1 - v0 <= 1) {
+      return; // all are corners
+    }
+    if (difference > _threshold) {
+      // split in (up to) 4, through the middle of sides longer than 1
+      int us[3] = {u0, (u0 + u1) / 2, u1}, vs[3] = {v0, (v0 + v1) / 2, v1};
+      int nu = u1 - u0 > 1 ? 2 : 1, nv = v1 - v0 > 1 ? 2 : 1;
+      if (nu == 1) {
+        us[1] = u1;
+      }
+      if (nv == 1) {
+        vs[1] = v1;
+      }
+      for (int j = 0; j < nv; j++) {
+        for (int i = 0; i < nu; i++) {
+          refine(us[i], vs[j], us[i + 1], vs[j + 1]);
+        }
+      }
+      return;
+    }
+    // smooth, interpolate what is not cast
+    const RGBAColor a = _castOnce(u0, v0), b = _castOnce(u1, v0),
+                    c = _castOnce(u0, v1), d = _castOnce(u1, v1);
+    for (int v = v0; v <= v1; v++) {
+      float fv = v1 > v0 ? float(v - v0) / (v1 - v0) : 0;
+      for (int u = u0; u <= u1; u++) {
+        int i = _index(u, v);
+        if (_isCast[i]) {
+          continue;
+        }
+        float fu = u1 > u0 ? float(u - u0) / (u1 - u0) : 0;
+        _colors[i] = (1 - fv) * ((1 - fu) * a + fu * b) +
+                     fv * ((1 - fu) * c + fu * d);
+      }
+    }
+  }
+
+  int rays() const { return _rays; }
+  const RGBAColor &color(int u, int v) const { return _colors[_index(u, v)]; }
+};
+
+// Cast pixels of `tile` adaptively: corners of cells of `step` pixels (and
+// the last row and column) are cast by `cast(u, v)`, which returns the color
+// of pixel (u, v). Cells are refined while their corner colors differ by more
+// than `threshold` in any channel. Every pixel is then given to `store(u, v,
+// color)`. Returns the number of rays cast.
+int castTileAdaptive(const Tile &tile, int step, float threshold,
+                     const function<RGBAColor(int u, int v)> &cast,
+                     const function<void(int u, int v, const RGBAColor &)>
+                         &store) {
+  _AdaptiveTile adaptive(tile, threshold, cast);
+  step = std::max(step, 1);
+  for (int v0 = tile.v0; v0 < tile.v1 - 1 || v0 == tile.v0; v0 += step) {
+    int v1 = std::min(v0 + step, tile.v1 - 1);
+    for (int u0 = tile.u0; u0 < tile.u1 - 1 || u0 == tile.u0; u0 += step) {
+      int u1 = std::min(u0 + step, tile.u1 - 1);
+      adaptive.refine(u0, v0, u1, v1);
+    }
+  }
+  for (int v = tile.v0; v < tile.v1; v++) {
+    for (int u = tile.u0; u < tile.u1; u++) {
+      store(u, v, adaptive.color(u, v));
+    }
+  }
+  return adaptive.rays();
+}
+
+} // namespace zx
+
+#endif
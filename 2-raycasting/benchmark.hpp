@@ -0,0 +1,298 @@
+#pragma once
+
+// Benchmark suite for Ray Casting
+// by z0gSh1u (Zhuo Xu) @ https://github.com/z0gSh1u/seu-viz
+// Describes fixed rendering scenarios over phantom volumes, and checks their
+// output against recorded golden images, and optionally their timing against
+// an earlier report of the same machine.
+
+#ifndef BENCHMARK_HPP_
+#define BENCHMARK_HPP_
+
+#include <rapidjson/document.h>
+#include <cmath>
+#include <map>
+#include <cstdio>
+#include <vector>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+#include "../framework/ReNow.hpp"
+#include "../framework/Utils.hpp"
+#include "pipeline.hpp"
+
+using rapidjson::Document;
+using rapidjson::Value;
+
+namespace zx {
+
+// One rendering scenario of the suite.
+struct BenchmarkScenario {
+  string name;
+  string phantom;
+  int volumeWidth, volumeHeight, volumeZCount;
+  int imagePlaneWidth, imagePlaneHeight;
+  vec3 normalizedEyePos; // same meaning as in the interactive mode
+  float eyeZ;            // <= 0 means in front of the whole volume
+  string transferFunction;
+  float samplingDelta;
+  bool enableLighting;
+  float kAmbient;
+  int medianFilterKSize;
+  int repeat; // the median time of repeats is reported
+  string renderEngine;
+  bool sparseVolume;
+  int adaptiveStep; // 0 for one ray per pixel
+  float adaptiveThreshold;
+  bool jitterRays;
+  int progressivePasses; // averaged as one rendering
+  string golden;   // scenario whose golden image is the reference
+  float tolerance; // max RMSE allowed against golden image
+};
+
+// Measurement and verdict of one scenario.
+struct BenchmarkResult {
+  string name;
+  double seconds;
+  long long samples;
+  double samplesPerSec;
+  double rmse;     // in 8-bit levels, against golden image
+  int maxDiff;     // in 8-bit levels, against golden image
+  double slowdown; // time / baseline time, 0 if no baseline
+  string status;   // PASS, RECORDED, MISMATCH, SLOW or MISSING
+};
+
+// The whole suite.
+struct BenchmarkSuite {
+  string goldenDir;
+  string reportPath;
+  float tolerance;   // max RMSE allowed against golden image, by default
+  float maxSlowdown; // max time ratio allowed against baseline time
+  int multiThread;
+  bool pinThreads;
+  string hugePages;
+  vector<BenchmarkScenario> scenarios;
+  // set from command line
+  bool record = false; // (re)record golden images instead of checking them
+  std::map<string, double> baselineSeconds; // by scenario name, if given
+};
+
+// Load benchmark suite from json file. Members of "Defaults" apply to every
+// scenario unless the scenario overrides them. Members are read by the checked
+// config helpers, so that an invalid suite is reported.
+BenchmarkSuite loadBenchmarkSuite(const string &path) {
+  Document d;
+  d.Parse(readFileText(path).c_str());
+  ASSERT(!d.HasParseError() && d.IsObject(),
+         "[ERROR] Invalid benchmark suite: " + path);
+
+  BenchmarkSuite suite;
+  suite.goldenDir = configString(d, "GoldenDir", "./benchmark/golden");
+  suite.reportPath = configString(d, "ReportPath", "./benchmark/report.csv");
+  suite.tolerance = configFloat(d, "Tolerance", 1.0);
+  suite.maxSlowdown = configFloat(d, "MaxSlowdown", 1.25);
+  suite.multiThread = configInt(d, "MultiThread", 4);
+  suite.pinThreads = configBool(d, "PinThreads", false);
+  suite.hugePages = configString(d, "HugePages", "none");
+
+  const Value emptyDefaults(rapidjson::kObjectType);
+  const Value &defaults =
+      d.HasMember("Defaults") ? d["Defaults"] : emptyDefaults;
+  ASSERT(defaults.IsObject(), "[ERROR] Defaults should be an object.");
+  const Value &scenarios = configMember(d, "Scenarios");
+  ASSERT(scenarios.IsArray(), "[ERROR] Scenarios should be an array.");
+  for (rapidjson::SizeType i = 0; i < scenarios.Size(); i++) {
+    const Value &s = scenarios[i];
+    ASSERT(s.IsObject(), "[ERROR] Scenarios should be objects.");
+    // look up scenario first, then defaults
+    auto pick = [&](const char *key) -> const Value & {
+      return s.HasMember(key) ? s : defaults;
+    };
+    BenchmarkScenario sc;
+    sc.name = configString(s, "Name");
+    sc.phantom = configString(pick("Phantom"), "Phantom", "SheppLogan");
+    int volumeSize = configInt(pick("VolumeSize"), "VolumeSize", 128);
+    sc.volumeWidth = sc.volumeHeight = sc.volumeZCount = volumeSize;
+    sc.imagePlaneWidth =
+        configInt(pick("ImagePlaneWidth"), "ImagePlaneWidth", volumeSize);
+    sc.imagePlaneHeight =
+        configInt(pick("ImagePlaneHeight"), "ImagePlaneHeight", volumeSize);
+    sc.normalizedEyePos = vec3(0, 0, 1);
+    if (pick("NormalizedEyePos").HasMember("NormalizedEyePos")) {
+      const Value &e = pick("NormalizedEyePos")["NormalizedEyePos"];
+      const string error = "[ERROR] NormalizedEyePos should be 3 numbers.";
+      ASSERT(e.IsArray() && e.Size() == 3, error);
+      for (rapidjson::SizeType j = 0; j < 3; j++) {
+        ASSERT(e[j].IsNumber(), error);
+        sc.normalizedEyePos[j] = e[j].GetFloat();
+      }
+    }
+    sc.eyeZ = configFloat(pick("EyeZ"), "EyeZ", 0);
+    sc.transferFunction = configString(pick("TransferFunction"),
+                                       "TransferFunction", "TF_CT_Bone");
+    sc.samplingDelta = configFloat(pick("SamplingDelta"), "SamplingDelta", 1);
+    sc.enableLighting =
+        configBool(pick("EnableLighting"), "EnableLighting", false);
+    sc.kAmbient = configFloat(pick("KAmbient"), "KAmbient", 0.6);
+    sc.medianFilterKSize =
+        configInt(pick("MedianFilterKSize"), "MedianFilterKSize", 0);
+    sc.repeat = std::max(1, configInt(pick("Repeat"), "Repeat", 3));
+    sc.renderEngine =
+        configString(pick("RenderEngine"), "RenderEngine", "RayCasting");
+    sc.sparseVolume = configBool(pick("SparseVolume"), "SparseVolume", false);
+    ASSERT(!sc.sparseVolume || sc.renderEngine == "RayCasting",
+           "[ERROR] SparseVolume works with RayCasting engine only.");
+    sc.adaptiveStep = configInt(pick("AdaptiveStep"), "AdaptiveStep", 0);
+    sc.adaptiveThreshold =
+        configFloat(pick("AdaptiveThreshold"), "AdaptiveThreshold", 0.05);
+    sc.jitterRays = configBool(pick("JitterRays"), "JitterRays", false);
+    sc.progressivePasses =
+        configInt(pick("ProgressivePasses"), "ProgressivePasses", 1);
+    // e.g. to check another engine against the image of the CPU one
+    sc.golden = configString(s, "Golden", sc.name);
+    sc.tolerance = configFloat(pick("Tolerance"), "Tolerance", suite.tolerance);
+    suite.scenarios.push_back(sc);
+  }
+  return suite;
+}
+
+// Read times of scenarios from report CSV at `path` of an earlier run, as the
+// baseline to check slowdown against.
+std::map<string, double> loadBenchmarkBaseline(const string &path) {
+  std::ifstream s(path);
+  ASSERT(s.good(), "[ERROR] Cannot read benchmark baseline: " + path);
+  std::map<string, double> res;
+  string line;
+  std::getline(s, line); // header
+  while (std::getline(s, line)) {
+    size_t comma = line.find(',');
+    if (comma != string::npos) {
+      res[line.substr(0, comma)] = atof(line.c_str() + comma + 1);
+    }
+  }
+  return res;
+}
+
+// Quantize RGBA float image plane to 8-bit RGB (alpha discarded).
+vector<uint8> imagePlaneToRGB8(const RGBAColor *imagePlane, int size) {
+  vector<uint8> res(size * 3);
+  for (int i = 0; i < size; i++) {
+    for (int j = 0; j < 3; j++) {
+      res[i * 3 + j] =
+          uint8(minmaxClip(imagePlane[i][j], 0, 1) * 255.0f + 0.5f);
+    }
+  }
+  return res;
+}
+
+// Write 8-bit RGB image as binary PPM (P6).
+void writePPM(const string &path, const vector<uint8> &rgb, int w, int h) {
+  std::ofstream s(path, ios::binary);
+  ASSERT(s.good(), "[ERROR] Cannot write image: " + path);
+  s << "P6\n" << w << " " << h << "\n255\n";
+  s.write((const char *)rgb.data(), rgb.size());
+}
+
+// Read 8-bit RGB binary PPM (P6). Returns false if not available.
+bool readPPM(const string &path, vector<uint8> &rgb, int &w, int &h) {
+  std::ifstream s(path, ios::binary);
+  string magic;
+  int maxVal;
+  if (!(s >> magic >> w >> h >> maxVal) || magic != "P6" || maxVal != 255) {
+    return false;
+  }
+  s.get(); // single whitespace after header
+  rgb.resize(w * h * 3);
+  s.read((char *)rgb.data(), rgb.size());
+  return s.gcount() == (std::streamsize)rgb.size();
+}
+
+// Compare two 8-bit images of the same size.
+void compareImages(const vector<uint8> &a, const vector<uint8> &b, double &rmse,
+                   int &maxDiff) {
+  double sqSum = 0;
+  maxDiff = 0;
+  for (size_t i = 0; i < a.size(); i++) {
+    int diff = std::abs(int(a[i]) - int(b[i]));
+    sqSum += diff * diff;
+    maxDiff = std::max(maxDiff, diff);
+  }
+  rmse = sqrt(sqSum / std::max(a.size(), (size_t)1));
+}
+
+// Check one scenario against its golden image, and its time against the
+// baseline if any. A missing golden image fails the scenario, unless
+// recording, which (re)writes the golden image of the scenario itself. The
+// golden image of another scenario is never recorded.
+BenchmarkResult evaluateScenario(const BenchmarkSuite &suite,
+                                 const BenchmarkScenario &sc,
+                                 vector<double> seconds, long long samples,
+                                 const RGBAColor *imagePlane) {
+  BenchmarkResult res;
+  res.name = sc.name;
+  std::sort(seconds.begin(), seconds.end());
+  res.seconds = seconds.at(seconds.size() / 2);
+  res.samples = samples;
+  res.samplesPerSec = samples / std::max(res.seconds, 1e-9);
+  res.rmse = 0, res.maxDiff = 0, res.slowdown = 0;
+
+  int w = sc.imagePlaneWidth, h = sc.imagePlaneHeight;
+  vector<uint8> image = imagePlaneToRGB8(imagePlane, w * h), golden;
+  string goldenImagePath = suite.goldenDir + "/" + sc.golden + ".ppm";
+  int gw, gh;
+
+  if (suite.record && sc.golden == sc.name) {
+    writePPM(goldenImagePath, image, w, h);
+    res.status = "RECORDED";
+    return res;
+  }
+  if (!readPPM(goldenImagePath, golden, gw, gh)) {
+    res.status = "MISSING";
+    return res;
+  }
+
+  ASSERT(gw == w && gh == h,
+         "[ERROR] Golden image size mismatch: " + goldenImagePath);
+  compareImages(image, golden, res.rmse, res.maxDiff);
+  auto baseline = suite.baselineSeconds.find(sc.name);
+  if (baseline != suite.baselineSeconds.end() && baseline->second > 0) {
+    res.slowdown = res.seconds / baseline->second;
+  }
+
+  if (res.rmse > sc.tolerance) {
+    // keep the output for inspection
+    writePPM(suite.goldenDir + "/" + sc.name + ".actual.ppm", image, w, h);
+    res.status = "MISMATCH";
+  } else if (res.slowdown > suite.maxSlowdown) {
+    res.status = "SLOW";
+  } else {
+    res.status = "PASS";
+  }
+  return res;
+}
+
+// Print results as a table, and save them as CSV.
+void reportBenchmark(const BenchmarkSuite &suite,
+                     const vector<BenchmarkResult> &results) {
+  std::ofstream csv(suite.reportPath);
+  csv << "name,seconds,samples,samples_per_sec,rmse,max_diff,slowdown,status"
+      << std::endl;
+  std::cout << std::left << std::setw(24) << "Scenario" << std::setw(12)
+            << "Time(s)" << std::setw(14) << "MSamples/s" << std::setw(10)
+            << "RMSE" << std::setw(10) << "Slowdown"
+            << "Status" << std::endl;
+  for (const auto &r : results) {
+    csv << r.name << "," << r.seconds << "," << r.samples << ","
+        << r.samplesPerSec << "," << r.rmse << "," << r.maxDiff << ","
+        << r.slowdown << "," << r.status << std::endl;
+    std::cout << std::left << std::setw(24) << r.name << std::setw(12)
+              << r.seconds << std::setw(14) << r.samplesPerSec / 1e6
+              << std::setw(10) << r.rmse << std::setw(10) << r.slowdown
+              << r.status << std::endl;
+  }
+}
+
+} // namespace zx
+
+#endif
@@ -0,0 +1,126 @@
+#pragma once
+
+// Screen-space footprint of volume for Ray Casting
+// by z0gSh1u (Zhuo Xu) @ https://github.com/z0gSh1u/seu-viz
+// Projects the bounding box onto image plane, and splits the covered pixels
+// into tiles, so that rays which surely miss the volume are never cast.
+
+#ifndef FOOTPRINT_HPP_
+#define FOOTPRINT_HPP_
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include "../framework/ReNow.hpp"
+#include "../framework/Utils.hpp"
+
+namespace zx {
+
+// Tile of image plane, covering pixels [u0, u1) x [v0, v1).
+struct Tile {
+  int u0, v0, u1, v1;
+};
+
+// Project the 8 corners of bounding box [0, bbox] onto image plane.
+// With parallel projection, the ray of pixel (u, v) starts from
+// `(vec3(u, v, 0) + translateVec) * rotateMat`, so an object point p is hit by
+// the ray of pixel `(rotateMat * p - translateVec).xy`, given that rotateMat
+// is orthonormal.
+vector<vec2> projectBBoxCorners(const vec3 &bbox, const mat3 &rotateMat,
+                                const vec3 &translateVec) {
+  vector<vec2> res;
+  for (int i = 0; i < 8; i++) {
+    vec3 corner(i & 1 ? bbox.x : 0, i & 2 ? bbox.y : 0, i & 4 ? bbox.z : 0);
+    vec3 projected = rotateMat * corner - translateVec;
+    res.push_back(vec2(projected.x, projected.y));
+  }
+  return res;
+}
+
+// Cross product of (a - o) and (b - o).
+float _cross2D(const vec2 &o, const vec2 &a, const vec2 &b) {
+  return (a.x - o.x) * (b.y - o.y) - (a.y - o.y) * (b.x - o.x);
+}
+
+// Convex hull of points in counter-clockwise order (Andrew's monotone chain).
+vector<vec2> convexHull2D(vector<vec2> points) {
+  std::sort(points.begin(), points.end(), [](const vec2 &a, const vec2 &b) {
+    return a.x < b.x || (a.x == b.x && a.y < b.y);
+  });
+  int n = points.size(), k = 0;
+  if (n < 3) {
+    return points;
+  }
+  vector<vec2> hull(2 * n);
+  for (int i = 0; i < n; i++) { // lower hull
+    while (k >= 2 && _cross2D(hull[k - 2], hull[k - 1], points[i]) <= 0) {
+      k--;
+    }
+    hull[k++] = points[i];
+  }
+  for (int i = n - 2, t = k + 1; i >= 0; i--) { // upper hull
+    while (k >= t && _cross2D(hull[k - 2], hull[k - 1], points[i]) <= 0) {
+      k--;
+    }
+    hull[k++] = points[i];
+  }
+  hull.resize(std::max(k - 1, 1));
+  return hull;
+}
+
+// Judge if rectangle [low, high] comes within `margin` of convex polygon,
+// using the separating axis theorem.
+bool rectNearConvexPolygon(const vec2 &low, const vec2 &high,
+                           const vector<vec2> &polygon, float margin) {
+  // axes of rectangle
+  vec2 polyLow = polygon[0], polyHigh = polygon[0];
+  for (const auto &p : polygon) {
+    polyLow = glm::min(polyLow, p);
+    polyHigh = glm::max(polyHigh, p);
+  }
+  if (polyLow.x > high.x + margin || polyHigh.x < low.x - margin ||
+      polyLow.y > high.y + margin || polyHigh.y < low.y - margin) {
+    return false;
+  }
+  // normals of polygon edges
+  int n = polygon.size();
+  for (int i = 0; i < n && n >= 3; i++) {
+    const vec2 &a = polygon[i], &b = polygon[(i + 1) % n];
+    vec2 normal(b.y - a.y, a.x - b.x); // outward for counter-clockwise
+    float len = glm::length(normal);
+    if (len == 0) {
+      continue;
+    }
+    normal /= len;
+    // the rectangle corner deepest along -normal
+    vec2 nearest(normal.x > 0 ? low.x : high.x, normal.y > 0 ? low.y : high.y);
+    if (glm::dot(nearest - a, normal) > margin) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Split image plane of `w * h` into tiles of `tileSize`, and keep only those
+// covering some pixel within 1 pixel of the footprint `corners`.
+vector<Tile> footprintTiles(const vector<vec2> &corners, int w, int h,
+                            int tileSize) {
+  vector<vec2> hull = convexHull2D(corners);
+  vector<Tile> res;
+  for (int v0 = 0; v0 < h; v0 += tileSize) {
+    for (int u0 = 0; u0 < w; u0 += tileSize) {
+      Tile tile = {u0, v0, std::min(u0 + tileSize, w),
+                   std::min(v0 + tileSize, h)};
+      // rays start exactly at integer pixel positions
+      if (rectNearConvexPolygon(vec2(tile.u0, tile.v0),
+                                vec2(tile.u1 - 1, tile.v1 - 1), hull, 1.0f)) {
+        res.push_back(tile);
+      }
+    }
+  }
+  return res;
+}
+
+} // namespace zx
+
+#endif
@@ -0,0 +1,309 @@
+#pragma once
+
+// GPU ray marching engine for volume rendering
+// by z0gSh1u (Zhuo Xu) @ https://github.com/z0gSh1u/seu-viz
+// The volume is uploaded as 3D texture, either classified (RGBA8) or as is
+// (R16) with the transfer function as 1D texture, and every pixel of the image
+// plane is cast by a fragment of `fRayMarch.glsl` into an offscreen
+// framebuffer, which is then read back. The CPU engine stays the reference.
+
+#ifndef GPURAYCASTING_HPP_
+#define GPURAYCASTING_HPP_
+
+#include <glad/glad.h>
+#include <vector>
+#include <algorithm>
+#include "../framework/ReNow.hpp"
+#include "../framework/Utils.hpp"
+
+namespace zx {
+
+// Texture units of the samplers of `fRayMarch.glsl`, and a scratch unit for
+// other textures, e.g. render targets, so that binding them leaves the
+// samplers alone.
+enum GPUTextureUnit {
+  UNIT_COLORED_VOLUME,
+  UNIT_RAW_VOLUME,
+  UNIT_TRANSFER_FUNCTION,
+  UNIT_SCRATCH,
+};
+
+// Ray caster running in fragment shader. Needs a current GL context.
+class GPURayCaster {
+private:
+  ReNowHelper *_helper = nullptr;
+  GL_PROGRAM_ID _program = 0;
+  GL_OBJECT_ID _quadVAO = 0, _quadVBO = 0;
+  // sampled textures, each bound at its unit of GPUTextureUnit
+  GL_OBJECT_ID _coloredVolume = 0, _rawVolume = 0, _transferFunction = 0;
+  // storage of 3D textures, reused if fit
+  glm::ivec3 _coloredSize = glm::ivec3(0), _rawSize = glm::ivec3(0);
+  int _transferFunctionSize = 1;
+  // offscreen targets: color, and ray statistics (samples, hit)
+  GL_OBJECT_ID _framebuffer = 0, _colorTarget = 0, _statsTarget = 0;
+  int _targetWidth = 0, _targetHeight = 0;
+  vector<RGBAColor> _colorPixels;
+  vector<vec2> _statsPixels;
+
+  // Make `tex` current at texture unit `unit`.
+  void _bindTexture(GLenum target, GL_OBJECT_ID tex, GPUTextureUnit unit) {
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(target, tex);
+  }
+
+  // Create texture of `target` at `unit` with linear filtering clamped to
+  // edge.
+  GL_OBJECT_ID _createTexture(GLenum target, GPUTextureUnit unit) {
+    GL_OBJECT_ID tex;
+    glGenTextures(1, &tex);
+    ASSERT(tex > 0, "Create texture failed.");
+    _bindTexture(target, tex, unit);
+    glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(target, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    return tex;
+  }
+
+  // Bind 3D texture `tex` at `unit` with storage of `w * h * d` in
+  // `internalFormat`, specified again only if `size` differs, e.g. not for
+  // the next frame of a time-varying volume.
+  void _prepareVolumeTexture(GL_OBJECT_ID tex, GPUTextureUnit unit,
+                             glm::ivec3 &size, GLint internalFormat,
+                             GLenum format, GLenum type, int w, int h,
+                             int d) {
+    _bindTexture(GL_TEXTURE_3D, tex, unit);
+    if (size == glm::ivec3(w, h, d)) {
+      return;
+    }
+    _checkVolumeSize(w, h, d);
+    glTexImage3D(GL_TEXTURE_3D, 0, internalFormat, w, h, d, 0, format, type,
+                 nullptr);
+    size = glm::ivec3(w, h, d);
+  }
+
+  // Check that a volume of `w * h * d` fits in 3D texture.
+  void _checkVolumeSize(int w, int h, int d) {
+    GLint maxSize = 0;
+    glGetIntegerv(GL_MAX_3D_TEXTURE_SIZE, &maxSize);
+    ASSERT(w <= maxSize && h <= maxSize && d <= maxSize,
+           "[ERROR] Volume exceeds max 3D texture size " +
+               std::to_string(maxSize) + ".");
+  }
+
+  // (Re)create offscreen targets of `w * h` if their size differs.
+  void _prepareTargets(int w, int h) {
+    if (_framebuffer != 0 && w == _targetWidth && h == _targetHeight) {
+      return;
+    }
+    _releaseTargets();
+    glGenFramebuffers(1, &_framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, _framebuffer);
+    GL_OBJECT_ID *targets[2] = {&_colorTarget, &_statsTarget};
+    GLint formats[2] = {GL_RGBA32F, GL_RG32F};
+    GLenum channels[2] = {GL_RGBA, GL_RG};
+    for (int i = 0; i < 2; i++) {
+      glGenTextures(1, targets[i]);
+      _bindTexture(GL_TEXTURE_2D, *targets[i], UNIT_SCRATCH);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      glTexImage2D(GL_TEXTURE_2D, 0, formats[i], w, h, 0, channels[i],
+                   GL_FLOAT, nullptr);
+      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i,
+                             GL_TEXTURE_2D, *targets[i], 0);
+    }
+    ASSERT(glCheckFramebufferStatus(GL_FRAMEBUFFER) ==
+               GL_FRAMEBUFFER_COMPLETE,
+           "[ERROR] Offscreen framebuffer is incomplete.");
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    _targetWidth = w, _targetHeight = h;
+    _colorPixels.resize((size_t)w * h);
+    _statsPixels.resize((size_t)w * h);
+  }
+
+  void _releaseTargets() {
+    if (_framebuffer != 0) {
+      glDeleteFramebuffers(1, &_framebuffer);
+      glDeleteTextures(1, &_colorTarget);
+      glDeleteTextures(1, &_statsTarget);
+      _framebuffer = _colorTarget = _statsTarget = 0;
+    }
+  }
+
+public:
+  // Whether `init` has been called.
+  bool ready() const { return _program != 0; }
+
+  // Build the program from shader files, and create textures and the quad
+  // covering image plane. Programs and VAOs are switched through `helper`.
+  void init(ReNowHelper &helper, const string &vShaderPath,
+            const string &fShaderPath) {
+    _helper = &helper;
+    _program = helper.createProgram(
+        helper.createShader(GL_VERTEX_SHADER, vShaderPath),
+        helper.createShader(GL_FRAGMENT_SHADER, fShaderPath));
+    // every sampler always has a texture at its own unit, even if empty,
+    // since samplers of different types must not share a unit
+    _coloredVolume = _createTexture(GL_TEXTURE_3D, UNIT_COLORED_VOLUME);
+    _rawVolume = _createTexture(GL_TEXTURE_3D, UNIT_RAW_VOLUME);
+    _transferFunction = _createTexture(GL_TEXTURE_1D, UNIT_TRANSFER_FUNCTION);
+
+    static float quad[8] = {-1, -1, 1, -1, 1, 1, -1, 1};
+    _quadVAO = helper.createVAO();
+    _quadVBO = helper.createVBO();
+    helper.switchProgram(_program);
+    helper.switchVAO(_quadVAO);
+    helper.switchVBO(_quadVBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+    GL_ATTRIB_LOC loc = helper.getAttributeLocation("aPosition");
+    glVertexAttribPointer(loc, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+    glEnableVertexAttribArray(loc);
+    helper.switchVAO(0);
+  }
+
+  // Upload classified volume of `w * h * d` as RGBA8, converted slab by slab
+  // to keep the staging buffer small.
+  void uploadColoredVolume(const RGBAColor *coloredVolumeData, int w, int h,
+                           int d) {
+    _prepareVolumeTexture(_coloredVolume, UNIT_COLORED_VOLUME, _coloredSize,
+                          GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, w, h, d);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    size_t pixelPerSlice = (size_t)w * h;
+    int slab = std::max(1, int((64 << 20) / (pixelPerSlice * 4)));
+    vector<uint8> staging(pixelPerSlice * std::min(slab, d) * 4);
+    for (int z0 = 0; z0 < d; z0 += slab) {
+      int n = std::min(slab, d - z0);
+      const RGBAColor *src = coloredVolumeData + pixelPerSlice * z0;
+      for (size_t i = 0; i < pixelPerSlice * n; i++) {
+        for (int j = 0; j < 4; j++) {
+          staging[i * 4 + j] =
+              uint8(minmaxClip(src[i][j], 0, 1) * 255.0f + 0.5f);
+        }
+      }
+      glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, z0, w, h, n, GL_RGBA,
+                      GL_UNSIGNED_BYTE, staging.data());
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  }
+
+  // Upload volume of `w * h * d` as is (R16), for lighting and for
+  // classifying on GPU.
+  void uploadRawVolume(const uint16 *volumeData, int w, int h, int d) {
+    _prepareVolumeTexture(_rawVolume, UNIT_RAW_VOLUME, _rawSize, GL_R16,
+                          GL_RED, GL_UNSIGNED_SHORT, w, h, d);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, w, h, d, GL_RED,
+                    GL_UNSIGNED_SHORT, volumeData);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  }
+
+  // Max # colors of transfer function texture.
+  int maxTransferFunctionSize() const {
+    GLint maxSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+    return maxSize;
+  }
+
+  // Upload transfer function as colors of values 0 ~ lut.size() - 1. Larger
+  // values take the last color.
+  void uploadTransferFunction(const vector<RGBAColor> &lut) {
+    _bindTexture(GL_TEXTURE_1D, _transferFunction, UNIT_TRANSFER_FUNCTION);
+    glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA32F, (GLsizei)lut.size(), 0, GL_RGBA,
+                 GL_FLOAT, lut.data());
+    _transferFunctionSize = (int)lut.size();
+  }
+
+  // Render the image plane of `w * h` with the same geometry as CPU ray
+  // casting, and store pixel (u, v) at `imagePlane[(h - 1 - v) * w + u]`.
+  // Samples are taken from the classified volume if `classified`, else
+  // classified by the transfer function. Returns the number of samples taken,
+  // with the number of rays hitting the bounding box in `intersectCount`.
+  // Current program of helper is left switched to this one.
+  long long render(const mat3 &rotateMat, const vec3 &translateVec,
+                   const vec3 &spacing, const vec3 &bbox, float samplingDelta,
+                   bool classified, bool enableLighting, float kAmbient, int w,
+                   int h, RGBAColor *imagePlane, const RGBAColor &background,
+                   int &intersectCount) {
+    ReNowHelper &helper = *_helper;
+    _prepareTargets(w, h);
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glBindFramebuffer(GL_FRAMEBUFFER, _framebuffer);
+    GLenum drawBuffers[2] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+    glDrawBuffers(2, drawBuffers);
+    glViewport(0, 0, w, h);
+
+    // bind again, in case other code changed the units
+    _bindTexture(GL_TEXTURE_3D, _coloredVolume, UNIT_COLORED_VOLUME);
+    _bindTexture(GL_TEXTURE_3D, _rawVolume, UNIT_RAW_VOLUME);
+    _bindTexture(GL_TEXTURE_1D, _transferFunction, UNIT_TRANSFER_FUNCTION);
+
+    helper.switchProgram(_program);
+    helper.setUniform(helper.getUniformLocation("uRotateMat"), rotateMat);
+    helper.setUniform(helper.getUniformLocation("uTranslate"), translateVec);
+    helper.setUniform(helper.getUniformLocation("uSpacing"), spacing);
+    helper.setUniform(helper.getUniformLocation("uBBox"), bbox);
+    helper.setUniform(helper.getUniformLocation("uSamplingDelta"),
+                      samplingDelta);
+    helper.setUniform(helper.getUniformLocation("uBackground"), background);
+    helper.setUniform(helper.getUniformLocation("uClassified"),
+                      (int)classified);
+    helper.setUniform(helper.getUniformLocation("uColoredVolume"),
+                      (int)UNIT_COLORED_VOLUME);
+    helper.setUniform(helper.getUniformLocation("uRawVolume"),
+                      (int)UNIT_RAW_VOLUME);
+    helper.setUniform(helper.getUniformLocation("uTransferFunction"),
+                      (int)UNIT_TRANSFER_FUNCTION);
+    helper.setUniform(helper.getUniformLocation("uTransferFunctionSize"),
+                      (float)_transferFunctionSize);
+    helper.setUniform(helper.getUniformLocation("uEnableLighting"),
+                      (int)enableLighting);
+    helper.setUniform(helper.getUniformLocation("uKAmbient"), kAmbient);
+    helper.switchVAO(_quadVAO);
+    helper.drawArrays(GL_TRIANGLE_FAN, 0, 4);
+    helper.switchVAO(0);
+
+    // read back, which waits for the rendering
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glReadPixels(0, 0, w, h, GL_RGBA, GL_FLOAT, _colorPixels.data());
+    glReadBuffer(GL_COLOR_ATTACHMENT1);
+    glReadPixels(0, 0, w, h, GL_RG, GL_FLOAT, _statsPixels.data());
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDrawBuffer(GL_BACK);
+    glReadBuffer(GL_BACK);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+    // rows are read bottom (v = 0) first
+    long long samples = 0;
+    intersectCount = 0;
+    for (int v = 0; v < h; v++) {
+      std::copy(_colorPixels.begin() + (size_t)v * w,
+                _colorPixels.begin() + (size_t)(v + 1) * w,
+                imagePlane + (size_t)(h - 1 - v) * w);
+    }
+    for (const auto &stats : _statsPixels) {
+      samples += (long long)stats.x;
+      intersectCount += stats.y > 0 ? 1 : 0;
+    }
+    return samples;
+  }
+
+  // Delete GL objects other than those created through helper.
+  void release() {
+    _releaseTargets();
+    GL_OBJECT_ID textures[3] = {_coloredVolume, _rawVolume, _transferFunction};
+    if (_program != 0) {
+      glDeleteTextures(3, textures);
+      glDeleteProgram(_program);
+    }
+    _coloredVolume = _rawVolume = _transferFunction = 0;
+    _coloredSize = _rawSize = glm::ivec3(0);
+    _program = 0;
+  }
+};
+
+} // namespace zx
+
+#endif
@@ -0,0 +1,313 @@
+#pragma once
+
+// Cache of rendered image planes for Ray Casting
+// by z0gSh1u (Zhuo Xu) @ https://github.com/z0gSh1u/seu-viz
+// Keeps recently rendered image planes in memory, keyed by everything that
+// determines them, and evicts the least recently used ones beyond a byte
+// budget. Evicted image planes can be spilled to disk and brought back.
+
+#ifndef IMAGECACHE_HPP_
+#define IMAGECACHE_HPP_
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <direct.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include <list>
+#include <ctime>
+#include <memory>
+#include <cstdio>
+#include <vector>
+#include <tuple>
+#include <fstream>
+#include <algorithm>
+#include <unordered_map>
+#include "../framework/ReNow.hpp"
+#include "../framework/Utils.hpp"
+
+using std::shared_ptr;
+
+// bump when what rendering produces, or the layout of spill files, changes,
+// so that image planes spilled by earlier builds are not served
+#define IMAGE_CACHE_VERSION 1
+
+namespace zx {
+
+// Rendered image plane, before and after filtering.
+struct CachedImagePlane {
+  int width, height;
+  vector<RGBAColor> unfiltered;
+  int filterKSize = -1;       // what `filtered` is filtered with, -1 if none
+  vector<RGBAColor> filtered; // empty if not filtered
+
+  size_t bytes() const {
+    return (unfiltered.size() + filtered.size()) * sizeof(RGBAColor);
+  }
+};
+
+// Counters of cache lookups.
+struct ImageCacheStats {
+  long long hits = 0;      // found in memory or on disk
+  long long diskHits = 0;  // found on disk
+  long long misses = 0;    // found nowhere
+  long long evictions = 0; // dropped from memory
+  long long spills = 0;    // written to disk when dropped from memory
+};
+
+// 64-bit FNV-1a hash, stable across runs for spill file names.
+unsigned long long _fnv1a(const string &str) {
+  unsigned long long hash = 14695981039346656037ULL;
+  for (unsigned char c : str) {
+    hash = (hash ^ c) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Create directory `path` if not present.
+void _makeDirectory(const string &path) {
+#ifdef _WIN32
+  _mkdir(path.c_str());
+#else
+  mkdir(path.c_str(), 0755);
+#endif
+}
+
+// Files of directory `dir` named with `suffix`, as (modification time, path,
+// bytes).
+vector<std::tuple<time_t, string, size_t>>
+_listFiles(const string &dir, const string &suffix) {
+  vector<std::tuple<time_t, string, size_t>> res;
+  auto matches = [&](const string &name) {
+    return name.size() > suffix.size() &&
+           name.compare(name.size() - suffix.size(), suffix.size(), suffix) ==
+               0;
+  };
+#ifdef _WIN32
+  WIN32_FIND_DATAA found;
+  HANDLE h = FindFirstFileA((dir + "/*" + suffix).c_str(), &found);
+  if (h == INVALID_HANDLE_VALUE) {
+    return res;
+  }
+  do {
+    string name = found.cFileName;
+    if (!(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && matches(name)) {
+      // FILETIME is in 100 ns since 1601
+      ULARGE_INTEGER t;
+      t.LowPart = found.ftLastWriteTime.dwLowDateTime;
+      t.HighPart = found.ftLastWriteTime.dwHighDateTime;
+      res.emplace_back(time_t(t.QuadPart / 10000000ULL - 11644473600ULL),
+                       dir + "/" + name,
+                       ((size_t)found.nFileSizeHigh << 32) |
+                           found.nFileSizeLow);
+    }
+  } while (FindNextFileA(h, &found));
+  FindClose(h);
+#else
+  DIR *d = opendir(dir.c_str());
+  if (d == nullptr) {
+    return res;
+  }
+  while (dirent *entry = readdir(d)) {
+    string name = entry->d_name, path = dir + "/" + name;
+    struct stat info;
+    if (matches(name) && stat(path.c_str(), &info) == 0 &&
+        S_ISREG(info.st_mode)) {
+      res.emplace_back(info.st_mtime, path, (size_t)info.st_size);
+    }
+  }
+  closedir(d);
+#endif
+  return res;
+}
+
+// LRU cache of image planes, bounded in bytes.
+class ImagePlaneCache {
+private:
+  typedef std::pair<string, shared_ptr<CachedImagePlane>> _Item;
+  std::list<_Item> _items; // most recently used first
+  std::unordered_map<string, std::list<_Item>::iterator> _index;
+  size_t _bytes = 0, _budget = 0;
+  // disk spilling, disabled if `_spillDir` is empty
+  string _spillDir;
+  size_t _diskBytes = 0, _diskBudget = 0;
+  std::list<std::pair<string, size_t>> _spilled; // path, bytes, oldest first
+  ImageCacheStats _stats;
+
+  string _spillPath(const string &key) const {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.plane", _fnv1a(key));
+    return _spillDir + "/" + name;
+  }
+
+  // Write `entry` to disk, dropping the oldest spilled files beyond budget.
+  void _spill(const string &key, const CachedImagePlane &entry) {
+    if (_spillDir.empty() || entry.bytes() > _diskBudget) {
+      return;
+    }
+    string path = _spillPath(key);
+    // it may have been spilled before, then read back
+    for (auto it = _spilled.begin(); it != _spilled.end(); ++it) {
+      if (it->first == path) {
+        _diskBytes -= it->second;
+        _spilled.erase(it);
+        break;
+      }
+    }
+    std::ofstream s(path, ios::binary);
+    if (!s.good()) {
+      return;
+    }
+    int header[5] = {(int)key.size(), entry.width, entry.height,
+                     entry.filterKSize, (int)entry.filtered.size()};
+    s.write(key.data(), key.size());
+    s.write((const char *)header, sizeof(header));
+    s.write((const char *)entry.unfiltered.data(),
+            entry.unfiltered.size() * sizeof(RGBAColor));
+    s.write((const char *)entry.filtered.data(),
+            entry.filtered.size() * sizeof(RGBAColor));
+    _spilled.push_back({path, entry.bytes()});
+    _diskBytes += entry.bytes();
+    _stats.spills++;
+    _trimSpilled();
+  }
+
+  // Delete the oldest spilled files beyond budget.
+  void _trimSpilled() {
+    while (_diskBytes > _diskBudget) {
+      std::remove(_spilled.front().first.c_str());
+      _diskBytes -= _spilled.front().second;
+      _spilled.pop_front();
+    }
+  }
+
+  // Take over files spilled by earlier runs into `_spillDir`, oldest first,
+  // so that they count against the disk budget as well.
+  void _scanSpilled() {
+    auto files = _listFiles(_spillDir, ".plane");
+    std::sort(files.begin(), files.end());
+    for (auto &file : files) {
+      _spilled.push_back({std::get<1>(file), std::get<2>(file)});
+      _diskBytes += std::get<2>(file);
+    }
+  }
+
+  // Read entry of `key` from disk, which must be `width` x `height`. Returns
+  // nullptr if not there, or if the file is not such an entry.
+  shared_ptr<CachedImagePlane> _unspill(const string &key, int width,
+                                        int height) const {
+    if (_spillDir.empty()) {
+      return nullptr;
+    }
+    std::ifstream s(_spillPath(key), ios::binary);
+    string stored(key.size(), 0);
+    int header[5];
+    // the key is stored first, since names may collide
+    if (!s.read(&stored[0], key.size()) || stored != key ||
+        !s.read((char *)header, sizeof(header)) ||
+        header[0] != (int)key.size()) {
+      return nullptr;
+    }
+    // check sizes before allocating, the file may be corrupt or foreign
+    int pixels = width * height;
+    if (header[1] != width || header[2] != height ||
+        (header[4] != 0 && header[4] != pixels)) {
+      return nullptr;
+    }
+    auto entry = std::make_shared<CachedImagePlane>();
+    entry->width = header[1], entry->height = header[2];
+    entry->filterKSize = header[3];
+    entry->unfiltered.resize((size_t)entry->width * entry->height);
+    entry->filtered.resize(header[4]);
+    s.read((char *)entry->unfiltered.data(),
+           entry->unfiltered.size() * sizeof(RGBAColor));
+    s.read((char *)entry->filtered.data(),
+           entry->filtered.size() * sizeof(RGBAColor));
+    return s ? entry : nullptr;
+  }
+
+  // Drop least recently used entries beyond budget.
+  void _evict() {
+    while (_bytes > _budget && !_items.empty()) {
+      _Item &last = _items.back();
+      _spill(last.first, *last.second);
+      _bytes -= last.second->bytes();
+      _index.erase(last.first);
+      _items.pop_back();
+      _stats.evictions++;
+    }
+  }
+
+public:
+  // Set budgets (MiB), and the directory to spill evicted entries into
+  // (disabled if empty). Files already in the directory count against the
+  // disk budget. Entries and files beyond the new budgets are dropped.
+  void configure(int budgetMB, const string &spillDir, int diskBudgetMB) {
+    _budget = (size_t)std::max(budgetMB, 0) << 20;
+    _diskBudget = (size_t)std::max(diskBudgetMB, 0) << 20;
+    if (spillDir != _spillDir) {
+      _spilled.clear();
+      _diskBytes = 0;
+      _spillDir = spillDir;
+      if (!_spillDir.empty()) {
+        _makeDirectory(_spillDir);
+        _scanSpilled();
+      }
+    }
+    _trimSpilled();
+    _evict();
+  }
+
+  // Find entry of `key` for an image plane of `width` x `height`, from memory
+  // first, then from disk. Returns nullptr on miss.
+  shared_ptr<CachedImagePlane> find(const string &key, int width,
+                                    int height) {
+    auto it = _index.find(key);
+    if (it != _index.end()) {
+      // move to front as most recently used
+      _items.splice(_items.begin(), _items, it->second);
+      _stats.hits++;
+      return it->second->second;
+    }
+    auto entry = _unspill(key, width, height);
+    if (entry == nullptr) {
+      _stats.misses++;
+      return nullptr;
+    }
+    _stats.hits++;
+    _stats.diskHits++;
+    put(key, entry);
+    return entry;
+  }
+
+  // Insert or replace entry of `key`. Call again after the entry grows, to
+  // account for its size.
+  void put(const string &key, const shared_ptr<CachedImagePlane> &entry) {
+    auto it = _index.find(key);
+    if (it != _index.end()) {
+      _bytes -= it->second->second->bytes();
+      _items.erase(it->second);
+    }
+    _items.push_front({key, entry});
+    _index[key] = _items.begin();
+    _bytes += entry->bytes();
+    _evict();
+  }
+
+  const ImageCacheStats &stats() const { return _stats; }
+  size_t size() const { return _items.size(); }
+  size_t bytes() const { return _bytes; }
+};
+
+} // namespace zx
+
+#endif
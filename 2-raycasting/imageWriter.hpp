@@ -0,0 +1,328 @@
+#pragma once
+
+// Image writer for Ray Casting
+// by z0gSh1u (Zhuo Xu) @ https://github.com/z0gSh1u/seu-viz
+// Image planes are converted to 8 or 16 bits by several threads, and then
+// queued for a background thread, which encodes them as PPM or PNG files, or
+// appends them to a Y4M stream. Rendering never waits for disk: when the
+// queue is full, the frame is dropped and counted instead.
+
+#ifndef IMAGEWRITER_HPP_
+#define IMAGEWRITER_HPP_
+
+#include <zlib.h>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <condition_variable>
+#include "../framework/ReNow.hpp"
+#include "../framework/Utils.hpp"
+
+namespace zx {
+
+#define Y4M_FRAME_RATE 25
+
+enum ImageFormat { FORMAT_PPM, FORMAT_PNG, FORMAT_Y4M };
+
+// Format by extension of `path`.
+ImageFormat imageFormatOfPath(const string &path) {
+  string ext = path.substr(path.find_last_of('.') + 1);
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  if (ext == "ppm") {
+    return FORMAT_PPM;
+  } else if (ext == "png") {
+    return FORMAT_PNG;
+  }
+  ASSERT(ext == "y4m", "[ERROR] Unsupported output format: " + path);
+  return FORMAT_Y4M;
+}
+
+// Replace the first run of '#' in `pattern` with zero-padded `index`, e.g.
+// "frame_####.png" -> "frame_0042.png".
+string numberedPath(const string &pattern, long long index) {
+  size_t begin = pattern.find('#');
+  if (begin == string::npos) {
+    return pattern;
+  }
+  size_t end = pattern.find_first_not_of('#', begin);
+  end = end == string::npos ? pattern.size() : end;
+  string number = std::to_string(index);
+  if (number.size() < end - begin) {
+    number.insert(0, end - begin - number.size(), '0');
+  }
+  return pattern.substr(0, begin) + number + pattern.substr(end);
+}
+
+// Image converted for writing. PPM and PNG hold interleaved RGB samples of
+// `bitDepth` (16-bit ones are big-endian), Y4M holds 8-bit Y, U and V planes
+// (4:4:4). Rows are top first.
+struct ImageFrame {
+  string path;
+  ImageFormat format;
+  int width, height, bitDepth;
+  vector<unsigned char> data;
+};
+
+// Convert image plane `src` (bottom row first) of w*h to `frame`, by
+// `nThreads` threads, each converting some rows.
+void convertImagePlane(const RGBAColor *src, int w, int h, int nThreads,
+                       ImageFrame &frame) {
+  frame.width = w, frame.height = h;
+  if (frame.format == FORMAT_Y4M) {
+    frame.bitDepth = 8;
+  }
+  int bytesPerSample = frame.bitDepth / 8, maxValue = (1 << frame.bitDepth) - 1;
+  frame.data.resize((size_t)w * h * 3 * bytesPerSample);
+  unsigned char *dst = frame.data.data();
+  auto clamp01 = [](float x) { return std::min(std::max(x, 0.0f), 1.0f); };
+  auto quantize = [=](float x) { return int(clamp01(x) * maxValue + 0.5f); };
+
+  auto convertRows = [&](int low, int high) {
+    for (int r = low; r < high; r++) {
+      const RGBAColor *row = src + (size_t)(h - 1 - r) * w;
+      for (int c = 0; c < w; c++) {
+        const RGBAColor &p = row[c];
+        size_t i = (size_t)r * w + c;
+        if (frame.format == FORMAT_Y4M) {
+          // BT.601, studio swing
+          float red = clamp01(p.r), green = clamp01(p.g),
+                blue = clamp01(p.b);
+          float y = 0.299f * red + 0.587f * green + 0.114f * blue;
+          size_t plane = (size_t)w * h;
+          dst[i] = (unsigned char)(16 + 219 * y + 0.5f);
+          dst[plane + i] =
+              (unsigned char)(128 + 224 * 0.564f * (blue - y) + 0.5f);
+          dst[plane * 2 + i] =
+              (unsigned char)(128 + 224 * 0.713f * (red - y) + 0.5f);
+        } else {
+          int values[3] = {quantize(p.r), quantize(p.g), quantize(p.b)};
+          unsigned char *out = dst + i * 3 * bytesPerSample;
+          for (int k = 0; k < 3; k++) {
+            if (bytesPerSample == 2) {
+              *out++ = (unsigned char)(values[k] >> 8);
+            }
+            *out++ = (unsigned char)(values[k] & 0xFF);
+          }
+        }
+      }
+    }
+  };
+
+  nThreads = std::max(1, std::min(nThreads, h));
+  vector<std::thread> workers;
+  for (int i = 1; i < nThreads; i++) {
+    workers.push_back(
+        std::thread(convertRows, h * i / nThreads, h * (i + 1) / nThreads));
+  }
+  convertRows(0, h / nThreads);
+  for (auto &t : workers) {
+    t.join();
+  }
+}
+
+void _appendBigEndian32(vector<unsigned char> &buf, unsigned int x) {
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    buf.push_back((unsigned char)(x >> shift));
+  }
+}
+
+// Append PNG chunk of `type` with `data` to `buf`.
+void _appendPNGChunk(vector<unsigned char> &buf, const char *type,
+                     const unsigned char *data, size_t size) {
+  _appendBigEndian32(buf, (unsigned int)size);
+  size_t begin = buf.size();
+  buf.insert(buf.end(), type, type + 4);
+  buf.insert(buf.end(), data, data + size);
+  _appendBigEndian32(buf, (unsigned int)crc32(0, buf.data() + begin,
+                                              (uInt)(size + 4)));
+}
+
+// Encode `frame` as PNG. Rows are filtered by Sub, which suits the smooth
+// background and shading of rendered images. Throws runtime_error if zlib
+// fails.
+vector<unsigned char> encodePNG(const ImageFrame &frame) {
+  size_t pixelBytes = 3 * frame.bitDepth / 8,
+         rowBytes = frame.width * pixelBytes;
+  vector<unsigned char> filtered((rowBytes + 1) * frame.height);
+  for (int r = 0; r < frame.height; r++) {
+    const unsigned char *row = frame.data.data() + r * rowBytes;
+    unsigned char *out = filtered.data() + r * (rowBytes + 1);
+    *out++ = 1; // Sub
+    for (size_t i = 0; i < rowBytes; i++) {
+      out[i] = (unsigned char)(row[i] - (i >= pixelBytes ? row[i - pixelBytes]
+                                                         : 0));
+    }
+  }
+  uLongf compressedSize = compressBound((uLong)filtered.size());
+  vector<unsigned char> compressed(compressedSize);
+  int status = compress2(compressed.data(), &compressedSize, filtered.data(),
+                         (uLong)filtered.size(), Z_BEST_SPEED);
+  if (status != Z_OK) {
+    ASSERT(false, "[ERROR] Cannot compress PNG: zlib error " +
+                      std::to_string(status) + ".");
+  }
+
+  const unsigned char signature[8] = {0x89, 'P',  'N',  'G',
+                                      '\r', '\n', 0x1A, '\n'};
+  vector<unsigned char> png(signature, signature + 8), header;
+  _appendBigEndian32(header, frame.width);
+  _appendBigEndian32(header, frame.height);
+  // bit depth, color type RGB, deflate, adaptive filtering, no interlace
+  header.insert(header.end(), {(unsigned char)frame.bitDepth, 2, 0, 0, 0});
+  _appendPNGChunk(png, "IHDR", header.data(), header.size());
+  _appendPNGChunk(png, "IDAT", compressed.data(), compressedSize);
+  _appendPNGChunk(png, "IEND", nullptr, 0);
+  return png;
+}
+
+// Encode `frame` as a PPM or PNG file.
+vector<unsigned char> encodeImageFrame(const ImageFrame &frame) {
+  if (frame.format == FORMAT_PNG) {
+    return encodePNG(frame);
+  }
+  ASSERT(frame.format == FORMAT_PPM, "[ERROR] Not an image file format.");
+  string header = "P6\n" + std::to_string(frame.width) + " " +
+                  std::to_string(frame.height) + "\n" +
+                  std::to_string((1 << frame.bitDepth) - 1) + "\n";
+  vector<unsigned char> ppm(header.begin(), header.end());
+  ppm.insert(ppm.end(), frame.data.begin(), frame.data.end());
+  return ppm;
+}
+
+// Writes queued frames by a background thread.
+class AsyncImageWriter {
+private:
+  std::thread _thread;
+  std::mutex _mutex;
+  std::condition_variable _queued, _drained;
+  std::deque<ImageFrame> _queue;
+  size_t _capacity = 16;
+  bool _stopping = false, _busy = false;
+  long long _written = 0, _dropped = 0;
+  // Y4M stream being appended
+  std::ofstream _stream;
+  string _streamPath;
+  int _streamWidth = 0, _streamHeight = 0;
+
+  // Write `frame`. Returns false if it fails, which is reported.
+  bool _write(const ImageFrame &frame) {
+    if (frame.format == FORMAT_Y4M) {
+      if (frame.path != _streamPath) {
+        _stream.close();
+        _stream.open(frame.path, ios::binary);
+        _streamPath = frame.path;
+        _streamWidth = frame.width, _streamHeight = frame.height;
+        _stream << "YUV4MPEG2 W" << frame.width << " H" << frame.height
+                << " F" << Y4M_FRAME_RATE << ":1 Ip A1:1 C444\n";
+      }
+      if (frame.width != _streamWidth || frame.height != _streamHeight) {
+        std::cerr << "[WARN] Frame size differs from Y4M stream, skipped."
+                  << std::endl;
+        return false;
+      }
+      _stream << "FRAME\n";
+      _stream.write((const char *)frame.data.data(), frame.data.size());
+      _stream.flush();
+      if (!_stream.good()) {
+        std::cerr << "[WARN] Failed to write " << frame.path << std::endl;
+        return false;
+      }
+      return true;
+    }
+
+    // encode first, so that a failed frame leaves no partial file
+    vector<unsigned char> encoded;
+    try {
+      encoded = encodeImageFrame(frame);
+    } catch (const std::runtime_error &) {
+      std::cerr << "[WARN] Failed to encode " << frame.path << std::endl;
+      return false;
+    }
+    std::ofstream file(frame.path, ios::binary);
+    file.write((const char *)encoded.data(), encoded.size());
+    if (!file.good()) {
+      std::cerr << "[WARN] Failed to write " << frame.path << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  void _run() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+      _queued.wait(lock, [this]() { return _stopping || !_queue.empty(); });
+      if (_queue.empty()) {
+        return; // stopping and drained
+      }
+      ImageFrame frame = std::move(_queue.front());
+      _queue.pop_front();
+      _busy = true;
+      lock.unlock();
+      bool written = _write(frame);
+      lock.lock();
+      _busy = false;
+      _written += written;
+      _drained.notify_all();
+    }
+  }
+
+public:
+  // Write what is queued before leaving.
+  ~AsyncImageWriter() {
+    if (_thread.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+      }
+      _queued.notify_one();
+      _thread.join();
+    }
+  }
+
+  // Set # frames that can wait for writing.
+  void setCapacity(size_t capacity) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _capacity = std::max(capacity, (size_t)1);
+  }
+
+  // Queue `frame` for writing. Returns false if the queue is full, and the
+  // frame is dropped.
+  bool push(ImageFrame &&frame) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (_queue.size() >= _capacity) {
+        _dropped++;
+        return false;
+      }
+      _queue.push_back(std::move(frame));
+      if (!_thread.joinable()) {
+        _thread = std::thread(&AsyncImageWriter::_run, this);
+      }
+    }
+    _queued.notify_one();
+    return true;
+  }
+
+  // Wait until every queued frame is written.
+  void flush() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _drained.wait(lock, [this]() { return _queue.empty() && !_busy; });
+  }
+
+  long long written() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _written;
+  }
+  long long dropped() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _dropped;
+  }
+};
+
+} // namespace zx
+
+#endif
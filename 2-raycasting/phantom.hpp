@@ -0,0 +1,153 @@
+#pragma once
+
+// Procedural volume phantoms for Ray Casting
+// by z0gSh1u (Zhuo Xu) @ https://github.com/z0gSh1u/seu-viz
+// Generates volume data of arbitrary size, so that rendering can be
+// benchmarked without shipping private scans.
+
+#ifndef PHANTOM_HPP_
+#define PHANTOM_HPP_
+
+#include <cmath>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include "../framework/ReNow.hpp"
+#include "../framework/Utils.hpp"
+
+// Phantom intensity p (0~1) is mapped to `PHANTOM_BASE + PHANTOM_SCALE * p`
+// inside the phantom, and 0 (air) outside, so that the CT transfer functions
+// apply to phantoms as well: the skull falls into the bone range, while the
+// brain falls into the muscle range.
+#define PHANTOM_BASE 1000
+#define PHANTOM_SCALE 700
+
+namespace zx {
+
+// Ellipsoid component of a phantom, in normalized coordinates [-1, 1]^3.
+struct PhantomEllipsoid {
+  float A;               // additive intensity
+  float a, b, c;         // semi-axes
+  float x0, y0, z0;      // center
+  float phi, theta, psi; // Euler angles (DEG)
+};
+
+// Modified 3D Shepp-Logan phantom (higher contrast than the original).
+// @see A. C. Kak and M. Slaney. "Principles of Computerized Tomographic
+// Imaging." 1988.
+// @see M. Schabel. "3D Shepp-Logan phantom." MATLAB Central, 2005.
+const vector<PhantomEllipsoid> SheppLogan3D = {
+    // A     a       b      c      x0     y0       z0     phi  theta psi
+    {1.0, 0.6900, 0.920, 0.810, 0.00, 0.0000, 0.00, 0, 0, 0},
+    {-0.8, 0.6624, 0.874, 0.780, 0.00, -0.0184, 0.00, 0, 0, 0},
+    {-0.2, 0.1100, 0.310, 0.220, 0.22, 0.0000, 0.00, -18, 0, 10},
+    {-0.2, 0.1600, 0.410, 0.280, -0.22, 0.0000, 0.00, 18, 0, 10},
+    {0.1, 0.2100, 0.250, 0.410, 0.00, 0.3500, -0.15, 0, 0, 0},
+    {0.1, 0.0460, 0.046, 0.050, 0.00, 0.1000, 0.25, 0, 0, 0},
+    {0.1, 0.0460, 0.046, 0.050, 0.00, -0.1000, 0.25, 0, 0, 0},
+    {0.1, 0.0460, 0.023, 0.050, -0.08, -0.6050, 0.00, 0, 0, 0},
+    {0.1, 0.0230, 0.023, 0.020, 0.00, -0.6060, 0.00, 0, 0, 0},
+    {0.1, 0.0230, 0.046, 0.020, 0.06, -0.6050, 0.00, 0, 0, 0},
+};
+
+// Rotation (world -> ellipsoid local) of Euler angles in z-x-z convention.
+mat3 phantomRotation(const PhantomEllipsoid &e) {
+  float phi = radians(e.phi), theta = radians(e.theta), psi = radians(e.psi);
+  float cphi = cos(phi), sphi = sin(phi), ctheta = cos(theta),
+        stheta = sin(theta), cpsi = cos(psi), spsi = sin(psi);
+  // r0, r1, r2 are rows of the rotation matrix
+  vec3 r0(cpsi * cphi - ctheta * sphi * spsi,
+          cpsi * sphi + ctheta * cphi * spsi, spsi * stheta);
+  vec3 r1(-spsi * cphi - ctheta * sphi * cpsi,
+          -spsi * sphi + ctheta * cphi * cpsi, cpsi * stheta);
+  vec3 r2(stheta * sphi, -stheta * cphi, ctheta);
+  // glm takes them as columns, so `world * R` gives dot(world, r_i)
+  return mat3(r0, r1, r2);
+}
+
+// Fill slices [zLow, zHigh) of the phantom volume.
+void _generatePhantomSlices(const vector<PhantomEllipsoid> &ellipsoids, int w,
+                            int h, int d, int zLow, int zHigh,
+                            uint16 *store) {
+  int pixelPerSlice = w * h;
+  vector<float> intensity(pixelPerSlice);
+  vector<uint8> inside(pixelPerSlice);
+  // voxel index -> normalized coordinate
+  vec3 scale(2.0f / std::max(w - 1, 1), 2.0f / std::max(h - 1, 1),
+             2.0f / std::max(d - 1, 1));
+
+  for (int z = zLow; z < zHigh; z++) {
+    std::fill(intensity.begin(), intensity.end(), 0.0f);
+    std::fill(inside.begin(), inside.end(), 0);
+    float nz = z * scale.z - 1;
+
+    for (const auto &e : ellipsoids) {
+      mat3 rot = phantomRotation(e);
+      vec3 axes(e.a, e.b, e.c), center(e.x0, e.y0, e.z0);
+      // axis-aligned extent of the rotated ellipsoid in world space, so that
+      // only voxels near the ellipsoid are visited
+      vec3 worldCenter = rot * center, halfExtent;
+      for (int i = 0; i < 3; i++) {
+        halfExtent[i] = glm::length(vec3(rot[0][i] * axes[0],
+                                         rot[1][i] * axes[1],
+                                         rot[2][i] * axes[2]));
+      }
+      if (fabs(nz - worldCenter.z) > halfExtent.z) {
+        continue;
+      }
+      vec3 low = (worldCenter - halfExtent + 1.0f) / scale,
+           high = (worldCenter + halfExtent + 1.0f) / scale;
+      int xMin = std::max(0, int(low.x)),
+          xMax = std::min(w - 1, int(high.x) + 1),
+          yMin = std::max(0, int(low.y)),
+          yMax = std::min(h - 1, int(high.y) + 1);
+
+      for (int y = yMin; y <= yMax; y++) {
+        for (int x = xMin; x <= xMax; x++) {
+          vec3 local = vec3(x * scale.x - 1, y * scale.y - 1, nz) * rot;
+          vec3 q = (local - center) / axes;
+          if (glm::dot(q, q) <= 1) {
+            intensity[y * w + x] += e.A;
+            inside[y * w + x] = 1;
+          }
+        }
+      }
+    }
+
+    uint16 *slice = store + (size_t)pixelPerSlice * z;
+    for (int i = 0; i < pixelPerSlice; i++) {
+      slice[i] = inside[i] ? uint16(PHANTOM_BASE +
+                                    PHANTOM_SCALE *
+                                        minmaxClip(intensity[i], 0, 1))
+                           : 0;
+    }
+  }
+}
+
+// Generate a `w * h * d` phantom volume into `store`, using `nThreads`
+// threads over z-slices.
+void generatePhantom(const vector<PhantomEllipsoid> &ellipsoids, int w, int h,
+                     int d, uint16 *store, int nThreads = 1) {
+  nThreads = std::max(1, std::min(nThreads, d));
+  vector<std::thread> workers;
+  for (int i = 0; i < nThreads; i++) {
+    int zLow = d * i / nThreads, zHigh = d * (i + 1) / nThreads;
+    workers.push_back(std::thread(_generatePhantomSlices,
+                                  std::cref(ellipsoids), w, h, d, zLow, zHigh,
+                                  store));
+  }
+  for (auto &t : workers) {
+    t.join();
+  }
+}
+
+// Phantoms that can be referred to by name in config files.
+const vector<PhantomEllipsoid> &getPhantomByName(const string &name) {
+  ASSERT(name == "SheppLogan", "[ERROR] Invalid phantom: " + name);
+  return SheppLogan3D;
+}
+
+} // namespace zx
+
+#endif
@@ -0,0 +1,248 @@
+#pragma once
+
+// Incremental rendering pipeline for Ray Casting
+// by z0gSh1u (Zhuo Xu) @ https://github.com/z0gSh1u/seu-viz
+// Rendering is modeled as stages, each depending on the previous one. A change
+// invalidates the stage it affects, so only that stage and the ones after it
+// run again. The config file is watched, and its changed keys are mapped to
+// the stages they affect.
+
+#ifndef PIPELINE_HPP_
+#define PIPELINE_HPP_
+
+#include <rapidjson/document.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <ctime>
+#include <map>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include "../framework/ReNow.hpp"
+#include "../framework/Utils.hpp"
+
+using std::function;
+
+namespace zx {
+
+// Stages of rendering, in the order they run.
+enum PipelineStage {
+  STAGE_LOAD,     // read or generate volume data
+  STAGE_CLASSIFY, // apply transfer function
+  STAGE_ACCEL,    // build acceleration structures of the classified volume
+  STAGE_CAST,     // render the image plane
+  STAGE_FILTER,   // post-process the image plane
+  STAGE_UPLOAD,   // show the image plane
+  STAGE_WRITE,    // save the image plane
+  STAGE_COUNT,    // also means nothing to run
+};
+
+// Rendering pipeline of dependent stages.
+class RenderPipeline {
+private:
+  vector<string> _names = vector<string>(STAGE_COUNT);
+  vector<function<void()>> _jobs = vector<function<void()>>(STAGE_COUNT);
+  int _dirtyFrom = STAGE_LOAD; // the first stage to run
+  function<void(const string &)> _beforeStage;
+  function<void()> _afterStage;
+
+public:
+  // Set the job of `stage`.
+  void setStage(PipelineStage stage, const string &name,
+                const function<void()> &job) {
+    _names[stage] = name;
+    _jobs[stage] = job;
+  }
+
+  // Call `before` with the name of each stage run and `after` it, e.g. to
+  // profile stages.
+  void setStageHooks(const function<void(const string &)> &before,
+                     const function<void()> &after) {
+    _beforeStage = before;
+    _afterStage = after;
+  }
+
+  // Let `stage` and the stages after it run again.
+  void invalidate(PipelineStage stage) {
+    _dirtyFrom = std::min(_dirtyFrom, (int)stage);
+  }
+
+  // Whether some stage needs to run.
+  bool pending() const { return _dirtyFrom < STAGE_COUNT; }
+
+  // Run invalidated stages in order. A stage may invalidate any stage,
+  // which runs in turn.
+  void run() {
+    while (_dirtyFrom < STAGE_COUNT) {
+      int i = _dirtyFrom++;
+      if (_beforeStage) {
+        _beforeStage(_names[i]);
+      }
+      auto tic = std::chrono::steady_clock::now();
+      if (_jobs[i]) {
+        _jobs[i]();
+      }
+      auto toc = std::chrono::steady_clock::now();
+      if (_afterStage) {
+        _afterStage();
+      }
+      std::cout << "[Pipeline] " << _names[i] << ": "
+                << std::chrono::duration<double>(toc - tic).count()
+                << " secs." << std::endl;
+    }
+  }
+};
+
+// The earliest stage affected by keys that differ between `before` and
+// `after` config objects, or STAGE_COUNT if none. Keys missing in
+// `keyStages` affect `unknownStage`. Changed keys in `restartKeys` only take
+// effect after restart, so they are reported and otherwise ignored.
+PipelineStage
+changedConfigStage(const rapidjson::Value &before,
+                   const rapidjson::Value &after,
+                   const std::map<string, PipelineStage> &keyStages,
+                   const vector<string> &restartKeys,
+                   PipelineStage unknownStage = STAGE_LOAD) {
+  int res = STAGE_COUNT;
+  auto affect = [&](const string &key) {
+    if (std::find(restartKeys.begin(), restartKeys.end(), key) !=
+        restartKeys.end()) {
+      std::cerr << "[WARN] " << key << " takes effect after restart."
+                << std::endl;
+      return;
+    }
+    auto it = keyStages.find(key);
+    res = std::min(res, int(it == keyStages.end() ? unknownStage : it->second));
+  };
+  // changed or removed keys
+  for (auto m = before.MemberBegin(); m != before.MemberEnd(); ++m) {
+    const char *key = m->name.GetString();
+    if (!after.HasMember(key) || after[key] != m->value) {
+      affect(key);
+    }
+  }
+  // added keys
+  for (auto m = after.MemberBegin(); m != after.MemberEnd(); ++m) {
+    if (!before.HasMember(m->name.GetString())) {
+      affect(m->name.GetString());
+    }
+  }
+  return PipelineStage(res);
+}
+
+// Checked reading of members of config object `d`. A required member that is
+// missing, or a member of the wrong type, throws runtime_error, so that an
+// invalid config file is reported instead of failing an assert of rapidjson.
+const rapidjson::Value &configMember(const rapidjson::Value &d,
+                                     const char *key) {
+  ASSERT(d.HasMember(key), string("[ERROR] Config misses ") + key + ".");
+  return d[key];
+}
+int configInt(const rapidjson::Value &d, const char *key) {
+  const rapidjson::Value &v = configMember(d, key);
+  ASSERT(v.IsInt(), string("[ERROR] ") + key + " should be an integer.");
+  return v.GetInt();
+}
+float configFloat(const rapidjson::Value &d, const char *key) {
+  const rapidjson::Value &v = configMember(d, key);
+  ASSERT(v.IsNumber(), string("[ERROR] ") + key + " should be a number.");
+  return v.GetFloat();
+}
+bool configBool(const rapidjson::Value &d, const char *key) {
+  const rapidjson::Value &v = configMember(d, key);
+  ASSERT(v.IsBool(), string("[ERROR] ") + key + " should be true or false.");
+  return v.GetBool();
+}
+string configString(const rapidjson::Value &d, const char *key) {
+  const rapidjson::Value &v = configMember(d, key);
+  ASSERT(v.IsString(), string("[ERROR] ") + key + " should be a string.");
+  return v.GetString();
+}
+// Optional members, `def` if missing.
+int configInt(const rapidjson::Value &d, const char *key, int def) {
+  return d.HasMember(key) ? configInt(d, key) : def;
+}
+float configFloat(const rapidjson::Value &d, const char *key, float def) {
+  return d.HasMember(key) ? configFloat(d, key) : def;
+}
+bool configBool(const rapidjson::Value &d, const char *key, bool def) {
+  return d.HasMember(key) ? configBool(d, key) : def;
+}
+string configString(const rapidjson::Value &d, const char *key,
+                    const string &def) {
+  return d.HasMember(key) ? configString(d, key) : def;
+}
+// Optional arrays, empty if missing.
+vector<int> configInts(const rapidjson::Value &d, const char *key) {
+  vector<int> res;
+  if (d.HasMember(key)) {
+    const rapidjson::Value &v = d[key];
+    ASSERT(v.IsArray(), string("[ERROR] ") + key + " should be an array.");
+    for (rapidjson::SizeType i = 0; i < v.Size(); i++) {
+      ASSERT(v[i].IsInt(), string("[ERROR] ") + key + " should be integers.");
+      res.push_back(v[i].GetInt());
+    }
+  }
+  return res;
+}
+vector<string> configStrings(const rapidjson::Value &d, const char *key) {
+  vector<string> res;
+  if (d.HasMember(key)) {
+    const rapidjson::Value &v = d[key];
+    ASSERT(v.IsArray(), string("[ERROR] ") + key + " should be an array.");
+    for (rapidjson::SizeType i = 0; i < v.Size(); i++) {
+      ASSERT(v[i].IsString(), string("[ERROR] ") + key + " should be strings.");
+      res.push_back(v[i].GetString());
+    }
+  }
+  return res;
+}
+
+// Modification time and size of file, or (0, -1) if not available.
+std::pair<time_t, long long> fileStamp(const string &path) {
+  struct stat info;
+  if (stat(path.c_str(), &info) != 0) {
+    return {0, -1};
+  }
+  return {info.st_mtime, (long long)info.st_size};
+}
+
+// Detect modification of a file by polling its modification time, size and
+// content. The time may be as coarse as 1 second, and an edit may keep the
+// size, so the content is compared by hash as well.
+class FileWatcher {
+private:
+  string _path;
+  std::pair<time_t, long long> _stamp;
+  size_t _hash;
+
+  size_t _contentHash() const {
+    return std::hash<string>()(readFileText(_path));
+  }
+
+public:
+  FileWatcher(const string &path = "")
+      : _path(path), _stamp(fileStamp(path)), _hash(_contentHash()) {}
+
+  // Whether the file has been modified since last call (or construction).
+  bool changed() {
+    auto stamp = fileStamp(_path);
+    if (stamp.second == -1) {
+      return false;
+    }
+    size_t hash = _contentHash();
+    if (stamp == _stamp && hash == _hash) {
+      return false;
+    }
+    _stamp = stamp;
+    _hash = hash;
+    return true;
+  }
+};
+
+} // namespace zx
+
+#endif
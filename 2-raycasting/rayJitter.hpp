@@ -0,0 +1,37 @@
+#pragma once
+
+// Jittered ray start for Ray Casting
+// by z0gSh1u (Zhuo Xu) @ https://github.com/z0gSh1u/seu-viz
+// Rays sampled at the same regular steps show wood-grain rings where they cut
+// iso-surfaces at the same depths. Starting each ray at its own offset within
+// the first step turns the rings into fine noise. Offsets come from
+// interleaved gradient noise, which is deterministic and spreads its values
+// evenly over neighbouring pixels like blue noise, so the noise is hardly
+// visible. Each progressive pass shifts the offsets by the golden ratio, so
+// that the passes of a pixel cover the step evenly when averaged.
+// Jorge Jimenez. "Next Generation Post Processing in Call of Duty: Advanced
+// Warfare." SIGGRAPH 2014.
+
+#ifndef RAYJITTER_HPP_
+#define RAYJITTER_HPP_
+
+#include <cmath>
+#include "../framework/ReNow.hpp"
+#include "../framework/Utils.hpp"
+
+namespace zx {
+
+#define GOLDEN_RATIO_CONJUGATE 0.61803398875f
+
+// Offset in [0, 1) of the ray start of pixel (u, v), in steps, for
+// progressive pass `pass`.
+float rayJitter(int u, int v, int pass) {
+  float x = 0.06711056f * u + 0.00583715f * v;
+  float noise = 52.9829189f * (x - std::floor(x));
+  float res = noise - std::floor(noise) + pass * GOLDEN_RATIO_CONJUGATE;
+  return res - std::floor(res);
+}
+
+} // namespace zx
+
+#endif
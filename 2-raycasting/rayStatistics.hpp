@@ -0,0 +1,163 @@
+#pragma once
+
+// Per-pixel ray statistics for Ray Casting
+// by z0gSh1u (Zhuo Xu) @ https://github.com/z0gSh1u/seu-viz
+// When diagnosing a slow view, each ray records how many samples it took, how
+// many of them were transparent, how many steps early termination skipped,
+// the depth where its alpha saturated, and its time. Each of them is shown as
+// a false-color heatmap over the image plane, and summarized by percentiles
+// and a histogram.
+
+#ifndef RAYSTATISTICS_HPP_
+#define RAYSTATISTICS_HPP_
+
+#include <cstdio>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include "../framework/ReNow.hpp"
+#include "../framework/Utils.hpp"
+
+namespace zx {
+
+#define RAY_STATS_HIST_BINS 10
+#define RAY_STATS_BAR_WIDTH 40
+
+// Statistics of the ray of one pixel.
+struct RayStats {
+  bool cast = false;   // false if the pixel is not cast, e.g. interpolated
+  int samples = 0;     // samples taken
+  int transparent = 0; // samples of alpha 0, which empty space skipping saves
+  int skipped = 0;     // steps in bounding box left by early termination
+  float depth = -1;    // t where alpha saturated, -1 if it did not
+  float seconds = 0;
+};
+
+// What heatmaps and summaries show.
+enum RayStatsChannel {
+  STATS_SAMPLES,
+  STATS_TRANSPARENT,
+  STATS_SKIPPED,
+  STATS_DEPTH,
+  STATS_TIME,
+  STATS_CHANNEL_COUNT
+};
+
+const char *RayStatsChannelNames[STATS_CHANNEL_COUNT] = {
+    "samples", "transparent", "skipped", "depth", "time"};
+
+// Value of `channel` in `s` (time in microseconds). Returns false if `s` has
+// none, i.e. not cast, or not saturated for depth.
+bool rayStatsValue(const RayStats &s, int channel, float &value) {
+  switch (channel) {
+  case STATS_SAMPLES:
+    value = s.samples;
+    break;
+  case STATS_TRANSPARENT:
+    value = s.transparent;
+    break;
+  case STATS_SKIPPED:
+    value = s.skipped;
+    break;
+  case STATS_DEPTH:
+    value = s.depth;
+    return s.cast && s.depth >= 0;
+  default:
+    value = s.seconds * 1e6f;
+    break;
+  }
+  return s.cast;
+}
+
+// Percentiles and histogram of one channel over the pixels having it.
+struct RayStatsSummary {
+  int count = 0; // # pixels having the value
+  float min = 0, mean = 0, p50 = 0, p90 = 0, p99 = 0, max = 0;
+  int bins[RAY_STATS_HIST_BINS] = {}; // over [min, max] evenly
+};
+
+RayStatsSummary summarizeRayStats(const vector<RayStats> &stats, int channel) {
+  RayStatsSummary res;
+  vector<float> values;
+  float value;
+  for (const auto &s : stats) {
+    if (rayStatsValue(s, channel, value)) {
+      values.push_back(value);
+    }
+  }
+  res.count = values.size();
+  if (values.empty()) {
+    return res;
+  }
+  std::sort(values.begin(), values.end());
+  auto percentile = [&values](float p) {
+    return values[std::min(values.size() - 1, size_t(p * values.size()))];
+  };
+  double sum = 0;
+  for (float v : values) {
+    sum += v;
+  }
+  res.min = values.front(), res.max = values.back();
+  res.mean = sum / values.size();
+  res.p50 = percentile(0.5f), res.p90 = percentile(0.9f);
+  res.p99 = percentile(0.99f);
+  float width = (res.max - res.min) / RAY_STATS_HIST_BINS;
+  for (float v : values) {
+    int bin = width > 0 ? int((v - res.min) / width) : 0;
+    res.bins[std::min(bin, RAY_STATS_HIST_BINS - 1)]++;
+  }
+  return res;
+}
+
+// Summary of `channel` as text, with the histogram drawn in bars.
+string formatRayStatsSummary(const RayStatsSummary &summary, int channel) {
+  std::stringstream res;
+  res << RayStatsChannelNames[channel] << (channel == STATS_TIME ? " (us)" : "")
+      << ": " << summary.count << " pixels, min " << summary.min << ", mean "
+      << summary.mean << ", p50 " << summary.p50 << ", p90 " << summary.p90
+      << ", p99 " << summary.p99 << ", max " << summary.max << std::endl;
+  if (summary.count == 0) {
+    return res.str();
+  }
+  int highest = *std::max_element(summary.bins,
+                                  summary.bins + RAY_STATS_HIST_BINS);
+  float width = (summary.max - summary.min) / RAY_STATS_HIST_BINS;
+  char line[64];
+  for (int i = 0; i < RAY_STATS_HIST_BINS; i++) {
+    snprintf(line, sizeof(line), "  [%10.2f, %10.2f) %8d ",
+             summary.min + i * width, summary.min + (i + 1) * width,
+             summary.bins[i]);
+    res << line
+        << string(summary.bins[i] * RAY_STATS_BAR_WIDTH / highest, '#')
+        << std::endl;
+  }
+  return res.str();
+}
+
+// False color of `x` in [0, 1], from dark blue through cyan and yellow to red.
+RGBAColor heatColor(float x) {
+  const vec3 stops[] = {vec3(0, 0, 0.5), vec3(0, 0, 1), vec3(0, 1, 1),
+                        vec3(1, 1, 0), vec3(1, 0, 0)};
+  const int n = sizeof(stops) / sizeof(stops[0]);
+  float f = minmaxClip(x, 0, 1) * (n - 1);
+  int i = std::min(int(f), n - 2);
+  return RGBAColor(glm::mix(stops[i], stops[i + 1], f - i), 1);
+}
+
+// Heatmap of `channel` in the layout of image plane, scaled so that `high`
+// is red. Pixels without the value are black.
+vector<RGBAColor> rayStatsHeatmap(const vector<RayStats> &stats, int channel,
+                                  float high) {
+  vector<RGBAColor> res(stats.size(), RGBAColor(RGBBlack, 1));
+  float value;
+  for (size_t i = 0; i < stats.size(); i++) {
+    if (rayStatsValue(stats[i], channel, value)) {
+      res[i] = heatColor(high > 0 ? value / high : 0);
+    }
+  }
+  return res;
+}
+
+} // namespace zx
+
+#endif
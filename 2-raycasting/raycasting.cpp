@@ -14,12 +14,93 @@
 //   So we only need the right-top-front point `bbox` to determine the
 //   bounding box.
 // [data]
-//   Required volume data is .raw file with 16-bit Unsigned LittleEndian
-//   per voxel.
-#define BytesPerVoxel 2
+//   Volume data can be NRRD (.nrrd, .nhdr) or MetaImage (.mhd, .mha), raw or
+//   gzip encoded, whose size, spacing and voxel type come from the header.
+//   Otherwise it is headerless .raw file of "VolumeType" (16-bit Unsigned
+//   LittleEndian by default) per voxel, sized by config file.
+#include "volumeFile.hpp"
+//   Set "VolumeFrames" to a list of volume files of the same size to play them
+//   as a time-varying volume. "FramePrefetch" frames after the current one are
+//   loaded (and classified if "ClassifyAhead") in background.
+#include "volumeSequence.hpp"
 // [transfer function]
 //   Refer to the document for detail. And refer to:
 #include "transferFunction.hpp"
+// [benchmark]
+//   Run with `--benchmark <suite.json>` to render the scenarios of a suite
+//   headlessly over phantom volumes, and check output against golden images.
+//   Add `--record` to (re)record the golden images, and `--baseline
+//   <report.csv>` to check time against an earlier report of this machine.
+//   Set "Phantom" in config file to view a phantom interactively.
+#include "phantom.hpp"
+#include "benchmark.hpp"
+// [memory]
+//   Volume buffers are allocated untouched and first touched by the cast
+//   workers, so that on NUMA machines each worker mostly reads memory of its
+//   own node. Set "PinThreads" to keep workers on fixed cores ("ThreadCores"),
+//   and "HugePages" to "transparent" or "explicit" to cut TLB misses.
+#include "volumeMemory.hpp"
+//   Set "SparseVolume" to keep only bricks of the classified volume with some
+//   non-transparent voxel, instead of every voxel (ray casting engine only).
+#include "sparseVolume.hpp"
+//   Set "VolumeCacheDir" to keep decoded and classified volumes there, so that
+//   the next run maps them instead of decoding and classifying again.
+#include "volumeCache.hpp"
+// [footprint]
+//   Only tiles of image plane that overlap the projected bounding box are
+//   cast, the rest is filled with background directly.
+#include "footprint.hpp"
+// [adaptive sampling]
+//   Set "AdaptiveStep" (e.g. 4) to cast rays on a grid of that step first, and
+//   cast more only where neighbours differ by more than "AdaptiveThreshold",
+//   interpolating the rest.
+#include "adaptiveSampling.hpp"
+// [jitter]
+//   Set "JitterRays" to start each ray at its own offset within the first
+//   step, which turns wood-grain rings of coarse sampling into fine noise, and
+//   "ProgressivePasses" to average that many jittered passes while the view
+//   stands still.
+#include "rayJitter.hpp"
+// [ray statistics]
+//   Set "RayStatsPath" (e.g. "./stats/view_####.png") to record samples,
+//   transparent samples, skipped steps, saturation depth and time of every
+//   ray cast, and save them as heatmaps with a histogram summary.
+#include "rayStatistics.hpp"
+// [engine]
+//   Set "RenderEngine" to "ShearWarp" to composite the volume slice by slice
+//   instead of casting rays. It shares volume and transfer function, and
+//   skips transparent voxels by run-length encoding.
+#include "shearWarp.hpp"
+//   Set "RenderEngine" to "GPU" to march the rays in fragment shader over the
+//   volume in 3D texture, classified ("GPUVolumeFormat" "RGBA8") or classified
+//   per sample by the transfer function in 1D texture ("R16").
+#include "gpuRayCasting.hpp"
+// [pipeline]
+//   Rendering runs as stages: load, classify, accel, cast, filter, upload
+//   and write.
+//   The config file is watched while running, and a change re-runs only the
+//   stages after the ones its keys affect, e.g. a new "TransferFunction"
+//   classifies without reading the volume again.
+#include "pipeline.hpp"
+// [image cache]
+//   Rendered image planes are kept in memory ("ImageCacheMB"), keyed by view,
+//   volume, transfer function and quality settings, so that a revisited view
+//   shows without casting again. Set "ImageCacheSpillDir" to spill the least
+//   recently used ones to disk ("ImageCacheDiskMB") instead of dropping them.
+#include "imageCache.hpp"
+// [output]
+//   Set "OutputPath" to save every rendered image plane as .ppm or .png
+//   (8 or 16 bits by "OutputBitDepth"), numbered by the first run of '#' in
+//   the path, or to append it to a .y4m stream. Files are written by a
+//   background thread, so rendering does not wait for disk.
+#include "imageWriter.hpp"
+// [server]
+//   Run with `--serve [address]` to serve render requests over the volume in
+//   config file without window, on "ServerAddress" ("host:port", or
+//   "unix:path" except on Windows) by default. Requests arriving within
+//   "ServerBatchWindowMs" are rendered as one batch. Viewers may stop the
+//   server only if "ServerAllowShutdown". See README for protocol.
+#include "renderServer.hpp"
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
@@ -27,6 +108,8 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <rapidjson/document.h>
 #include <ctime>
+#include <chrono>
+#include <atomic>
 #include <climits>
 #include <thread>
 #include <map>
@@ -35,6 +118,7 @@
 #include <mutex>
 #include <algorithm>
 #include <cstdio>
+#include <cmath>
 
 #include "../framework/ReNow.hpp"
 #include "../framework/Utils.hpp"
@@ -65,15 +149,42 @@ int WINDOW_WIDTH, WINDOW_HEIGHT;
 
 // [Volume Data Metainfo]
 string VolumePath;                           // volume raw file path
+string Phantom; // generate phantom of this name instead, if not empty
 int VolumeWidth, VolumeHeight, VolumeZCount; // x, y, z (thickness)
+VolumeFileInfo volumeFile;   // how to decode the volume file
+vec3 VolumeSpacing(1, 1, 1); // voxel size relative to its shortest side
 vec3 bbox; // bounding box point beside (0, 0, 0)
 int PixelPerSlice, VoxelCount;
-uint16 *volumeData;           // volume data itself
-RGBAColor *coloredVolumeData; // after coloring using transfer function (TF)
+HugePageMode VolumeHugePages = HUGE_PAGE_NONE; // huge pages for volume buffers
+uint16 *volumeData = nullptr; // volume data itself
+RGBAColor *coloredVolumeData =
+    nullptr; // after coloring using transfer function (TF)
+bool SparseVolume = false; // keep classified volume in `sparseColoredVolume`
+BrickedVolume sparseColoredVolume; // instead of `coloredVolumeData`
+
+// [Volume Cache]
+VolumeCache volumeCache;
+string VolumeCacheDir; // where to keep derived volume data, none if empty
+std::unique_ptr<CachedVolumeData> mappedColoredVolume; // in use, if any
+RGBAColor *coloredVolumeBuffer = nullptr; // own buffer while mapped
+
+// [Time-varying Volume]
+vector<string> VolumeFrames;         // volume file of each frame, if any
+vector<VolumeFileInfo> frameFiles;   // how to decode each frame
+int FramePrefetch = 4;               // # frames loaded ahead of current one
+bool ClassifyAhead = true;           // classify frames loaded ahead
+float PlaybackFPS = 0;               // frame rate limit, 0 for none
+VolumeSequence volumeSequence;       // slots of frames loaded
+bool volumeFromSequence = false;     // volume buffers belong to the slots
+int currentFrame = 0;                // frame shown
+const VolumeSlot *currentSlot = nullptr; // its slot
+bool playing = false;
+std::chrono::steady_clock::time_point lastFrameTime; // when frame changed
 
 // [Image Plane]
 int ImagePlaneWidth, ImagePlaneHeight, ImagePlaneSize;
-RGBAColor *imagePlane; // image plane itself
+RGBAColor *imagePlane = nullptr; // image plane itself
+vector<RGBAColor> unfilteredImagePlane; // cast result before filtering
 int MedianFilterKSize;
 
 // [Transfer Function]
@@ -85,6 +196,7 @@ map<string, function<void(const uint16 *vol, int vCount, RGBAColor *res)>>
         {"TF_CT_MuscleAndBone", TF_CT_MuscleAndBone},
         {"TF_CT_Skin", TF_CT_Skin},
 };
+map<string, string> transferFunctionDigests; // hex digest by name, on demand
 
 // [Multi Thread]
 int multiThread;        // num_workers
@@ -92,17 +204,45 @@ float sharePerThread;   // proportion of workload per thread
 mutex multiThreadMutex; // mutex lock
 vector<thread> threadPool;
 vector<pair<int, int>> threadParamRanges; // [low, high] for row params
+vector<vector<Tile>> workerTiles; // tiles to cast, grouped by owner worker
+vector<std::atomic<int>> workerTileCursors; // next tile of each owner
+bool PinThreads = false; // pin worker i to ThreadCores[i]
+vector<int> ThreadCores; // core of each worker
 
 // [Progress Bar]
-float progress = 0.0;
-float progressPerThreadPerRow;
+std::atomic<int> tilesCast; // # tiles finished
+int tilesTotal;             // # tiles to cast
+bool ShowProgressBar = true;
 
 // [Ray Casting]
-int intersectCount = 0; // # ray intersects with bounding box
-int currentTexId = -1;  // casting result image plane is stored as texture
+int intersectCount = 0;     // # ray intersects with bounding box
+int rayCount = 0;           // # rays cast, at most pixels in footprint tiles
+long long sampleCount = 0;  // # samples taken along all rays
+int currentTexId = -1;      // casting result image plane is stored as texture
 #define INTERSECT_EPSILON 1e-6 // error control for intersect test
 float SamplingDelta;           // step of voxel sampling, coarse: 1, finer: 0.5
-bool shouldReCast = true;
+#define TILE_SIZE 32 // rays are scheduled in tiles of TILE_SIZE^2 pixels
+const RGBAColor backgroundColor(RGBBlack, 1.0); // for rays missing the volume
+string RenderEngine = "RayCasting"; // or "ShearWarp", "GPU"
+int AdaptiveStep = 0;            // grid step of adaptive sampling, 0 for none
+float AdaptiveThreshold = 0.05f; // color difference that needs more rays
+bool JitterRays = false;      // start rays at jittered offsets
+int ProgressivePasses = 1;    // jittered passes averaged for a still view
+int progressivePass = 0;      // pass being cast
+bool progressiveRefining = false; // next cast is a pass of the same view
+string RayStatsPath;         // where to save ray statistics, none if empty
+vector<RayStats> rayStats;   // of each pixel, if collected
+long long rayStatsIndex = 0; // to number saved statistics
+
+// [Shear Warp]
+RunLengthVolume runLengthVolumes[3]; // classified volume encoded along x, y, z
+bool runLengthVolumesReady = false;  // whether they match `coloredVolumeData`
+
+// [GPU]
+GPURayCaster gpuRayCaster;
+string GPUVolumeFormat = "RGBA8"; // or "R16"
+bool gpuVolumeReady = false;    // whether textures match classification
+bool gpuRawVolumeReady = false; // whether R16 texture matches `volumeData`
 
 // [Observation]
 vec3 eyePos;                             // current eye position
@@ -125,6 +265,81 @@ float KAmbient;                                // weight for ambient component
 
 // [ReNow Helper]
 ReNowHelper helper;
+GL_PROGRAM_ID mainProgram = 0; // shows the image plane
+
+// [Pipeline]
+RenderPipeline pipeline;
+FileWatcher configWatcher;
+string appliedConfigText; // content of config file in effect
+// The first stage affected by each config key. Unknown keys affect
+// STAGE_LOAD to be safe.
+const map<string, PipelineStage> ConfigKeyStages = {
+    {"VolumePath", STAGE_LOAD},
+    {"Phantom", STAGE_LOAD},
+    {"VolumeWidth", STAGE_LOAD},
+    {"VolumeHeight", STAGE_LOAD},
+    {"VolumeZCount", STAGE_LOAD},
+    {"VolumeType", STAGE_LOAD},
+    {"HugePages", STAGE_LOAD},
+    {"SparseVolume", STAGE_LOAD},
+    {"VolumeCacheDir", STAGE_LOAD},
+    {"VolumeFrames", STAGE_LOAD},
+    {"FramePrefetch", STAGE_LOAD},
+    {"ClassifyAhead", STAGE_LOAD},
+    {"PlaybackFPS", STAGE_COUNT},
+    {"TransferFunction", STAGE_CLASSIFY},
+    {"GPUVolumeFormat", STAGE_CLASSIFY},
+    {"RenderEngine", STAGE_ACCEL},
+    {"ImagePlaneWidth", STAGE_CAST},
+    {"ImagePlaneHeight", STAGE_CAST},
+    {"SamplingDelta", STAGE_CAST},
+    {"AdaptiveStep", STAGE_CAST},
+    {"AdaptiveThreshold", STAGE_CAST},
+    {"RayStatsPath", STAGE_CAST},
+    {"JitterRays", STAGE_CAST},
+    {"ProgressivePasses", STAGE_CAST},
+    {"EnableLighting", STAGE_CAST},
+    {"KAmbient", STAGE_CAST},
+    {"MultiThread", STAGE_CAST},
+    {"PinThreads", STAGE_CAST},
+    {"ThreadCores", STAGE_CAST},
+    {"MedianFilterKSize", STAGE_FILTER},
+    {"ImageCacheMB", STAGE_UPLOAD},
+    {"ImageCacheSpillDir", STAGE_UPLOAD},
+    {"ImageCacheDiskMB", STAGE_UPLOAD},
+    {"OutputPath", STAGE_WRITE},
+    {"OutputBitDepth", STAGE_WRITE},
+    {"OutputQueueSize", STAGE_WRITE},
+};
+
+// [Image Cache]
+ImagePlaneCache imageCache;
+int ImageCacheMB = 256; // 0 to disable
+string currentImageKey; // key of image plane being rendered
+shared_ptr<CachedImagePlane> currentImage; // its cache entry, if any
+
+// [Output]
+AsyncImageWriter imageWriter;
+string OutputPath;              // where to save image planes, none if empty
+int OutputBitDepth = 8;         // 8 or 16, for PPM and PNG
+long long outputFrameIndex = 0; // to number saved files
+
+// [Server]
+string ServerAddress = "127.0.0.1:7878";
+int ServerBatchWindowMs = 5; // wait for more requests to batch
+int ServerMaxBatch = 32;     // # requests in a batch at most
+bool ServerAllowShutdown = false; // let viewers stop the server
+
+// [Profiler]
+bool Profile = false;       // time passes of frames in window
+string ProfilePath;         // log of frame times, none if empty
+int ProfileReportEvery = 0; // frames between console reports, 0 for none
+
+// Config keys that take effect after restart only.
+const vector<string> RestartConfigKeys = {
+    "WindowWidth",         "WindowHeight",   "ServerAddress",
+    "ServerBatchWindowMs", "ServerMaxBatch", "ServerAllowShutdown",
+    "Profile",             "ProfilePath",    "ProfileReportEvery"};
 // ### Here are parameters that should be set, read, or calculated. ###
 
 // Truncate the translation vector (i.e. the last column) in lookAt matrix,
@@ -133,42 +348,88 @@ mat3 UntranslatedLookAt(vec3 eye, vec3 at, vec3 up) {
   return mat3(glm::lookAt(eye, at, up));
 }
 
-// Load config file from CONFIG_FILE, and calculate some parameters.
-void loadConfigFileAndInitialize() {
-  Document d;
-  d.Parse(readFileText(CONFIG_FILE).c_str());
-
-  WINDOW_WIDTH = d["WindowWidth"].GetInt();
-  WINDOW_HEIGHT = d["WindowHeight"].GetInt();
+// Classify frames of time-varying volume loaded ahead by the current
+// transfer function, if enabled.
+void updateFrameTransferFunction() {
+  bool classify = ClassifyAhead && !SparseVolume &&
+                  TransferFunctionMap.count(TransferFunctionName) != 0;
+  volumeSequence.setTransferFunction(
+      TransferFunctionName, classify ? TransferFunctionMap[TransferFunctionName]
+                                     : nullptr);
+}
 
-  VolumePath = d["VolumePath"].GetString();
-  VolumeWidth = d["VolumeWidth"].GetInt();
-  VolumeHeight = d["VolumeHeight"].GetInt();
-  VolumeZCount = d["VolumeZCount"].GetInt();
-  // far enough to hold the whole volume in view
-  eyePos = vec3(0, 0, VolumeZCount + 1);
+// Use the own buffer as `coloredVolumeData` again, instead of the one mapped
+// from volume cache.
+void unmapColoredVolume() {
+  if (mappedColoredVolume != nullptr) {
+    coloredVolumeData = coloredVolumeBuffer;
+    mappedColoredVolume = nullptr;
+  }
+}
 
+// (Re)allocate volume buffers according to volume size. Pages are left
+// untouched, see `firstTouchVolume`. Frames of time-varying volume have
+// buffers of their slots instead.
+void allocateVolume() {
+  unmapColoredVolume();
+  volumeCache.cancel(volumeData);
+  volumeCache.cancel(coloredVolumeData);
+  if (!volumeFromSequence) {
+    freeLargeBuffer(volumeData, sizeof(uint16) * VoxelCount);
+    freeLargeBuffer(coloredVolumeData, sizeof(RGBAColor) * VoxelCount);
+  }
+  volumeData = nullptr;
+  coloredVolumeData = nullptr;
+  currentSlot = nullptr;
   bbox = vec3(VolumeWidth - 1, VolumeHeight - 1, VolumeZCount - 1);
   PixelPerSlice = VolumeWidth * VolumeHeight;
   VoxelCount = PixelPerSlice * VolumeZCount;
-  volumeData = new uint16[VoxelCount];
-  coloredVolumeData = new RGBAColor[VoxelCount];
+  volumeFromSequence = !frameFiles.empty();
+  if (volumeFromSequence) {
+    volumeSequence.configure(frameFiles, VolumeHugePages, FramePrefetch,
+                             multiThread, !SparseVolume);
+    updateFrameTransferFunction();
+    return;
+  }
+  volumeSequence.release();
+  volumeData = (uint16 *)allocateLargeBuffer(sizeof(uint16) * VoxelCount,
+                                             VolumeHugePages);
+  if (!SparseVolume) {
+    coloredVolumeData = (RGBAColor *)allocateLargeBuffer(
+        sizeof(RGBAColor) * VoxelCount, VolumeHugePages);
+  }
+}
 
-  ImagePlaneWidth = d["ImagePlaneWidth"].GetInt();
-  ImagePlaneHeight = d["ImagePlaneHeight"].GetInt();
-  ImagePlaneSize = ImagePlaneWidth * ImagePlaneHeight;
-  imagePlane = new RGBAColor[ImagePlaneSize];
+// Assign cores to workers, from `configured` first, then spread evenly.
+void assignThreadCores(const vector<int> &configured) {
+  ThreadCores.clear();
+  for (int i = 0; i < multiThread; i++) {
+    ThreadCores.push_back(i < (int)configured.size()
+                              ? configured[i]
+                              : defaultCoreOfWorker(i, multiThread));
+  }
+}
 
-  TransferFunctionName = d["TransferFunction"].GetString();
-  MedianFilterKSize = d["MedianFilterKSize"].GetInt();
-  SamplingDelta = d["SamplingDelta"].GetFloat();
-  EnableLighting = d["EnableLighting"].GetBool();
-  KAmbient = d["KAmbient"].GetFloat();
+// Pin the calling thread if it is worker `i` and pinning is enabled.
+void pinWorker(int i) {
+  if (PinThreads && !pinCurrentThread(ThreadCores.at(i))) {
+    cerr << "[WARN] Failed to pin worker " << i << " to core "
+         << ThreadCores.at(i) << endl;
+  }
+}
+
+// (Re)allocate image plane according to its size, and split rows of it
+// among threads.
+void allocateImagePlane() {
+  if (imagePlane == nullptr ||
+      ImagePlaneSize != ImagePlaneWidth * ImagePlaneHeight) {
+    ImagePlaneSize = ImagePlaneWidth * ImagePlaneHeight;
+    delete[] imagePlane;
+    imagePlane = new RGBAColor[ImagePlaneSize];
+  }
 
-  multiThread = d["MultiThread"].GetInt();
   sharePerThread = 1.0 / multiThread;
-  progressPerThreadPerRow =
-      (float)ImagePlaneWidth * multiThread / ImagePlaneSize;
+  threadParamRanges.clear();
   for (int i = 0; i < multiThread; i++) {
     int low = int(sharePerThread * i * ImagePlaneHeight);
     int high = i == multiThread - 1
@@ -178,6 +439,182 @@ void loadConfigFileAndInitialize() {
   }
 }
 
+// Read parameters from config file content `d`, and calculate some of them.
+// Buffers are (re)allocated by pipeline stages.
+void applyConfig(const Document &d) {
+  VolumeFrames = configStrings(d, "VolumeFrames");
+  // the first frame tells size and type of all
+  VolumePath =
+      VolumeFrames.empty() ? configString(d, "VolumePath") : VolumeFrames[0];
+  Phantom = VolumeFrames.empty() ? configString(d, "Phantom", "") : "";
+  if (Phantom.empty() && readVolumeHeader(VolumePath, volumeFile)) {
+    // size and spacing come from the header
+    VolumeWidth = volumeFile.width;
+    VolumeHeight = volumeFile.height;
+    VolumeZCount = volumeFile.zCount;
+    const vec3 &s = volumeFile.spacing;
+    VolumeSpacing = s / std::min(std::min(s.x, s.y), s.z);
+  } else {
+    VolumeSpacing = vec3(1, 1, 1);
+    VolumeWidth = configInt(d, "VolumeWidth");
+    VolumeHeight = configInt(d, "VolumeHeight");
+    VolumeZCount = configInt(d, "VolumeZCount");
+    volumeFile = rawVolumeInfo(
+        VolumePath, VolumeWidth, VolumeHeight, VolumeZCount,
+        parseVoxelType(configString(d, "VolumeType", "ushort")));
+  }
+  ASSERT(VolumeWidth > 0 && VolumeHeight > 0 && VolumeZCount > 0,
+         "[ERROR] Volume size should be positive.");
+  VolumeHugePages = parseHugePageMode(configString(d, "HugePages", "none"));
+  VolumeCacheDir = configString(d, "VolumeCacheDir", "");
+  volumeCache.configure(VolumeCacheDir);
+  frameFiles.clear();
+  for (const auto &path : VolumeFrames) {
+    VolumeFileInfo info = volumeFile;
+    if (!readVolumeHeader(path, info)) {
+      info.dataPath = path;
+    }
+    ASSERT(info.width == VolumeWidth && info.height == VolumeHeight &&
+               info.zCount == VolumeZCount,
+           "[ERROR] Frame differs in size from the first one: " + path);
+    frameFiles.push_back(info);
+  }
+  currentFrame = currentFrame < (int)frameFiles.size() ? currentFrame : 0;
+  FramePrefetch = configInt(d, "FramePrefetch", 4);
+  ASSERT(FramePrefetch >= 0, "[ERROR] FramePrefetch should be >= 0.");
+  ClassifyAhead = configBool(d, "ClassifyAhead", true);
+  PlaybackFPS = configFloat(d, "PlaybackFPS", 0);
+  ASSERT(PlaybackFPS >= 0, "[ERROR] PlaybackFPS should be >= 0.");
+
+  ImagePlaneWidth = configInt(d, "ImagePlaneWidth");
+  ImagePlaneHeight = configInt(d, "ImagePlaneHeight");
+  ASSERT(ImagePlaneWidth > 0 && ImagePlaneHeight > 0,
+         "[ERROR] Image plane size should be positive.");
+
+  TransferFunctionName = configString(d, "TransferFunction");
+  MedianFilterKSize = configInt(d, "MedianFilterKSize");
+  ASSERT(MedianFilterKSize == 0 ||
+             (MedianFilterKSize > 0 && MedianFilterKSize % 2 == 1),
+         "MedianFilterKSize should be odd.");
+  SamplingDelta = configFloat(d, "SamplingDelta");
+  ASSERT(SamplingDelta > 0, "[ERROR] SamplingDelta should be positive.");
+  AdaptiveStep = configInt(d, "AdaptiveStep", 0);
+  ASSERT(AdaptiveStep >= 0, "[ERROR] AdaptiveStep should be >= 0.");
+  AdaptiveThreshold = configFloat(d, "AdaptiveThreshold", 0.05f);
+  ASSERT(AdaptiveThreshold >= 0, "[ERROR] AdaptiveThreshold should be >= 0.");
+  EnableLighting = configBool(d, "EnableLighting");
+  KAmbient = configFloat(d, "KAmbient");
+  ASSERT(KAmbient >= 0, "[ERROR] KAmbient should be >= 0.");
+  RenderEngine = configString(d, "RenderEngine", "RayCasting");
+  ASSERT(RenderEngine == "RayCasting" || RenderEngine == "ShearWarp" ||
+             RenderEngine == "GPU",
+         "[ERROR] Invalid render engine: " + RenderEngine);
+  JitterRays = configBool(d, "JitterRays", false);
+  ProgressivePasses = configInt(d, "ProgressivePasses", 1);
+  ASSERT(ProgressivePasses >= 1, "[ERROR] ProgressivePasses should be >= 1.");
+  RayStatsPath = configString(d, "RayStatsPath", "");
+  ASSERT(RayStatsPath.empty() || RenderEngine == "RayCasting",
+         "[ERROR] RayStatsPath works with RayCasting engine only.");
+  ASSERT(RayStatsPath.empty() || imageFormatOfPath(RayStatsPath) != FORMAT_Y4M,
+         "[ERROR] RayStatsPath should be .ppm or .png.");
+  SparseVolume = configBool(d, "SparseVolume", false);
+  ASSERT(!SparseVolume || RenderEngine == "RayCasting",
+         "[ERROR] SparseVolume works with RayCasting engine only.");
+  GPUVolumeFormat = configString(d, "GPUVolumeFormat", "RGBA8");
+  ASSERT(GPUVolumeFormat == "RGBA8" || GPUVolumeFormat == "R16",
+         "[ERROR] Invalid GPU volume format: " + GPUVolumeFormat);
+
+  multiThread = configInt(d, "MultiThread");
+  ASSERT(multiThread > 0, "[ERROR] MultiThread should be positive.");
+  PinThreads = configBool(d, "PinThreads", false);
+  vector<int> configuredCores = configInts(d, "ThreadCores");
+  for (int core : configuredCores) {
+    ASSERT(core >= 0, "[ERROR] ThreadCores should be >= 0.");
+  }
+  assignThreadCores(configuredCores);
+
+  ImageCacheMB = configInt(d, "ImageCacheMB", 256);
+  int imageCacheDiskMB = configInt(d, "ImageCacheDiskMB", 1024);
+  ASSERT(ImageCacheMB >= 0 && imageCacheDiskMB >= 0,
+         "[ERROR] Image cache sizes should be >= 0.");
+  imageCache.configure(ImageCacheMB, configString(d, "ImageCacheSpillDir", ""),
+                       imageCacheDiskMB);
+
+  OutputPath = configString(d, "OutputPath", "");
+  if (!OutputPath.empty()) {
+    imageFormatOfPath(OutputPath); // check it
+  }
+  OutputBitDepth = configInt(d, "OutputBitDepth", 8);
+  ASSERT(OutputBitDepth == 8 || OutputBitDepth == 16,
+         "OutputBitDepth should be 8 or 16.");
+  int outputQueueSize = configInt(d, "OutputQueueSize", 16);
+  ASSERT(outputQueueSize > 0, "[ERROR] OutputQueueSize should be positive.");
+  imageWriter.setCapacity(outputQueueSize);
+
+  ServerAddress = configString(d, "ServerAddress", ServerAddress);
+  ServerBatchWindowMs =
+      configInt(d, "ServerBatchWindowMs", ServerBatchWindowMs);
+  ASSERT(ServerBatchWindowMs >= 0,
+         "[ERROR] ServerBatchWindowMs should be >= 0.");
+  ServerMaxBatch = configInt(d, "ServerMaxBatch", ServerMaxBatch);
+  ASSERT(ServerMaxBatch > 0, "[ERROR] ServerMaxBatch should be positive.");
+  ServerAllowShutdown =
+      configBool(d, "ServerAllowShutdown", ServerAllowShutdown);
+
+  Profile = configBool(d, "Profile", false);
+  ProfilePath = configString(d, "ProfilePath", "");
+  ProfileReportEvery = configInt(d, "ProfileReportEvery", 120);
+  ASSERT(ProfileReportEvery >= 0,
+         "[ERROR] ProfileReportEvery should be >= 0.");
+}
+
+// Load config file from CONFIG_FILE, and calculate some parameters.
+void loadConfigFileAndInitialize() {
+  appliedConfigText = readFileText(CONFIG_FILE);
+  configWatcher = FileWatcher(CONFIG_FILE);
+  Document d;
+  d.Parse(appliedConfigText.c_str());
+  ASSERT(!d.HasParseError() && d.IsObject(),
+         "[ERROR] Invalid config file: " + CONFIG_FILE);
+
+  WINDOW_WIDTH = configInt(d, "WindowWidth");
+  WINDOW_HEIGHT = configInt(d, "WindowHeight");
+  ASSERT(WINDOW_WIDTH > 0 && WINDOW_HEIGHT > 0,
+         "[ERROR] Window size should be positive.");
+  applyConfig(d);
+}
+
+// Apply config file again if it has changed, and invalidate the pipeline
+// stages affected. Invalid config is reported and ignored.
+void reloadConfigFileIfChanged() {
+  if (!configWatcher.changed()) {
+    return;
+  }
+  string text = readFileText(CONFIG_FILE);
+  Document before, after;
+  before.Parse(appliedConfigText.c_str());
+  after.Parse(text.c_str());
+  if (after.HasParseError() || !after.IsObject()) {
+    cerr << "[WARN] Config file is invalid, ignored." << endl;
+    return;
+  }
+  PipelineStage stage = changedConfigStage(before, after, ConfigKeyStages,
+                                           RestartConfigKeys);
+  try {
+    applyConfig(after);
+  } catch (const runtime_error &) {
+    cerr << "[WARN] Config file is invalid, ignored." << endl;
+    applyConfig(before);
+    return;
+  }
+  appliedConfigText = text;
+  if (stage == STAGE_COUNT) {
+    return; // nothing to re-run, e.g. only "PlaybackFPS" changed
+  }
+  cout << ">>> Config file changed." << endl;
+  pipeline.invalidate(stage);
+}
+
 // Get pixel index at imaging plane.
 int getPixelIndex(int r, int c) {
   // Refer to the geometry definition. Row starts from "bottom"
@@ -205,7 +642,8 @@ vec3 calcNormal(int x, int y, int z) {
         z2 = z < VolumeZCount - 1 ? getVoxel(x, y, z + 1) : defaultValue;
   // normalized normal equal to normalized gradient
   // use normal that points out (Left Hand Side of curve growing)
-  vec3 gradient(x2 - x1, y2 - y1, z2 - z1); // the order is important
+  // the order is important, and the gradient is in physical space
+  vec3 gradient = vec3(x2 - x1, y2 - y1, z2 - z1) / VolumeSpacing;
   vec3 gradientNorm = glm::normalize(gradient);
   // handle numerical precision error
   if (isnan(gradientNorm.x) || isnan(gradientNorm.y) || isnan(gradientNorm.z)) {
@@ -215,47 +653,213 @@ vec3 calcNormal(int x, int y, int z) {
   return gradientNorm;
 }
 
-// Apply transfer function to fill `coloredVolumeData`.
+// Run `job(low, high)` over the volume on every worker. Worker i takes the
+// voxel index ranges [low, high) of rows that it casts rays through in the
+// default view, slice by slice.
+void forEachVolumeShare(const function<void(int low, int high)> &job) {
+  threadPool.clear();
+  for (int i = 0; i < multiThread; i++) {
+    threadPool.push_back(thread([i, &job]() {
+      pinWorker(i);
+      int yLow = VolumeHeight * i / multiThread,
+          yHigh = VolumeHeight * (i + 1) / multiThread;
+      for (int z = 0; z < VolumeZCount; z++) {
+        job(getVoxelIndex(0, yLow, z), getVoxelIndex(0, yHigh, z));
+      }
+    }));
+  }
+  for_each(threadPool.begin(), threadPool.end(), [=](thread &t) { t.join(); });
+}
+
+// Whether derived volume data go through volume cache. Frames of
+// time-varying volume are loaded ahead instead.
+bool volumeCacheEnabled() {
+  return volumeCache.enabled() && !volumeFromSequence;
+}
+
+// What volume data depend on, as cache key. The volume file may change in
+// place, so its modification time and size are included.
+string volumeKey() {
+  stringstream key;
+  if (Phantom.empty()) {
+    auto stamp = fileStamp(VolumePath);
+    key << "volume=" << VolumePath << "@" << stamp.first << "+"
+        << stamp.second << ";type=" << volumeFile.type;
+    if (volumeFile.dataPath != VolumePath) {
+      auto dataStamp = fileStamp(volumeFile.dataPath);
+      key << ";data=" << volumeFile.dataPath << "@" << dataStamp.first << "+"
+          << dataStamp.second;
+    }
+  } else {
+    key << "phantom=" << Phantom;
+  }
+  key << ";size=" << VolumeWidth << "x" << VolumeHeight << "x"
+      << VolumeZCount;
+  return key.str();
+}
+
+// Name of the volume in volume cache, whose files are replaced when stale.
+string volumeCacheName() {
+  return Phantom.empty() ? VolumePath
+                         : Phantom + "@" + std::to_string(VolumeWidth) + "x" +
+                               std::to_string(VolumeHeight) + "x" +
+                               std::to_string(VolumeZCount);
+}
+
+// Touch volume buffers in parallel before anything else writes them, so that
+// their pages are placed on the NUMA node of the worker using them. With
+// volume cache, the classified buffer is left to classification, which
+// touches it by the same shares, as the cache may map it instead.
+void firstTouchVolume() {
+  bool touchColored = coloredVolumeData != nullptr && !volumeCacheEnabled();
+  forEachVolumeShare([touchColored](int low, int high) {
+    std::fill(volumeData + low, volumeData + high, 0);
+    if (touchColored) {
+      std::fill(coloredVolumeData + low, coloredVolumeData + high,
+                Transparent);
+    }
+  });
+}
+
+// Digest of transfer function `name` in hex, so that a changed definition
+// under the same name gives a different cache key. Computed once per name.
+const string &transferFunctionDigestHex(const string &name) {
+  auto it = transferFunctionDigests.find(name);
+  if (it == transferFunctionDigests.end()) {
+    ASSERT(TransferFunctionMap.count(name) != 0,
+           "[ERROR] Invalid transfer function: " + name);
+    char digest[32];
+    snprintf(digest, sizeof(digest), "%016llx",
+             transferFunctionDigest(TransferFunctionMap[name]));
+    it = transferFunctionDigests.emplace(name, digest).first;
+  }
+  return it->second;
+}
+
+// Apply transfer function to fill `coloredVolumeData`, or to build
+// `sparseColoredVolume` if SparseVolume.
 void applyTransferFunction(const string &name) {
   ASSERT(TransferFunctionMap.count(name) != 0,
-         "[ERROR] Invalid transfer function: " + TransferFunctionName);
-  TransferFunctionMap[name](volumeData, VoxelCount, coloredVolumeData);
+         "[ERROR] Invalid transfer function: " + name);
+  const auto &tf = TransferFunctionMap[name];
+  if (SparseVolume) {
+    sparseColoredVolume.build(volumeData, VolumeWidth, VolumeHeight,
+                              VolumeZCount, tf, multiThread);
+    if (ShowProgressBar) {
+      cout << "# Sparse volume: " << sparseColoredVolume.activeBricks()
+           << " / " << sparseColoredVolume.totalBricks() << " bricks, "
+           << (sparseColoredVolume.bytes() >> 20) << " MiB (dense "
+           << ((sizeof(RGBAColor) * VoxelCount) >> 20) << " MiB)" << endl;
+    }
+  } else {
+    sparseColoredVolume.clear();
+    unmapColoredVolume();
+    volumeCache.cancel(coloredVolumeData);
+    string cacheName = volumeCacheName() + ";tf=" + name,
+           key = volumeKey() + ";tf=" + name + "@" +
+                 transferFunctionDigestHex(name);
+    size_t bytes = sizeof(RGBAColor) * VoxelCount;
+    auto cached = volumeCacheEnabled()
+                      ? volumeCache.find("classified", cacheName, key, bytes)
+                      : nullptr;
+    if (cached != nullptr) {
+      // read in place, paged in as rays reach it
+      cout << ">>> Classified volume mapped from cache." << endl;
+      coloredVolumeBuffer = coloredVolumeData;
+      coloredVolumeData = (RGBAColor *)cached->data();
+      mappedColoredVolume = std::move(cached);
+    } else {
+      forEachVolumeShare([&tf](int low, int high) {
+        tf(volumeData + low, high - low, coloredVolumeData + low);
+      });
+      if (volumeCacheEnabled()) {
+        volumeCache.store("classified", cacheName, key, coloredVolumeData,
+                          bytes);
+      }
+    }
+  }
+  runLengthVolumesReady = false;
+  gpuVolumeReady = false;
+}
+
+// Colors of transfer function `name` for voxel values 0 ~ max value in
+// `volumeData`, as many as a texture holds.
+vector<RGBAColor> transferFunctionLUT(const string &name) {
+  ASSERT(TransferFunctionMap.count(name) != 0,
+         "[ERROR] Invalid transfer function: " + name);
+  int maxValue = *std::max_element(volumeData, volumeData + VoxelCount);
+  int n = std::min(maxValue + 1, gpuRayCaster.maxTransferFunctionSize());
+  if (n <= maxValue) {
+    cerr << "[WARN] Voxel values above " << n - 1
+         << " take the color of it on GPU." << endl;
+  }
+  vector<uint16> values(n);
+  for (int i = 0; i < n; i++) {
+    values[i] = i;
+  }
+  vector<RGBAColor> res(n);
+  TransferFunctionMap[name](values.data(), n, res.data());
+  return res;
+}
+
+// Upload what GPU ray marching needs to textures, if not yet.
+void prepareGPUVolume() {
+  if (!gpuRayCaster.ready()) {
+    gpuRayCaster.init(helper, "./shader/vRayMarch.glsl",
+                      "./shader/fRayMarch.glsl");
+  }
+  bool classifyOnGPU = GPUVolumeFormat == "R16";
+  if ((classifyOnGPU || EnableLighting) && !gpuRawVolumeReady) {
+    gpuRayCaster.uploadRawVolume(volumeData, VolumeWidth, VolumeHeight,
+                                 VolumeZCount);
+    gpuRawVolumeReady = true;
+  }
+  if (!gpuVolumeReady) {
+    if (classifyOnGPU) {
+      gpuRayCaster.uploadTransferFunction(
+          transferFunctionLUT(TransferFunctionName));
+    } else {
+      gpuRayCaster.uploadColoredVolume(coloredVolumeData, VolumeWidth,
+                                       VolumeHeight, VolumeZCount);
+    }
+    gpuVolumeReady = true;
+  }
+  helper.switchProgram(mainProgram);
+}
+
+// Encode `coloredVolumeData` along each axis for shear-warp, one thread per
+// axis.
+void encodeRunLengthVolumes() {
+  threadPool.clear();
+  for (int axis = 0; axis < 3; axis++) {
+    threadPool.push_back(thread([axis]() {
+      buildRunLengthVolume(coloredVolumeData, VolumeWidth, VolumeHeight,
+                           VolumeZCount, axis, runLengthVolumes[axis]);
+    }));
+  }
+  for_each(threadPool.begin(), threadPool.end(), [=](thread &t) { t.join(); });
+  runLengthVolumesReady = true;
 }
 
 // Get interpolated color of pos using TriLinear method.
 RGBAColor colorInterpTriLinear(const vec3 &pos, const vec3 &bbox) {
-  int x0, y0, z0, x1, y1, z1; // integer positions
-  float xd, yd, zd;           // remainders
-  RGBAColor res;
+  int x0, y0, z0;   // integer positions
+  float xd, yd, zd; // remainders
 
   x0 = int(pos.x);
   xd = pos.x - x0;
-  x1 = x0 + 1;
-  x1 = x1 > bbox.x ? x1 - 1 : x1;
-
   y0 = int(pos.y);
   yd = pos.y - y0;
-  y1 = y0 + 1;
-  y1 = y1 > bbox.y ? y1 - 1 : y1;
-
   z0 = int(pos.z);
   zd = pos.z - z0;
-  z1 = z0 + 1;
-  z1 = z1 > bbox.z ? z1 - 1 : z1;
-
-  res =
-      (1 - xd) * (1 - yd) * (1 - zd) *
-          coloredVolumeData[getVoxelIndex(x0, y0, z0)] +
-      xd * (1 - yd) * (1 - zd) * coloredVolumeData[getVoxelIndex(x1, y0, z0)] +
-      (1 - xd) * yd * (1 - zd) * coloredVolumeData[getVoxelIndex(x0, y1, z0)] +
-      (1 - xd) * (1 - yd) * zd * coloredVolumeData[getVoxelIndex(x0, y0, z1)] +
-      xd * yd * (1 - zd) * coloredVolumeData[getVoxelIndex(x1, y1, z0)] +
-      xd * (1 - yd) * zd * coloredVolumeData[getVoxelIndex(x1, y0, z1)] +
-      (1 - xd) * yd * zd * coloredVolumeData[getVoxelIndex(x0, y1, z1)] +
-      xd * yd * zd * coloredVolumeData[getVoxelIndex(x1, y1, z1)];
-
-  zx::clipRGBA(res);
-  return res;
+
+  // address the 8 neighbours by offsets from the base voxel, which collapse
+  // to 0 at the far border of bounding box
+  int dx = x0 < bbox.x ? 1 : 0;
+  int dy = y0 < bbox.y ? VolumeWidth : 0;
+  int dz = z0 < bbox.z ? PixelPerSlice : 0;
+  const RGBAColor *base = coloredVolumeData + getVoxelIndex(x0, y0, z0);
+  return zx::blendTriLinear(base, dx, dy, dz, xd, yd, zd);
 }
 
 // Fusion `sample` color into `accumalted` using front-to-back iteration method.
@@ -268,65 +872,35 @@ void fusionColorFrontToBack(RGBAColor &accmulated, const RGBAColor &sample) {
   accmulated.a = accmulated.a + (1 - accmulated.a) * sample.a;
 }
 
-// Judge if point is inside bounding box.
-bool inBBox(const vec3 &point, const vec3 &bbox) {
-  return point.x >= 0 && point.x <= bbox.x && point.y >= 0 &&
-         point.y <= bbox.y && point.z >= 0 && point.z <= bbox.z;
+// Ray and bounding box intersection test using the slab method.
+// Tavian Barnes. "Fast, Branchless Ray/Bounding Box Intersections." 2011.
+// @see https://tavianator.com/2011/ray_box.html
+// The ray is origin + t * direction, with `invDirection` being the
+// component-wise reciprocal of direction (precomputed once per ray). Returns
+// whether the ray hits the bounding box, with [tEntry, tExit] being the
+// parameter range inside it. If the origin is already inside the bounding box,
+// tEntry is clamped to 0 so that we cast the ray from the origin.
+bool intersectTest(const vec3 &origin, const vec3 &invDirection,
+                   const vec3 &bbox, float &tEntry, float &tExit) {
+  vec3 tLow = -origin * invDirection;
+  vec3 tHigh = (bbox - origin) * invDirection;
+  vec3 tNear = glm::min(tLow, tHigh), tFar = glm::max(tLow, tHigh);
+  tEntry = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+  tExit = std::min(std::min(tFar.x, tFar.y), tFar.z);
+  return tEntry <= tExit;
 }
 
-// Helper function for `bool intersectTest`.
-bool _intersectTestOnePlane(const float origin, const float direction,
-                            const float bboxBorder, double &t0Final,
-                            double &t1Final) {
-  double bMin = 0, bMax = bboxBorder;
-  double t0, t1;
-
-  if (fabs(direction) > INTERSECT_EPSILON) { // direction != 0
-    t0 = (bMin - origin) / direction;
-    t1 = (bMax - origin) / direction;
-    if (t0 > t1) {
-      zx::swap<double>(t0, t1);
-    }
-    t0Final = std::max(t0Final, t0);
-    t1Final = std::min(t1Final, t1);
-
-    if (t0Final > t1Final || t1 < 0) {
-      return false; // must not intersect
-    }
-  }
-
-  return true; // cannot determine for now
-}
-
-// Ray and bounding box intersection test
-// Eric Haines. "Essential Ray Tracing Algorithms." An introduction to ray
-// tracing. pp.33, 1989.
-// @see https://zhuanlan.zhihu.com/p/138259656
-// origin->direction determines the ray
-// the entry point (or first intersect point exactly) is returned using &entry
-// with parameter &t
-bool intersectTest(const vec3 &origin, const vec3 &direction, const vec3 &bbox,
-                   vec3 &entry, float &t) {
-  // t0 is the parameter of entry, while t1 is of exit
-  double t0Final = -(DBL_MAX - 1), t1Final = DBL_MAX - 1;
-
-  if (!_intersectTestOnePlane(origin.x, direction.x, bbox.x, t0Final,
-                              t1Final) ||
-      !_intersectTestOnePlane(origin.y, direction.y, bbox.y, t0Final,
-                              t1Final) ||
-      !_intersectTestOnePlane(origin.z, direction.z, bbox.z, t0Final,
-                              t1Final)) {
-    return false;
+// Component-wise reciprocal of ray direction for `intersectTest`. Zero
+// components are nudged to INTERSECT_EPSILON to keep the slabs finite.
+vec3 reciprocalDirection(const vec3 &direction) {
+  vec3 res;
+  for (int i = 0; i < 3; i++) {
+    float d = direction[i];
+    res[i] = 1.0f / (fabs(d) > INTERSECT_EPSILON
+                         ? d
+                         : (d < 0 ? -INTERSECT_EPSILON : INTERSECT_EPSILON));
   }
-
-  // If t0Final > 0, there are two intersect points. So t0Final is for exact
-  // entry. But if t0Final < 0, then there is only exit, which means we are
-  // currently inside the bounding box. So we return source point instead.
-  // Then that we can cast the ray from here.
-  t = t0Final >= 0 ? t0Final : 0;
-  entry = vec3(origin + t * direction);
-
-  return true;
+  return res;
 }
 
 // Implement of a simple progressbar.
@@ -355,11 +929,29 @@ void applyLighting(RGBAColor &src, const vec3 &pos) {
   }
 }
 
+// Samplers of the classified volume for `castOneRay`, in `coloredVolumeData`
+// or in `sparseColoredVolume`. The ray march is instantiated per sampler, so
+// that the choice is made once per ray instead of per sample.
+struct DenseSampler {
+  RGBAColor operator()(const vec3 &pos, const vec3 &bbox) const {
+    return colorInterpTriLinear(pos, bbox);
+  }
+};
+struct BrickedSampler {
+  RGBAColor operator()(const vec3 &pos, const vec3 &bbox) const {
+    return sparseColoredVolume.interpolate(pos);
+  }
+};
+
 // Cast one ray corresponding to (u, v) at image plane
-// according to `coloredVolumeData`. Returns the fused (blended) RGBAColor.
-void castOneRay(int u, int v, const vec3 &bbox, const mat3 &rotateMat,
-                const vec3 &translateVec,
-                const RGBAColor &defaultColor = RGBAColor(RGBBlack, 1.0)) {
+// according to the classified volume read by `sampler`. The fused (blended)
+// RGBAColor is filled into the image plane, and its statistics into `stats` if
+// given. Returns the number of samples taken.
+template <typename Sampler>
+int castOneRay(const Sampler &sampler, int u, int v, const vec3 &bbox,
+               const mat3 &rotateMat, const vec3 &translateVec,
+               const RGBAColor &defaultColor = backgroundColor,
+               RayStats *stats = nullptr) {
   RGBAColor accumulated(0, 0, 0, 0); // acuumulated color during line integral
 
   // use parallel projection
@@ -368,22 +960,37 @@ void castOneRay(int u, int v, const vec3 &bbox, const mat3 &rotateMat,
   vec3 direction(initEyeDirection);
   // transform to object coordinate
   // [xobj, yobj, zobj](t) = [x, y, tz]R+T
-  source = source * rotateMat;
-  // the direction of ray is changed too
-  direction = glm::normalize(direction * rotateMat);
+  // then scale to voxel coordinate by spacing
+  source = source * rotateMat / VolumeSpacing;
+  // the direction of ray is changed too, so that t is still physical length
+  direction = glm::normalize(direction * rotateMat) / VolumeSpacing;
 
-  vec3 entry;            // entry point of ray into bounding box
   vec3 samplePos;        // current voxel coordinate
   RGBAColor sampleColor; // current color (at current voxel)
-  float paramT; // parameter t of entry or exit point (first intersect point)
-
-  if (intersectTest(source, direction, bbox, entry, paramT)) {
+  float tEntry, tExit;   // parameter t of entry and exit point
+
+  if (intersectTest(source, reciprocalDirection(direction), bbox, tEntry,
+                    tExit)) {
+    // start within the first step by the jitter of the pixel, if any
+    float tStart = tEntry;
+    if (JitterRays) {
+      tStart += rayJitter(u, v, progressivePass) * SamplingDelta;
+    }
+    // the number of samples is known beforehand, so the march loop needs no
+    // bounding box check per sample
+    int nSamples =
+        tStart <= tExit ? int((tExit - tStart) / SamplingDelta) + 1 : 0;
+    vec3 stepVec = SamplingDelta * direction;
     // initialize samplePos
-    samplePos = entry;
+    samplePos = source + tStart * direction;
     // march the ray
-    while (inBBox(samplePos, bbox) && accumulated.a < 1.0) {
+    int i;
+    for (i = 0; i < nSamples && accumulated.a < 1.0; i++) {
       // get sampleColor via interpolation
-      sampleColor = colorInterpTriLinear(samplePos, bbox);
+      sampleColor = sampler(samplePos, bbox);
+      if (stats != nullptr && sampleColor.a <= 0) {
+        stats->transparent++;
+      }
       // light it
       if (EnableLighting) {
         applyLighting(sampleColor, samplePos);
@@ -391,48 +998,171 @@ void castOneRay(int u, int v, const vec3 &bbox, const mat3 &rotateMat,
       // Cout = Cin + (1-ain)aiCi
       fusionColorFrontToBack(accumulated, sampleColor);
       // go forward
-      samplePos += SamplingDelta * direction;
+      samplePos += stepVec;
     }
     // fill the image plane
     zx::clipRGBA(accumulated);
     imagePlane[getPixelIndex(v, u)] = RGBAColor(accumulated);
+    if (stats != nullptr) {
+      stats->samples = i;
+      stats->skipped = nSamples - i;
+      if (accumulated.a >= 1.0) {
+        stats->depth = tStart + (i - 1) * SamplingDelta;
+      }
+    }
     // record intersect count
     multiThreadMutex.lock();
     intersectCount++;
     multiThreadMutex.unlock();
+    return i;
   } else {
     imagePlane[getPixelIndex(v, u)] = RGBAColor(defaultColor);
+    return 0;
   }
 }
 
-// Written in this form to support multi-thread processing.
-void castSomeRays(int rowLow, int rowHigh) {
-  for (int r = rowLow; r < rowHigh; r++) {
-    for (int c = 0; c < ImagePlaneWidth; c++) {
-      castOneRay(c, r, bbox, currentRotateMatrix, eyePos);
+// Fill the image plane with background, and collect tiles that overlap the
+// footprint of bounding box. Each tile is owned by the worker whose rows
+// (`threadParamRanges`) it starts in.
+void prepareTiles() {
+  std::fill(imagePlane, imagePlane + ImagePlaneSize, backgroundColor);
+  vector<Tile> tiles = footprintTiles(
+      projectBBoxCorners(bbox * VolumeSpacing, currentRotateMatrix, eyePos),
+      ImagePlaneWidth, ImagePlaneHeight, TILE_SIZE);
+
+  workerTiles.assign(multiThread, vector<Tile>());
+  workerTileCursors = vector<std::atomic<int>>(multiThread);
+  for (const auto &tile : tiles) {
+    int owner = 0;
+    while (owner < multiThread - 1 &&
+           tile.v0 >= threadParamRanges.at(owner).second) {
+      owner++;
+    }
+    workerTiles[owner].push_back(tile);
+  }
+  for (auto &cursor : workerTileCursors) {
+    cursor = 0;
+  }
+  tilesCast = 0;
+  tilesTotal = tiles.size();
+  rayCount = 0;
+}
+
+// Cast the ray of pixel (u, v) through `sampler`, recording its statistics if
+// they are collected. Returns the number of samples taken.
+template <typename Sampler>
+int castPixel(const Sampler &sampler, int u, int v) {
+  if (rayStats.empty()) {
+    return castOneRay(sampler, u, v, bbox, currentRotateMatrix, eyePos);
+  }
+  RayStats &stats = rayStats[getPixelIndex(v, u)];
+  auto tic = std::chrono::steady_clock::now();
+  int samples = castOneRay(sampler, u, v, bbox, currentRotateMatrix, eyePos,
+                           backgroundColor, &stats);
+  auto toc = std::chrono::steady_clock::now();
+  stats.cast = true;
+  stats.seconds = std::chrono::duration<float>(toc - tic).count();
+  return samples;
+}
+// The same with the sampler of the classified volume in use.
+int castPixel(int u, int v) {
+  return SparseVolume ? castPixel(BrickedSampler(), u, v)
+                      : castPixel(DenseSampler(), u, v);
+}
+
+// Cast rays of `tile`, adaptively if AdaptiveStep > 1. Returns the number of
+// samples taken, with rays cast added to `rays`.
+long long castTile(const Tile &tile, int &rays) {
+  long long samples = 0;
+  if (AdaptiveStep > 1) {
+    rays += castTileAdaptive(
+        tile, AdaptiveStep, AdaptiveThreshold,
+        [&](int u, int v) {
+          samples += castPixel(u, v);
+          return imagePlane[getPixelIndex(v, u)];
+        },
+        [](int u, int v, const RGBAColor &color) {
+          imagePlane[getPixelIndex(v, u)] = color;
+        });
+    return samples;
+  }
+  for (int r = tile.v0; r < tile.v1; r++) {
+    for (int c = tile.u0; c < tile.u1; c++) {
+      samples += castPixel(c, r);
     }
-    if (rowLow == 0) { // the first thread
-      updateProgressBar(progress = progress + progressPerThreadPerRow);
+  }
+  rays += (tile.u1 - tile.u0) * (tile.v1 - tile.v0);
+  return samples;
+}
+
+// Written in this form to support multi-thread processing. The worker casts
+// its own tiles first, then helps the others with what is left.
+void castSomeTiles(int worker) {
+  pinWorker(worker);
+  long long samples = 0;
+  int rays = 0;
+  for (int k = 0; k < multiThread; k++) {
+    int owner = (worker + k) % multiThread;
+    const vector<Tile> &tiles = workerTiles[owner];
+    int t;
+    while ((t = workerTileCursors[owner]++) < (int)tiles.size()) {
+      samples += castTile(tiles[t], rays);
+      int done = ++tilesCast;
+      if (worker == 0 && ShowProgressBar) { // the first thread
+        updateProgressBar((float)done / tilesTotal);
+      }
     }
   }
+  multiThreadMutex.lock();
+  sampleCount += samples;
+  rayCount += rays;
+  multiThreadMutex.unlock();
 }
 
 // Multi-thread Ray Casting
 void castAllRays() {
+  prepareTiles();
   threadPool.clear();
   for (int i = 0; i < multiThread; i++) {
-    threadPool.push_back(thread(castSomeRays, threadParamRanges.at(i).first,
-                                threadParamRanges.at(i).second));
+    threadPool.push_back(thread(castSomeTiles, i));
   }
   for_each(threadPool.begin(), threadPool.end(), [=](thread &t) { t.join(); });
 }
 
 // Single-thread Ray Casting (for debug only)
-void castAllRaysSingleThread() { castSomeRays(0, ImagePlaneHeight); }
+void castAllRaysSingleThread() {
+  prepareTiles();
+  castSomeTiles(0);
+}
+
+// Shear-warp rendering of the whole image plane.
+void shearWarpAll() {
+  function<void(RGBAColor &, const vec3 &)> lighting;
+  if (EnableLighting) {
+    lighting = applyLighting;
+  }
+  sampleCount = shearWarpRender(
+      runLengthVolumes, currentRotateMatrix, eyePos, initEyeDirection,
+      VolumeSpacing, SamplingDelta, ImagePlaneWidth, ImagePlaneHeight,
+      imagePlane, backgroundColor, multiThread, lighting);
+  rayCount = ImagePlaneSize;
+}
+
+// GPU ray marching of the whole image plane.
+void gpuRayCastAll() {
+  sampleCount = gpuRayCaster.render(
+      currentRotateMatrix, eyePos, VolumeSpacing, bbox, SamplingDelta,
+      GPUVolumeFormat == "RGBA8", EnableLighting, KAmbient, ImagePlaneWidth,
+      ImagePlaneHeight, imagePlane, backgroundColor, intersectCount);
+  rayCount = ImagePlaneSize;
+  helper.switchProgram(mainProgram);
+}
 
 // Median filtering the image plane.
 void medianFilter(int ksize) {
   RGBAColor *tempRes = new RGBAColor[ImagePlaneSize]; // alloc on demand
+  // borders are not filtered, keep them as is
+  std::copy(imagePlane, imagePlane + ImagePlaneSize, tempRes);
   vector<vec4> vs;
   int pad = (ksize - 1) / 2;
   int middle = (ksize * ksize - 1) / 2;
@@ -451,55 +1181,278 @@ void medianFilter(int ksize) {
     }
   }
   std::copy(tempRes, tempRes + ImagePlaneSize, imagePlane);
-  delete tempRes;
+  delete[] tempRes;
 }
 
-// The very main
-void rayCasting() {
+// Build what RenderEngine needs from the classified volume, if not yet.
+void prepareAcceleration() {
+  if (RenderEngine == "ShearWarp" && !runLengthVolumesReady) {
+    encodeRunLengthVolumes();
+  } else if (RenderEngine == "GPU") {
+    prepareGPUVolume();
+  }
+}
+
+// Save heatmaps of ray statistics to RayStatsPath with the channel name
+// appended, and their summaries to a .txt file beside, also shown in console.
+void writeRayStats() {
+  string path = numberedPath(RayStatsPath, rayStatsIndex++);
+  size_t dot = path.find_last_of('.');
+  string base = path.substr(0, dot), ext = path.substr(dot);
+  stringstream summaries;
+  for (int channel = 0; channel < STATS_CHANNEL_COUNT; channel++) {
+    RayStatsSummary summary = summarizeRayStats(rayStats, channel);
+    summaries << formatRayStatsSummary(summary, channel);
+    // scaled to p99, so that a few outliers do not wash the rest out
+    vector<RGBAColor> heatmap =
+        rayStatsHeatmap(rayStats, channel, summary.p99);
+    ImageFrame frame;
+    frame.path = base + "_" + RayStatsChannelNames[channel] + ext;
+    frame.format = imageFormatOfPath(frame.path);
+    frame.bitDepth = 8;
+    convertImagePlane(heatmap.data(), ImagePlaneWidth, ImagePlaneHeight,
+                      multiThread, frame);
+    if (!imageWriter.push(std::move(frame))) {
+      cerr << "[WARN] Output queue is full, heatmap dropped." << endl;
+    }
+  }
+  std::ofstream summaryFile(base + ".txt");
+  summaryFile << summaries.str();
+  if (!summaryFile.good()) {
+    cerr << "[WARN] Cannot write ray statistics: " << base + ".txt" << endl;
+  }
+  cout << endl << summaries.str();
+}
+
+// # passes averaged for a still view, 1 unless rays of the ray casting engine
+// are jittered.
+int progressivePassCount() {
+  return JitterRays && RenderEngine == "RayCasting"
+             ? std::max(1, ProgressivePasses)
+             : 1;
+}
+
+// Render the image plane with RenderEngine, and keep a copy of it before
+// filtering, averaged with the passes before if `progressivePass` > 0.
+// Returns rendering time (secs).
+double castImagePlane() {
   // prepare for a new rendering
   intersectCount = 0;
-  progress = 0.0;
+  sampleCount = 0;
+  allocateImagePlane();
+  rayStats.clear();
+  if (!RayStatsPath.empty()) {
+    rayStats.resize(ImagePlaneSize);
+  }
+  // acceleration belongs to classification, which is not timed
+  prepareAcceleration();
+
+  auto tic = std::chrono::steady_clock::now();
+  if (RenderEngine == "ShearWarp") {
+    shearWarpAll();
+  } else if (RenderEngine == "GPU") {
+    gpuRayCastAll();
+  } else {
+    castAllRays();
+  }
+  auto toc = std::chrono::steady_clock::now();
+  if (progressivePass > 0 &&
+      unfilteredImagePlane.size() == (size_t)ImagePlaneSize) {
+    // running mean of the passes
+    float weight = 1.0f / (progressivePass + 1);
+    for (int i = 0; i < ImagePlaneSize; i++) {
+      unfilteredImagePlane[i] =
+          glm::mix(unfilteredImagePlane[i], imagePlane[i], weight);
+    }
+    std::copy(unfilteredImagePlane.begin(), unfilteredImagePlane.end(),
+              imagePlane);
+  } else {
+    unfilteredImagePlane.assign(imagePlane, imagePlane + ImagePlaneSize);
+  }
+  if (!rayStats.empty()) {
+    writeRayStats();
+  }
+  return std::chrono::duration<double>(toc - tic).count();
+}
 
-  cout << ">>> Restart ray casting using " << multiThread << " threads..."
-       << endl;
-  time_t tic = time(NULL);
-  castAllRays();
-  time_t toc = time(NULL);
+// Post-process the image plane, starting from its unfiltered copy.
+void filterImagePlane() {
+  std::copy(unfilteredImagePlane.begin(), unfilteredImagePlane.end(),
+            imagePlane);
+  // check if we need to perform median filtering
+  if (MedianFilterKSize > 0) {
+    ASSERT(MedianFilterKSize % 2 == 1, "MedianFilterKSize should be odd.");
+    if (ShowProgressBar) {
+      cout << endl << "Performing Median Filtering..." << endl;
+    }
+    medianFilter(MedianFilterKSize);
+  }
+}
 
+// Cast and post-process the image plane, in all progressive passes. No GL
+// call is made here, so that it also serves the headless benchmark. Returns
+// rendering time (secs), with `sampleCount` of all passes.
+double renderImagePlane() {
+  double elapsed = 0;
+  long long samples = 0;
+  int passes = progressivePassCount();
+  for (progressivePass = 0; progressivePass < passes; progressivePass++) {
+    elapsed += castImagePlane();
+    samples += sampleCount;
+  }
+  progressivePass = 0;
+  sampleCount = samples;
+  filterImagePlane();
+  return elapsed;
+}
+
+// Everything the unfiltered image plane depends on, as image cache key.
+// Camera is quantized, so that positions reached by different key presses
+// match despite rounding errors. Spilled image planes outlive the run, so the
+// key also holds the digest of the transfer function and IMAGE_CACHE_VERSION.
+string imagePlaneKey() {
+  stringstream key;
+  auto quantize = [](const vec3 &v) {
+    return std::to_string(std::lround(v.x * 1000)) + "," +
+           std::to_string(std::lround(v.y * 1000)) + "," +
+           std::to_string(std::lround(v.z * 1000));
+  };
+  key << "v=" << IMAGE_CACHE_VERSION << ";eye=" << quantize(normalizedEyePos)
+      << ";pos=" << quantize(eyePos) << ";" << volumeKey()
+      << ";tf=" << TransferFunctionName << "@"
+      << transferFunctionDigestHex(TransferFunctionName)
+      << ";engine=" << RenderEngine
+      << ";plane=" << ImagePlaneWidth << "x" << ImagePlaneHeight
+      << ";delta=" << SamplingDelta;
+  if (AdaptiveStep > 1 && RenderEngine == "RayCasting") {
+    key << ";adaptive=" << AdaptiveStep << "@" << AdaptiveThreshold;
+  }
+  if (JitterRays && RenderEngine == "RayCasting") {
+    key << ";jitter=" << progressivePass;
+  }
+  if (RenderEngine == "GPU") {
+    key << ";format=" << GPUVolumeFormat;
+  }
+  if (EnableLighting) {
+    key << ";ambient=" << KAmbient;
+  }
+  return key.str();
+}
+
+// Cast the image plane, or take it from image cache if enabled. Returns
+// rendering time (secs), or -1 if found in cache.
+double castCachedImagePlane() {
+  if (!progressiveRefining) {
+    progressivePass = 0; // a new view
+  }
+  progressiveRefining = false;
+  currentImage = nullptr;
+  if (ImageCacheMB > 0) {
+    currentImageKey = imagePlaneKey();
+    // ray statistics need the rays cast
+    if (RayStatsPath.empty()) {
+      currentImage =
+          imageCache.find(currentImageKey, ImagePlaneWidth, ImagePlaneHeight);
+    }
+  }
+  if (currentImage != nullptr) {
+    allocateImagePlane();
+    unfilteredImagePlane = currentImage->unfiltered;
+    return -1;
+  }
+
+  double elapsed = castImagePlane();
+  if (ImageCacheMB > 0) {
+    currentImage = std::make_shared<CachedImagePlane>();
+    currentImage->width = ImagePlaneWidth;
+    currentImage->height = ImagePlaneHeight;
+    currentImage->unfiltered = unfilteredImagePlane;
+    imageCache.put(currentImageKey, currentImage);
+  }
+  return elapsed;
+}
+
+// The very main
+void rayCasting() {
+  cout << ">>> Restart rendering (" << RenderEngine << ") using "
+       << multiThread << " threads..." << endl;
+  // recalculate rotate matrix
+  currentRotateMatrix =
+      UntranslatedLookAt(normalizedEyePos, WORLD_ORIGIN, VEC_UP);
+  double elapsed = castCachedImagePlane();
+
+  if (progressivePassCount() > 1) {
+    cout << "Progressive pass: " << progressivePass + 1 << " / "
+         << progressivePassCount() << endl;
+  }
+  if (elapsed < 0) {
+    cout << "Image plane found in cache." << endl;
+  } else {
+    cout << endl
+         << "# Ray intersect: " << intersectCount << endl
+         << "# Ray cast: " << rayCount << " / " << ImagePlaneSize << endl
+         << "# Samples: " << sampleCount << endl
+         << "Time elapsed: " << elapsed << " secs." << endl;
+  }
+
+  if (ImageCacheMB > 0) {
+    const ImageCacheStats &stats = imageCache.stats();
+    cout << "# Image cache: " << stats.hits << " hits (" << stats.diskHits
+         << " from disk), " << stats.misses << " misses, "
+         << imageCache.size() << " planes in "
+         << (imageCache.bytes() >> 20) << " MiB" << endl;
+  }
+  cout << endl;
+}
+
+// Post-process the image plane, reusing the filtered one in cache if any.
+void filterCachedImagePlane() {
+  if (currentImage == nullptr || MedianFilterKSize == 0) {
+    filterImagePlane();
+    return;
+  }
+  if (currentImage->filterKSize == MedianFilterKSize) {
+    std::copy(currentImage->filtered.begin(), currentImage->filtered.end(),
+              imagePlane);
+    return;
+  }
+  filterImagePlane();
+  currentImage->filtered.assign(imagePlane, imagePlane + ImagePlaneSize);
+  currentImage->filterKSize = MedianFilterKSize;
+  imageCache.put(currentImageKey, currentImage); // account for growth
+}
+
+// Show the image plane as texture.
+void uploadImagePlane() {
   // release previous texture
   if (currentTexId != -1) {
     GL_OBJECT_ID x = currentTexId;
     glDeleteTextures(1, &x);
   }
-  // check if we need to perform median filtering
-  if (MedianFilterKSize > 0) {
-    ASSERT(MedianFilterKSize % 2 == 1, "MedianFilterKSize should be odd.");
-    cout << endl << "Performing Median Filtering..." << endl;
-    medianFilter(MedianFilterKSize);
-  }
   // store image plane in a new texture
   currentTexId = helper.createTexture2D(imagePlane, GL_RGBA, ImagePlaneWidth,
                                         ImagePlaneHeight, GL_FLOAT);
 
-  // If we need to save image plane as file: (for debug only)
-  // FILE *fp;
-  // fopen_s(&fp, "./ImagePlane.raw", "wb");
-  // for (int i = 0; i < ImagePlaneSize; i++) {
-  //   fwrite(&(imagePlane[i].r), sizeof(float), 1, fp);
-  //   fwrite(&(imagePlane[i].g), sizeof(float), 1, fp);
-  //   fwrite(&(imagePlane[i].b), sizeof(float), 1, fp);
-  //   // discard alpha channel
-  // }
-  // fclose(fp);
-
-  cout << endl
-       << "# Ray intersect: " << intersectCount << endl
-       << "# Ray cast: " << ImagePlaneSize << endl
-       << "Time elapsed: " << toc - tic << " secs." << endl
-       << endl
-       << ">>> Start rendering..." << endl
-       << endl;
-  helper.prepareUniforms(vector<UPrepInfo>{{"uTexture", currentTexId, "1i"}});
+  cout << ">>> Start rendering..." << endl << endl;
+  helper.setUniform(helper.getUniformLocation("uTexture"), (int)currentTexId);
+}
+
+// Queue the image plane for saving to OutputPath, if set. Of progressive
+// passes, only the last one is saved.
+void writeImagePlane() {
+  if (OutputPath.empty() || progressivePass + 1 < progressivePassCount()) {
+    return;
+  }
+  ImageFrame frame;
+  frame.path = numberedPath(OutputPath, outputFrameIndex++);
+  frame.format = imageFormatOfPath(OutputPath);
+  frame.bitDepth = OutputBitDepth;
+  convertImagePlane(imagePlane, ImagePlaneWidth, ImagePlaneHeight, multiThread,
+                    frame);
+  if (!imageWriter.push(std::move(frame))) {
+    cerr << "[WARN] Output queue is full, frame dropped ("
+         << imageWriter.dropped() << " in total)." << endl;
+  }
 }
 
 void consoleLogWelcome() {
@@ -512,10 +1465,294 @@ void consoleLogWelcome() {
           "Left / Right Arrow Key: Go Left / Right\n"
           "Up / Down Arrow Key: Look Upper / Bottom\n"
           "W / S Key: Go Forward / Backward\n"
+          "Space Key: Play / Pause Frames\n"
+          "[ / ] Key: Previous / Next Frame\n"
           "########################\n";
 }
 
-int main() {
+// Show `frame` of time-varying volume, waiting for it if not loaded yet.
+// Classification is left to the classify stage.
+void acquireFrame(int frame) {
+  if (!volumeSequence.ready(frame)) {
+    cout << ">>> Waiting for frame " << frame << "..." << endl;
+  }
+  currentSlot = volumeSequence.acquire(frame);
+  currentFrame = frame;
+  volumeData = currentSlot->volume;
+  coloredVolumeData = currentSlot->colored;
+  VolumePath = VolumeFrames[frame];
+  volumeFile = frameFiles[frame];
+  gpuRawVolumeReady = false;
+  lastFrameTime = std::chrono::steady_clock::now();
+  cout << "[Frame]: " << frame + 1 << " / " << frameFiles.size() << endl;
+}
+
+// Load volume data from file, or generate the phantom.
+void loadVolumeData() {
+  if (volumeFromSequence) {
+    acquireFrame(currentFrame);
+    return;
+  }
+  firstTouchVolume();
+  gpuRawVolumeReady = false;
+  // raw volume files of the native layout read as fast as cache files
+  bool cacheable = volumeCacheEnabled() &&
+                   (!Phantom.empty() || volumeFileNeedsDecoding(volumeFile));
+  size_t bytes = sizeof(uint16) * VoxelCount;
+  if (cacheable) {
+    auto cached =
+        volumeCache.find("decoded", volumeCacheName(), volumeKey(), bytes);
+    if (cached != nullptr) {
+      cout << ">>> Volume data loaded from cache." << endl;
+      const uint16 *src = (const uint16 *)cached->data();
+      forEachVolumeShare([src](int low, int high) {
+        std::copy(src + low, src + high, volumeData + low);
+      });
+      return;
+    }
+  }
+  if (Phantom.empty()) {
+    loadVolumeFile(volumeFile, volumeData, multiThread);
+  } else {
+    cout << ">>> Generating phantom " << Phantom << "..." << endl;
+    generatePhantom(getPhantomByName(Phantom), VolumeWidth, VolumeHeight,
+                    VolumeZCount, volumeData, multiThread);
+  }
+  if (cacheable) {
+    volumeCache.store("decoded", volumeCacheName(), volumeKey(), volumeData,
+                      bytes);
+  }
+}
+
+// Create an invisible window as GL context for the GPU engine, when there is
+// no window.
+void initHeadlessGL() {
+  GLFWwindow *window = initGLWindow("2-raycasting", 1, 1, false);
+  helper = ReNowHelper(window);
+}
+
+// Release GL objects of the GPU engine and the context.
+void terminateGL() {
+  gpuRayCaster.release();
+  helper.freeAllocatedObjects();
+  glfwTerminate();
+}
+
+// Apply transfer function, unless the frame shown was classified by it ahead.
+void classifyVolume() {
+  if (currentSlot != nullptr && !SparseVolume &&
+      currentSlot->transferFunction == TransferFunctionName) {
+    // acceleration structures are of the previous frame
+    runLengthVolumesReady = false;
+    gpuVolumeReady = false;
+    return;
+  }
+  cout << ">>> Start applying transfer function..." << endl;
+  cout << "[Transfer Function Name]: " << TransferFunctionName << endl;
+  applyTransferFunction(TransferFunctionName);
+  if (currentSlot != nullptr) {
+    volumeSequence.markClassified(currentSlot, TransferFunctionName);
+    updateFrameTransferFunction();
+  }
+}
+
+// Cast the next progressive pass of the view when nothing else is pending,
+// until all are averaged.
+void refineProgressively() {
+  if (pipeline.pending() || progressivePass + 1 >= progressivePassCount()) {
+    return;
+  }
+  progressivePass++;
+  progressiveRefining = true;
+  pipeline.invalidate(STAGE_CAST);
+}
+
+// Show the next frame of time-varying volume when playing, as soon as the
+// current one is rendered and the next one is loaded.
+void advancePlayback() {
+  if (!playing || !volumeFromSequence || pipeline.pending()) {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  if (PlaybackFPS > 0 &&
+      std::chrono::duration<double>(now - lastFrameTime).count() <
+          1.0 / PlaybackFPS) {
+    return;
+  }
+  int next = (currentFrame + 1) % frameFiles.size();
+  if (volumeSequence.ready(next)) {
+    acquireFrame(next);
+    pipeline.invalidate(STAGE_CLASSIFY);
+  }
+}
+
+// Render every scenario of benchmark suite at `suitePath` without window,
+// recording golden images if `record`, and checking time against report at
+// `baselinePath` if not empty. Returns # scenarios that failed.
+int runBenchmark(const string &suitePath, bool record,
+                 const string &baselinePath) {
+  BenchmarkSuite suite = loadBenchmarkSuite(suitePath);
+  suite.record = record;
+  if (!baselinePath.empty()) {
+    suite.baselineSeconds = loadBenchmarkBaseline(baselinePath);
+  }
+  multiThread = suite.multiThread;
+  PinThreads = suite.pinThreads;
+  assignThreadCores({});
+  VolumeHugePages = parseHugePageMode(suite.hugePages);
+  ShowProgressBar = false;
+  bool needGL = std::any_of(
+      suite.scenarios.begin(), suite.scenarios.end(),
+      [](const BenchmarkScenario &sc) { return sc.renderEngine == "GPU"; });
+  if (needGL) {
+    initHeadlessGL();
+  }
+
+  vector<BenchmarkResult> results;
+  string loadedVolume, appliedTransferFunction; // avoid redundant preparing
+  for (const auto &sc : suite.scenarios) {
+    cout << ">>> Running scenario " << sc.name << "..." << endl;
+    // prepare volume
+    string volumeKey = sc.phantom + "@" + std::to_string(sc.volumeWidth) +
+                       "x" + std::to_string(sc.volumeHeight) + "x" +
+                       std::to_string(sc.volumeZCount) +
+                       (sc.sparseVolume ? ";sparse" : "");
+    if (volumeKey != loadedVolume) {
+      Phantom = sc.phantom;
+      VolumeWidth = sc.volumeWidth;
+      VolumeHeight = sc.volumeHeight;
+      VolumeZCount = sc.volumeZCount;
+      VolumeSpacing = vec3(1, 1, 1);
+      SparseVolume = sc.sparseVolume;
+      allocateVolume();
+      loadVolumeData();
+      loadedVolume = volumeKey;
+      appliedTransferFunction = "";
+    }
+    if (sc.transferFunction != appliedTransferFunction) {
+      TransferFunctionName = sc.transferFunction;
+      applyTransferFunction(TransferFunctionName);
+      appliedTransferFunction = sc.transferFunction;
+    }
+    // prepare image plane and rendering parameters
+    ImagePlaneWidth = sc.imagePlaneWidth;
+    ImagePlaneHeight = sc.imagePlaneHeight;
+    allocateImagePlane();
+    SamplingDelta = sc.samplingDelta;
+    EnableLighting = sc.enableLighting;
+    KAmbient = sc.kAmbient;
+    MedianFilterKSize = sc.medianFilterKSize;
+    RenderEngine = sc.renderEngine;
+    AdaptiveStep = sc.adaptiveStep;
+    AdaptiveThreshold = sc.adaptiveThreshold;
+    JitterRays = sc.jitterRays;
+    ProgressivePasses = sc.progressivePasses;
+    normalizedEyePos = sc.normalizedEyePos;
+    eyePos = vec3(0, 0, sc.eyeZ > 0 ? sc.eyeZ
+                                        : VolumeZCount * VolumeSpacing.z + 1);
+    currentRotateMatrix =
+        UntranslatedLookAt(normalizedEyePos, WORLD_ORIGIN, VEC_UP);
+    // render
+    vector<double> seconds;
+    for (int i = 0; i < sc.repeat; i++) {
+      seconds.push_back(renderImagePlane());
+    }
+    results.push_back(
+        evaluateScenario(suite, sc, seconds, sampleCount, imagePlane));
+  }
+
+  if (needGL) {
+    terminateGL();
+  }
+
+  cout << endl;
+  reportBenchmark(suite, results);
+  return (int)std::count_if(
+      results.begin(), results.end(), [](const BenchmarkResult &r) {
+        return r.status == "MISMATCH" || r.status == "SLOW" ||
+               r.status == "MISSING";
+      });
+}
+
+// Render a request of the render server over the loaded volume.
+RenderResult renderServerRequest(const RenderRequest &req) {
+  RenderResult res;
+  auto tic = std::chrono::steady_clock::now();
+  if (req.transferFunction != TransferFunctionName) {
+    applyTransferFunction(req.transferFunction);
+    TransferFunctionName = req.transferFunction;
+  }
+  ImagePlaneWidth = req.width;
+  ImagePlaneHeight = req.height;
+  normalizedEyePos = req.normalizedEyePos;
+  eyePos = vec3(0, 0, req.eyeDistance);
+  currentRotateMatrix =
+      UntranslatedLookAt(normalizedEyePos, WORLD_ORIGIN, VEC_UP);
+  castCachedImagePlane();
+  filterCachedImagePlane();
+  auto toc = std::chrono::steady_clock::now();
+  res.renderMs = std::chrono::duration<double, std::milli>(toc - tic).count();
+
+  ImageFrame frame;
+  frame.format = req.format;
+  frame.bitDepth = req.bitDepth;
+  convertImagePlane(imagePlane, ImagePlaneWidth, ImagePlaneHeight, multiThread,
+                    frame);
+  res.image = encodeImageFrame(frame);
+  tic = std::chrono::steady_clock::now();
+  res.encodeMs = std::chrono::duration<double, std::milli>(tic - toc).count();
+  return res;
+}
+
+// Serve render requests over the volume in config file without window, at
+// `address` or ServerAddress if empty.
+int runServer(const string &address) {
+  loadConfigFileAndInitialize();
+  ShowProgressBar = false;
+  if (RenderEngine == "GPU") {
+    initHeadlessGL();
+  }
+  allocateVolume();
+  loadVolumeData();
+  applyTransferFunction(TransferFunctionName);
+
+  RenderRequest defaults;
+  defaults.normalizedEyePos = normalizedEyePos;
+  defaults.eyeDistance = VolumeZCount * VolumeSpacing.z + 1;
+  defaults.transferFunction = TransferFunctionName;
+  defaults.width = ImagePlaneWidth;
+  defaults.height = ImagePlaneHeight;
+  RenderServer server(address.empty() ? ServerAddress : address, defaults,
+                      ServerBatchWindowMs, ServerMaxBatch, ServerAllowShutdown);
+  server.serve(renderServerRequest);
+  volumeCache.flush();
+  if (RenderEngine == "GPU") {
+    terminateGL();
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  // benchmark mode
+  if (argc >= 3 && string(argv[1]) == "--benchmark") {
+    bool record = false;
+    string baselinePath;
+    for (int i = 3; i < argc; i++) {
+      if (string(argv[i]) == "--record") {
+        record = true;
+      } else if (string(argv[i]) == "--baseline" && i + 1 < argc) {
+        baselinePath = argv[++i];
+      } else {
+        ASSERT(false, "[ERROR] Unknown benchmark option: " + string(argv[i]));
+      }
+    }
+    return runBenchmark(argv[2], record, baselinePath) > 0 ? 1 : 0;
+  }
+  // server mode
+  if (argc >= 2 && string(argv[1]) == "--serve") {
+    return runServer(argc >= 3 ? argv[2] : "");
+  }
+
   // initialize
   consoleLogWelcome();
   loadConfigFileAndInitialize();
@@ -533,22 +1770,35 @@ int main() {
 
   // take over management
   helper = ReNowHelper(window);
+  FrameProfiler &profiler = helper.profiler();
+  if (Profile) {
+    profiler.enable(ProfilePath, ProfileReportEvery);
+  }
   // organize the program
   GL_SHADER_ID vShader =
                    helper.createShader(GL_VERTEX_SHADER, "./shader/vMain.glsl"),
                fShader = helper.createShader(GL_FRAGMENT_SHADER,
                                              "./shader/fMain.glsl");
-  GL_PROGRAM_ID mainProgram = helper.createProgram(vShader, fShader);
+  mainProgram = helper.createProgram(vShader, fShader);
   helper.switchProgram(mainProgram);
 
-  // load volume data
-  readFileBinary(VolumePath, BytesPerVoxel, VoxelCount, volumeData);
-
-  // apply transfer function
-  cout << ">>> Start applying transfer function..." << endl;
-  cout << "[Transfer Function Name]: " << TransferFunctionName << endl;
-  applyTransferFunction(TransferFunctionName);
-  cout << endl;
+  // organize the rendering pipeline, every stage runs at the first frame
+  pipeline.setStage(STAGE_LOAD, "load", []() {
+    allocateVolume();
+    loadVolumeData();
+    // far enough to hold the whole volume in view
+    eyePos = vec3(0, 0, VolumeZCount * VolumeSpacing.z + 1);
+  });
+  pipeline.setStage(STAGE_CLASSIFY, "classify", classifyVolume);
+  pipeline.setStage(STAGE_ACCEL, "accel", prepareAcceleration);
+  pipeline.setStage(STAGE_CAST, "cast", rayCasting);
+  pipeline.setStage(STAGE_FILTER, "filter", filterCachedImagePlane);
+  pipeline.setStage(STAGE_UPLOAD, "upload", uploadImagePlane);
+  pipeline.setStage(STAGE_WRITE, "write", writeImagePlane);
+  // stages run are passes of the frame
+  pipeline.setStageHooks(
+      [&](const string &name) { profiler.beginPass(name); },
+      [&]() { profiler.endPass(); });
 
   // render the image plane just as background
   const int nPoints = 4;
@@ -559,30 +1809,39 @@ int main() {
 
   // main loop
   while (!glfwWindowShouldClose(window)) {
+    profiler.beginFrame();
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    if (shouldReCast) {
+    profiler.beginPass("config");
+    reloadConfigFileIfChanged();
+    advancePlayback();
+    refineProgressively();
+    profiler.endPass();
+    if (pipeline.pending()) {
       // resend vertices
       helper.prepareAttributes(vector<APrepInfo>{
           {vBackBuf, vBack, nPoints * 2, "aPosition", 2, GL_FLOAT},
           {vtBackBuf, vtBack, nPoints * 2, "aTexCoord", 2, GL_FLOAT},
       });
-      // recalculate rotate matrix
-      currentRotateMatrix =
-          UntranslatedLookAt(normalizedEyePos, WORLD_ORIGIN, VEC_UP);
-      // recast rays
-      rayCasting();
-      shouldReCast = false;
+      // run the stages invalidated
+      pipeline.run();
     }
 
-    glDrawArrays(GL_TRIANGLE_FAN, 0, nPoints);
+    profiler.beginPass("draw");
+    helper.drawArrays(GL_TRIANGLE_FAN, 0, nPoints);
+    profiler.endPass();
 
+    profiler.beginPass("present");
     glfwSwapBuffers(window);
     glfwPollEvents();
+    profiler.endPass();
+    profiler.endFrame();
   }
 
-  helper.freeAllocatedObjects();
-  glfwTerminate();
+  // finish saving before leaving
+  imageWriter.flush();
+  volumeCache.flush();
+  terminateGL();
   return 0;
 }
 
@@ -592,31 +1851,42 @@ void keyboardCallback(GLFWwindow *window, int key, int _, int action, int __) {
     if (key == GLFW_KEY_LEFT) {
       // go left
       normalizedEyePos.x -= ARROW_KEY_TRACEBALL_DELTA_LR;
-      shouldReCast = true;
+      pipeline.invalidate(STAGE_CAST);
     } else if (key == GLFW_KEY_RIGHT) {
       // go right
       normalizedEyePos.x += ARROW_KEY_TRACEBALL_DELTA_LR;
-      shouldReCast = true;
+      pipeline.invalidate(STAGE_CAST);
     } else if (key == GLFW_KEY_UP) {
       // go top
       normalizedEyePos.y -= ARROW_KEY_TRACEBALL_DELTA_UD;
-      shouldReCast = true;
+      pipeline.invalidate(STAGE_CAST);
     } else if (key == GLFW_KEY_DOWN) {
       // go bottom
       normalizedEyePos.y += ARROW_KEY_TRACEBALL_DELTA_UD;
-      shouldReCast = true;
+      pipeline.invalidate(STAGE_CAST);
     } else if (key == GLFW_KEY_W) {
       // go forward
       if (eyePos.z > WS_KEY_FRONTBACK_DELTA) {
         eyePos.z -= WS_KEY_FRONTBACK_DELTA;
-        shouldReCast = true;
+        pipeline.invalidate(STAGE_CAST);
       }
     } else if (key == GLFW_KEY_S) {
       // go backward
-      if (eyePos.z < VolumeZCount + 1) {
+      if (eyePos.z < VolumeZCount * VolumeSpacing.z + 1) {
         eyePos.z += WS_KEY_FRONTBACK_DELTA;
-        shouldReCast = true;
+        pipeline.invalidate(STAGE_CAST);
       }
+    } else if (key == GLFW_KEY_SPACE && volumeFromSequence) {
+      // play or pause
+      playing = !playing;
+    } else if ((key == GLFW_KEY_LEFT_BRACKET ||
+                key == GLFW_KEY_RIGHT_BRACKET) &&
+               volumeFromSequence) {
+      // step a frame
+      int n = frameFiles.size();
+      acquireFrame((currentFrame + (key == GLFW_KEY_LEFT_BRACKET ? n - 1 : 1)) %
+                   n);
+      pipeline.invalidate(STAGE_CLASSIFY);
     }
   }
 }
\ No newline at end of file
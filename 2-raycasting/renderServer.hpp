@@ -0,0 +1,586 @@
+#pragma once
+
+// Render server for Ray Casting
+// by z0gSh1u (Zhuo Xu) @ https://github.com/z0gSh1u/seu-viz
+// Viewers share one loaded volume by connecting to the server, over TCP or a
+// Unix socket, and sending render requests as JSON lines. Requests arriving
+// close together form a batch, which is sorted so that each transfer
+// function is applied once, and whose identical requests are rendered once.
+// Each reply is a JSON line with latency metrics, followed by the image.
+
+#ifndef RENDERSERVER_HPP_
+#define RENDERSERVER_HPP_
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <signal.h>
+#endif
+
+#include <rapidjson/document.h>
+#include <list>
+#include <cmath>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+#include "../framework/ReNow.hpp"
+#include "../framework/Utils.hpp"
+#include "../framework/Camera.hpp"
+#include "imageWriter.hpp"
+
+using std::function;
+using std::shared_ptr;
+
+// longest request line accepted, in bytes
+#define SERVER_MAX_LINE (64 << 10)
+
+namespace zx {
+
+#ifdef _WIN32
+typedef SOCKET _Socket;
+const _Socket _NO_SOCKET = INVALID_SOCKET;
+void _closeSocket(_Socket s) { closesocket(s); }
+void _shutdownSocket(_Socket s) { shutdown(s, SD_BOTH); }
+string _socketError() { return "error " + std::to_string(WSAGetLastError()); }
+#else
+typedef int _Socket;
+const _Socket _NO_SOCKET = -1;
+void _closeSocket(_Socket s) { close(s); }
+void _shutdownSocket(_Socket s) { shutdown(s, SHUT_RDWR); }
+string _socketError() { return strerror(errno); }
+#endif
+
+typedef std::chrono::steady_clock::time_point _TimePoint;
+
+double _millisecondsBetween(_TimePoint from, _TimePoint to) {
+  return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+// Connection to a viewer. Closed when the last request from it is replied.
+struct _ServerClient {
+  _Socket socket;
+  std::mutex sendMutex;
+
+  explicit _ServerClient(_Socket s) : socket(s) {}
+  ~_ServerClient() { _closeSocket(socket); }
+
+  // Send `header` line and `body`. Returns false if connection is lost.
+  bool send(const string &header, const vector<unsigned char> &body = {}) {
+    std::lock_guard<std::mutex> lock(sendMutex);
+    return _sendAll(header.data(), header.size()) &&
+           _sendAll((const char *)body.data(), body.size());
+  }
+
+private:
+  bool _sendAll(const char *data, size_t size) {
+    while (size > 0) {
+      int n = ::send(socket, data, (int)std::min(size, (size_t)1 << 20), 0);
+      if (n <= 0) {
+        return false;
+      }
+      data += n, size -= n;
+    }
+    return true;
+  }
+};
+
+// Request to render a view.
+struct RenderRequest {
+  long long id = -1; // echoed in the reply
+  vec3 normalizedEyePos;
+  float eyeDistance; // z of eye position
+  string transferFunction;
+  int width, height;
+  ImageFormat format = FORMAT_PNG;
+  int bitDepth = 8;
+  // bookkeeping
+  shared_ptr<_ServerClient> client;
+  _TimePoint received;
+
+  // What the image depends on, so that equal keys share one rendering.
+  string key() const {
+    std::ostringstream s;
+    s << transferFunction << "|" << width << "x" << height << "|" << format
+      << bitDepth << "|" << normalizedEyePos.x << "," << normalizedEyePos.y
+      << "," << normalizedEyePos.z << "|" << eyeDistance;
+    return s.str();
+  }
+};
+
+// Rendered and encoded image of a request.
+struct RenderResult {
+  vector<unsigned char> image;
+  double renderMs = 0, encodeMs = 0;
+};
+
+// Value at proportion `p` of `values`, nearest rank.
+double _percentile(vector<double> values, double p) {
+  if (values.empty()) {
+    return 0;
+  }
+  size_t k = std::min(values.size() - 1, (size_t)(p * values.size()));
+  std::nth_element(values.begin(), values.begin() + k, values.end());
+  return values[k];
+}
+
+// Local render server. See the top of this file.
+class RenderServer {
+private:
+  string _address;
+  _Socket _listener = _NO_SOCKET;
+  int _batchWindowMs, _maxBatch;
+  bool _allowShutdown;
+  RenderRequest _defaults;
+  // pending requests
+  std::mutex _mutex;
+  std::condition_variable _arrived;
+  std::deque<RenderRequest> _queue;
+  bool _shutdown = false;
+  // thread reading requests of each viewer, joined on shutdown
+  struct _Reader {
+    std::thread thread;
+    std::weak_ptr<_ServerClient> client;
+    std::atomic<bool> done{false};
+  };
+  std::mutex _readersMutex;
+  std::list<_Reader> _readers;
+  // metrics
+  std::mutex _metricsMutex;
+  vector<double> _queueMs, _totalMs;
+  long long _batches = 0, _renders = 0, _errors = 0;
+
+  void _listen() {
+#ifdef _WIN32
+    WSADATA wsa;
+    ASSERT(WSAStartup(MAKEWORD(2, 2), &wsa) == 0, "[ERROR] Cannot init WSA.");
+#else
+    signal(SIGPIPE, SIG_IGN); // lost viewers are detected by send
+#endif
+    if (_address.compare(0, 5, "unix:") == 0) {
+#ifdef _WIN32
+      ASSERT(false, "[ERROR] Unix socket is not supported: " + _address);
+#else
+      string path = _address.substr(5);
+      sockaddr_un addr = {};
+      addr.sun_family = AF_UNIX;
+      ASSERT(path.size() < sizeof(addr.sun_path),
+             "[ERROR] Socket path too long: " + path);
+      std::copy(path.begin(), path.end(), addr.sun_path);
+      unlink(path.c_str()); // left by previous run
+      _listener = socket(AF_UNIX, SOCK_STREAM, 0);
+      ASSERT(_listener != _NO_SOCKET &&
+                 bind(_listener, (sockaddr *)&addr, sizeof(addr)) == 0,
+             "[ERROR] Cannot bind " + _address);
+#endif
+    } else {
+      size_t colon = _address.rfind(':');
+      ASSERT(colon != string::npos,
+             "[ERROR] ServerAddress should be host:port or unix:path.");
+      sockaddr_in addr = {};
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons((unsigned short)atoi(_address.c_str() + colon + 1));
+      ASSERT(inet_pton(AF_INET, _address.substr(0, colon).c_str(),
+                       &addr.sin_addr) == 1,
+             "[ERROR] Invalid host: " + _address);
+      _listener = socket(AF_INET, SOCK_STREAM, 0);
+      int reuse = 1;
+      setsockopt(_listener, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse,
+                 sizeof(reuse));
+      ASSERT(_listener != _NO_SOCKET &&
+                 bind(_listener, (sockaddr *)&addr, sizeof(addr)) == 0,
+             "[ERROR] Cannot bind " + _address);
+    }
+    ASSERT(listen(_listener, 16) == 0, "[ERROR] Cannot listen " + _address);
+  }
+
+  void _accept() {
+    while (true) {
+      _Socket s = accept(_listener, nullptr, nullptr);
+      if (s == _NO_SOCKET) {
+        {
+          std::lock_guard<std::mutex> lock(_mutex);
+          if (_shutdown) {
+            return; // listener closed by shutdown
+          }
+        }
+        // e.g. interrupted, aborted by the viewer, or out of descriptors,
+        // which may last a while
+        std::cerr << "[WARN] Cannot accept viewer: " << _socketError()
+                  << std::endl;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        continue;
+      }
+      if (_address.compare(0, 5, "unix:") != 0) {
+        // replies are written in two parts
+        int noDelay = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&noDelay,
+                   sizeof(noDelay));
+      }
+      auto client = std::make_shared<_ServerClient>(s);
+      std::lock_guard<std::mutex> lock(_readersMutex);
+      // forget viewers gone
+      for (auto it = _readers.begin(); it != _readers.end();) {
+        if (it->done) {
+          it->thread.join();
+          it = _readers.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      _readers.emplace_back();
+      _Reader &reader = _readers.back();
+      reader.client = client;
+      reader.thread =
+          std::thread(&RenderServer::_read, this, client, &reader.done);
+    }
+  }
+
+  // Read request lines of `client` until it disconnects, or sends a line
+  // longer than SERVER_MAX_LINE. Sets `done` when returning.
+  void _read(shared_ptr<_ServerClient> client, std::atomic<bool> *done) {
+    string pending;
+    char buf[4096];
+    int n;
+    while ((n = recv(client->socket, buf, sizeof(buf), 0)) > 0) {
+      pending.append(buf, n);
+      size_t end;
+      while ((end = pending.find('\n')) != string::npos) {
+        string line = pending.substr(0, end);
+        pending.erase(0, end + 1);
+        if (line.find_first_not_of(" \t\r") != string::npos) {
+          _handle(client, line);
+        }
+      }
+      if (pending.size() > SERVER_MAX_LINE) {
+        client->send(_errorReply(-1, "Request line too long."));
+        break;
+      }
+    }
+    *done = true;
+  }
+
+  // Queue request `line`, or answer it if not a render request.
+  void _handle(const shared_ptr<_ServerClient> &client, const string &line) {
+    rapidjson::Document d;
+    d.Parse(line.c_str());
+    if (d.HasParseError() || !d.IsObject()) {
+      client->send(_errorReply(-1, "Invalid JSON."));
+      return;
+    }
+    if (d.HasMember("Stats")) {
+      client->send(_statsReply());
+      return;
+    }
+    if (d.HasMember("Shutdown")) {
+      // any viewer could stop the server shared by all
+      if (!_allowShutdown) {
+        client->send(_errorReply(-1, "Shutdown is not allowed."));
+        return;
+      }
+      client->send("{\"Status\":\"OK\"}\n");
+      stop();
+      return;
+    }
+    RenderRequest req = _defaults;
+    string error = _parseRequest(d, req);
+    if (!error.empty()) {
+      client->send(_errorReply(req.id, error));
+      return;
+    }
+    req.client = client;
+    req.received = std::chrono::steady_clock::now();
+    bool queued = false;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (!_shutdown) {
+        _queue.push_back(req);
+        queued = true;
+      }
+    }
+    if (queued) {
+      _arrived.notify_one();
+    } else {
+      _reject(req);
+    }
+  }
+
+  // Read `d` into `req`. Returns error message, or empty if valid.
+  static string _parseRequest(const rapidjson::Document &d,
+                              RenderRequest &req) {
+    if (d.HasMember("Id") && d["Id"].IsNumber()) {
+      req.id = (long long)d["Id"].GetDouble();
+    }
+    if (d.HasMember("NormalizedEyePos")) {
+      const rapidjson::Value &v = d["NormalizedEyePos"];
+      if (!v.IsArray() || v.Size() != 3) {
+        return "NormalizedEyePos should be 3 numbers.";
+      }
+      for (rapidjson::SizeType j = 0; j < 3; j++) {
+        if (!v[j].IsNumber() || !std::isfinite(v[j].GetFloat())) {
+          return "NormalizedEyePos should be 3 numbers.";
+        }
+        req.normalizedEyePos[j] = v[j].GetFloat();
+      }
+      // the view is rotated by lookAt with VEC_UP, which has no solution for
+      // an eye on the up axis
+      const vec3 &eye = req.normalizedEyePos;
+      if (glm::length(eye) == 0 ||
+          glm::length(glm::cross(glm::normalize(eye), VEC_UP)) < 1e-4f) {
+        return "NormalizedEyePos should not be zero or along the up axis.";
+      }
+    }
+    if (d.HasMember("EyeDistance")) {
+      float distance =
+          d["EyeDistance"].IsNumber() ? d["EyeDistance"].GetFloat() : NAN;
+      if (!std::isfinite(distance) || distance <= 0) {
+        return "EyeDistance should be a positive number.";
+      }
+      req.eyeDistance = distance;
+    }
+    if (d.HasMember("TransferFunction")) {
+      if (!d["TransferFunction"].IsString()) {
+        return "TransferFunction should be a string.";
+      }
+      req.transferFunction = d["TransferFunction"].GetString();
+    }
+    const char *sizeKeys[2] = {"ImagePlaneWidth", "ImagePlaneHeight"};
+    int *sizes[2] = {&req.width, &req.height};
+    for (int i = 0; i < 2; i++) {
+      if (d.HasMember(sizeKeys[i])) {
+        if (!d[sizeKeys[i]].IsInt()) {
+          return string(sizeKeys[i]) + " should be an integer.";
+        }
+        *sizes[i] = d[sizeKeys[i]].GetInt();
+      }
+      if (*sizes[i] < 1 || *sizes[i] > 8192) {
+        return string(sizeKeys[i]) + " should be in [1, 8192].";
+      }
+    }
+    if (d.HasMember("Format")) {
+      string format = d["Format"].IsString() ? d["Format"].GetString() : "";
+      if (format != "png" && format != "ppm") {
+        return "Format should be png or ppm.";
+      }
+      req.format = format == "png" ? FORMAT_PNG : FORMAT_PPM;
+    }
+    if (d.HasMember("BitDepth")) {
+      req.bitDepth = d["BitDepth"].IsInt() ? d["BitDepth"].GetInt() : 0;
+      if (req.bitDepth != 8 && req.bitDepth != 16) {
+        return "BitDepth should be 8 or 16.";
+      }
+    }
+    return "";
+  }
+
+  static string _errorReply(long long id, const string &message) {
+    string escaped;
+    for (char c : message) {
+      if (c == '"' || c == '\\') {
+        escaped += '\\';
+      }
+      escaped += c == '\n' ? ' ' : c;
+    }
+    return "{\"Id\":" + std::to_string(id) +
+           ",\"Status\":\"ERROR\",\"Message\":\"" + escaped + "\"}\n";
+  }
+
+  // Answer `req` that will not be rendered since the server is shutting down.
+  void _reject(const RenderRequest &req) {
+    req.client->send(_errorReply(req.id, "Server is shutting down."));
+    std::lock_guard<std::mutex> lock(_metricsMutex);
+    _errors++;
+  }
+
+  string _statsReply() {
+    std::lock_guard<std::mutex> lock(_metricsMutex);
+    std::ostringstream s;
+    s << "{\"Status\":\"OK\",\"Requests\":" << _totalMs.size()
+      << ",\"Batches\":" << _batches << ",\"Renders\":" << _renders
+      << ",\"Errors\":" << _errors;
+    const char *names[2] = {"Queue", "Total"};
+    const vector<double> *values[2] = {&_queueMs, &_totalMs};
+    for (int i = 0; i < 2; i++) {
+      s << ",\"" << names[i] << "P50Ms\":" << _percentile(*values[i], 0.5)
+        << ",\"" << names[i] << "P95Ms\":" << _percentile(*values[i], 0.95)
+        << ",\"" << names[i] << "P99Ms\":" << _percentile(*values[i], 0.99);
+    }
+    s << "}\n";
+    return s.str();
+  }
+
+  // Wait for requests, then for more until the batch window closes or the
+  // batch is full. Returns empty batch on shutdown.
+  vector<RenderRequest> _nextBatch() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _arrived.wait(lock, [this]() { return _shutdown || !_queue.empty(); });
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(_batchWindowMs);
+    _arrived.wait_until(lock, deadline, [this]() {
+      return _shutdown || (int)_queue.size() >= _maxBatch;
+    });
+    vector<RenderRequest> batch;
+    while (!_shutdown && !_queue.empty() && (int)batch.size() < _maxBatch) {
+      batch.push_back(std::move(_queue.front()));
+      _queue.pop_front();
+    }
+    return batch;
+  }
+
+  void
+  _renderBatch(vector<RenderRequest> &batch,
+               const function<RenderResult(const RenderRequest &)> &render) {
+    // group by transfer function and size, and put identical ones together
+    vector<string> keys;
+    for (const auto &req : batch) {
+      keys.push_back(req.key());
+    }
+    vector<int> order(batch.size());
+    for (size_t i = 0; i < order.size(); i++) {
+      order[i] = (int)i;
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [&](int a, int b) { return keys[a] < keys[b]; });
+
+    RenderResult result;
+    string error;
+    int renders = 0, errors = 0;
+    vector<double> queueMs, totalMs;
+    for (size_t i = 0; i < order.size(); i++) {
+      const RenderRequest &req = batch[order[i]];
+      auto start = std::chrono::steady_clock::now();
+      if (i == 0 || keys[order[i]] != keys[order[i - 1]]) {
+        renders++;
+        try {
+          result = render(req);
+          error.clear();
+        } catch (const std::runtime_error &e) {
+          error = e.what();
+        }
+      }
+      if (!error.empty()) {
+        errors++;
+        req.client->send(_errorReply(req.id, error));
+        continue;
+      }
+      auto end = std::chrono::steady_clock::now();
+      queueMs.push_back(_millisecondsBetween(req.received, start));
+      totalMs.push_back(_millisecondsBetween(req.received, end));
+      std::ostringstream header;
+      header << "{\"Id\":" << req.id << ",\"Status\":\"OK\",\"Format\":\""
+             << (req.format == FORMAT_PNG ? "png" : "ppm")
+             << "\",\"Bytes\":" << result.image.size()
+             << ",\"BatchSize\":" << batch.size()
+             << ",\"QueueMs\":" << queueMs.back()
+             << ",\"RenderMs\":" << result.renderMs
+             << ",\"EncodeMs\":" << result.encodeMs
+             << ",\"TotalMs\":" << totalMs.back() << "}\n";
+      req.client->send(header.str(), result.image);
+    }
+
+    std::lock_guard<std::mutex> lock(_metricsMutex);
+    _batches++;
+    _renders += renders;
+    _errors += errors;
+    _queueMs.insert(_queueMs.end(), queueMs.begin(), queueMs.end());
+    _totalMs.insert(_totalMs.end(), totalMs.begin(), totalMs.end());
+    std::cout << "[Server] Batch of " << batch.size() << " requests, "
+              << renders << " rendered, total p50 "
+              << _percentile(totalMs, 0.5) << " ms." << std::endl;
+  }
+
+public:
+  // Server at `address` ("host:port", or "unix:path" except on Windows).
+  // Fields missing in requests are taken from `defaults`. A batch collects
+  // requests arriving within `batchWindowMs` of its first one, up to
+  // `maxBatch`. Viewers may stop the server only if `allowShutdown`.
+  RenderServer(const string &address, const RenderRequest &defaults,
+               int batchWindowMs, int maxBatch, bool allowShutdown = false)
+      : _address(address), _batchWindowMs(batchWindowMs),
+        _maxBatch(std::max(maxBatch, 1)), _allowShutdown(allowShutdown),
+        _defaults(defaults) {}
+
+  // Serve until shutdown, rendering requests one by one on this thread by
+  // `render`, which may throw runtime_error to reject a request. Requests
+  // still queued on shutdown are rejected, and viewers are disconnected
+  // before returning.
+  void serve(const function<RenderResult(const RenderRequest &)> &render) {
+    _listen();
+    std::cout << ">>> Serving at " << _address << "..." << std::endl;
+    std::thread acceptor(&RenderServer::_accept, this);
+    while (true) {
+      vector<RenderRequest> batch = _nextBatch();
+      if (batch.empty()) {
+        break;
+      }
+      _renderBatch(batch, render);
+    }
+    // stop accepting
+#ifdef _WIN32
+    closesocket(_listener);
+#else
+    shutdown(_listener, SHUT_RDWR);
+    close(_listener);
+#endif
+    acceptor.join();
+    // answer requests left, and disconnect viewers
+    std::deque<RenderRequest> left;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      left.swap(_queue);
+    }
+    for (const auto &req : left) {
+      _reject(req);
+    }
+    left.clear();
+    for (auto &reader : _readers) {
+      if (auto client = reader.client.lock()) {
+        _shutdownSocket(client->socket);
+      }
+    }
+    for (auto &reader : _readers) {
+      reader.thread.join();
+    }
+    _readers.clear();
+    if (_address.compare(0, 5, "unix:") == 0) {
+      std::remove(_address.substr(5).c_str());
+    }
+    std::cout << _statsReply();
+  }
+
+  // Let `serve` return after the batch in progress.
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _shutdown = true;
+    }
+    _arrived.notify_one();
+  }
+};
+
+} // namespace zx
+
+#endif
@@ -0,0 +1,107 @@
+#version 130
+
+// Fragment shader for GPU ray marching
+// Casts the ray of one image plane pixel the same way as `castOneRay` does on
+// CPU: parallel projection, slab test, fixed step count, trilinear sampling,
+// front-to-back compositing and early termination.
+
+uniform mat3 uRotateMat; // untranslated lookAt matrix
+uniform vec3 uTranslate; // eye position
+uniform vec3 uSpacing;   // voxel size relative to its shortest side
+uniform vec3 uBBox;      // bounding box point beside (0, 0, 0)
+uniform float uSamplingDelta;
+uniform vec4 uBackground; // for rays missing the volume
+
+// sample classified uColoredVolume, or classify samples of uRawVolume by
+// uTransferFunction of uTransferFunctionSize colors
+uniform bool uClassified;
+uniform sampler3D uColoredVolume;
+uniform sampler3D uRawVolume;
+uniform sampler1D uTransferFunction;
+uniform float uTransferFunctionSize;
+
+uniform bool uEnableLighting;
+uniform float uKAmbient;
+
+const vec3 eyeDirection = vec3(0.0, 0.0, -1.0);
+const vec3 lightDirection = vec3(0.0, 0.0, -1.0);
+const float INTERSECT_EPSILON = 1e-6;
+
+// Voxel value at integer position, 0 outside the volume.
+float rawVoxel(ivec3 p) {
+  if (any(lessThan(p, ivec3(0))) || any(greaterThan(p, ivec3(uBBox)))) {
+    return 0.0;
+  }
+  return texelFetch(uRawVolume, p, 0).r * 65535.0;
+}
+
+// Normalized gradient in physical space, as `calcNormal`.
+vec3 calcNormal(ivec3 p) {
+  vec3 gradient = vec3(rawVoxel(p + ivec3(1, 0, 0)) - rawVoxel(p - ivec3(1, 0, 0)),
+                       rawVoxel(p + ivec3(0, 1, 0)) - rawVoxel(p - ivec3(0, 1, 0)),
+                       rawVoxel(p + ivec3(0, 0, 1)) - rawVoxel(p - ivec3(0, 0, 1))) /
+                  uSpacing;
+  float len = length(gradient);
+  return len > 0.0 ? gradient / len : gradient;
+}
+
+// Interpolated color at voxel coordinate `pos`. Voxel i is at texel center.
+vec4 colorAt(vec3 pos) {
+  vec3 coord = (pos + 0.5) / (uBBox + 1.0);
+  if (uClassified) {
+    return clamp(texture(uColoredVolume, coord), 0.0, 1.0);
+  }
+  float value = texture(uRawVolume, coord).r * 65535.0;
+  return texture(uTransferFunction, (value + 0.5) / uTransferFunctionSize);
+}
+
+void main() {
+
+  // pixel (u, v) of image plane, v growing upwards
+  vec2 uv = floor(gl_FragCoord.xy);
+  vec3 source = (vec3(uv, 0.0) + uTranslate) * uRotateMat / uSpacing;
+  vec3 direction = normalize(eyeDirection * uRotateMat) / uSpacing;
+  vec3 invDirection;
+  for (int i = 0; i < 3; i++) {
+    float d = direction[i];
+    invDirection[i] = 1.0 / (abs(d) > INTERSECT_EPSILON
+                                 ? d
+                                 : (d < 0.0 ? -INTERSECT_EPSILON : INTERSECT_EPSILON));
+  }
+
+  // slab test
+  vec3 tLow = -source * invDirection, tHigh = (uBBox - source) * invDirection;
+  vec3 tNear = min(tLow, tHigh), tFar = max(tLow, tHigh);
+  float tEntry = max(max(tNear.x, tNear.y), max(tNear.z, 0.0));
+  float tExit = min(min(tFar.x, tFar.y), tFar.z);
+  if (tEntry > tExit) {
+    gl_FragData[0] = uBackground;
+    gl_FragData[1] = vec4(0.0);
+    return;
+  }
+
+  // march the ray
+  int nSamples = int((tExit - tEntry) / uSamplingDelta) + 1;
+  vec3 stepVec = uSamplingDelta * direction;
+  vec3 samplePos = source + tEntry * direction;
+  vec4 accumulated = vec4(0.0);
+  int i;
+  for (i = 0; i < nSamples && accumulated.a < 1.0; i++) {
+    vec4 sampleColor = colorAt(samplePos);
+    if (uEnableLighting) {
+      // simplified Phong (without specular) with white light
+      vec3 normal = calcNormal(ivec3(samplePos));
+      float kDiffuse = max(dot(normal, lightDirection), 0.0);
+      sampleColor.rgb = clamp((kDiffuse + uKAmbient) * sampleColor.rgb, 0.0, 1.0);
+    }
+    // Cout = Cin + (1-ain)aiCi
+    accumulated.rgb += (1.0 - accumulated.a) * sampleColor.a * sampleColor.rgb;
+    accumulated.a += (1.0 - accumulated.a) * sampleColor.a;
+    samplePos += stepVec;
+  }
+
+  gl_FragData[0] = clamp(accumulated, 0.0, 1.0);
+  // ray statistics: samples taken, and hit
+  gl_FragData[1] = vec4(float(i), 1.0, 0.0, 0.0);
+
+}
@@ -0,0 +1,11 @@
+#version 130
+
+// Vertex shader for GPU ray marching, covering the whole image plane
+
+in vec2 aPosition;
+
+void main() {
+
+  gl_Position = vec4(aPosition, 0.0, 1.0);
+
+}
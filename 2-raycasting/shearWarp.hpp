@@ -0,0 +1,298 @@
+#pragma once
+
+// Shear-Warp engine for volume rendering
+// by z0gSh1u (Zhuo Xu) @ https://github.com/z0gSh1u/seu-viz
+// P. Lacroute and M. Levoy. "Fast Volume Rendering Using a Shear-Warp
+// Factorization of the Viewing Transformation." SIGGRAPH, 1994.
+// For parallel projection, the volume is composited slice by slice (object
+// order) into an intermediate image, where every slice is only translated.
+// Then the intermediate image is warped into the image plane.
+
+#ifndef SHEARWARP_HPP_
+#define SHEARWARP_HPP_
+
+#include <cmath>
+#include <climits>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include "../framework/ReNow.hpp"
+#include "../framework/Utils.hpp"
+
+using std::function;
+
+namespace zx {
+
+// Run of non-transparent voxels along a scanline.
+struct VoxelRun {
+  int start, length; // position along scanline
+  int offset;        // index of its first voxel in `RunLengthVolume::voxels`
+};
+
+// Classified volume encoded with runs of non-transparent voxels, sliced
+// perpendicular to `axis`. Inside a slice, scanlines go along axis i and rows
+// along axis j, with i = (axis + 1) % 3 and j = (axis + 2) % 3.
+struct RunLengthVolume {
+  int axis;
+  int ni, nj, nk;       // sizes along axis i, j and slices
+  vector<int> lineRuns; // runs of scanline (k, j) are
+                        // [lineRuns[k * nj + j], lineRuns[k * nj + j + 1])
+  vector<VoxelRun> runs;
+  vector<RGBAColor> voxels;
+};
+
+// Encode `coloredVolumeData` of size `w * h * d` sliced along `axis`.
+void buildRunLengthVolume(const RGBAColor *coloredVolumeData, int w, int h,
+                          int d, int axis, RunLengthVolume &res) {
+  int dims[3] = {w, h, d}, strides[3] = {1, w, w * h};
+  int iAxis = (axis + 1) % 3, jAxis = (axis + 2) % 3;
+  res.axis = axis;
+  res.ni = dims[iAxis], res.nj = dims[jAxis], res.nk = dims[axis];
+  res.lineRuns.assign(1, 0);
+  res.runs.clear();
+  res.voxels.clear();
+
+  for (int k = 0; k < res.nk; k++) {
+    for (int j = 0; j < res.nj; j++) {
+      const RGBAColor *line = coloredVolumeData + (size_t)k * strides[axis] +
+                              (size_t)j * strides[jAxis];
+      int si = strides[iAxis];
+      for (int i = 0; i < res.ni; i++) {
+        if (line[(size_t)i * si].a <= 0) {
+          continue;
+        }
+        VoxelRun run = {i, 0, (int)res.voxels.size()};
+        for (; i < res.ni && line[(size_t)i * si].a > 0; i++, run.length++) {
+          res.voxels.push_back(line[(size_t)i * si]);
+        }
+        res.runs.push_back(run);
+      }
+      res.lineRuns.push_back(res.runs.size());
+    }
+  }
+}
+
+// Random access to voxels of one scanline, with positions never decreasing
+// between calls.
+struct _RunCursor {
+  const VoxelRun *run, *end;
+  const RGBAColor *voxels;
+
+  const RGBAColor &at(int i) {
+    while (run != end && run->start + run->length <= i) {
+      run++;
+    }
+    return run != end && run->start <= i ? voxels[run->offset + i - run->start]
+                                         : Transparent;
+  }
+};
+
+// Render `rle` (the encoding along each axis) with parallel projection, the
+// same as ray casting does: the ray of pixel (u, v) starts from
+// `(vec3(u, v, 0) + translateVec) * rotateMat` towards
+// `eyeDirection * rotateMat` in physical space, where voxels are of size
+// `spacing`. Pixel (u, v) is stored at
+// `imagePlane[(h - 1 - v) * w + u]`. Sample opacity is corrected to match ray
+// casting with step `samplingDelta`. `lighting` shades samples at object
+// positions if not empty. Returns the number of samples composited.
+long long shearWarpRender(const RunLengthVolume rle[3], const mat3 &rotateMat,
+                          const vec3 &translateVec, const vec3 &eyeDirection,
+                          const vec3 &spacing, float samplingDelta, int w,
+                          int h, RGBAColor *imagePlane, const RGBAColor &background,
+                          int nThreads,
+                          const function<void(RGBAColor &, const vec3 &)>
+                              &lighting) {
+  // ### Factorize viewing transformation ###
+  // in voxels per unit physical length
+  vec3 direction = glm::normalize(eyeDirection * rotateMat) / spacing;
+  int axis = 0;
+  for (int c = 1; c < 3; c++) {
+    axis = fabs(direction[c]) > fabs(direction[axis]) ? c : axis;
+  }
+  const RunLengthVolume &vol = rle[axis];
+  int iAxis = (axis + 1) % 3, jAxis = (axis + 2) % 3;
+  // shear: voxel (i, j) of slice k is on the same ray as intermediate pixel
+  // (i - k * si + a0, j - k * sj + b0)
+  float si = direction[iAxis] / direction[axis],
+        sj = direction[jAxis] / direction[axis];
+  float a0 = std::max(0.0f, (vol.nk - 1) * si),
+        b0 = std::max(0.0f, (vol.nk - 1) * sj);
+  int na = vol.ni + (int)ceil(fabs(si) * (vol.nk - 1)) + 1,
+      nb = vol.nj + (int)ceil(fabs(sj) * (vol.nk - 1)) + 1;
+  vector<RGBAColor> intermediate(na * nb, Transparent);
+
+  // opacity correction, since samples are 1 / |direction[axis]| apart
+  const int lutSize = 1024;
+  float ratio = 1.0f / fabs(direction[axis]) / samplingDelta;
+  vector<float> alphaLUT(lutSize + 1);
+  for (int i = 0; i <= lutSize; i++) {
+    alphaLUT[i] = 1 - pow(1 - (float)i / lutSize, ratio);
+  }
+
+  // only samples at image depth (rotateMat * p).z <= translateVec.z are in
+  // front of the image plane
+  vec3 depthRow =
+      vec3(rotateMat[0][2], rotateMat[1][2], rotateMat[2][2]) * spacing;
+  float depthI = depthRow[iAxis], depthJ = depthRow[jAxis],
+        depthK = depthRow[axis];
+
+  // ### Composite slices front-to-back, rows split among threads ###
+  vector<long long> samples(nThreads, 0);
+  auto compositeRows = [&](int worker, int bLow, int bHigh) {
+    long long count = 0;
+    for (int n = 0; n < vol.nk; n++) {
+      int k = direction[axis] > 0 ? n : vol.nk - 1 - n;
+      // slice k is translated by (offI, offJ), with constant remainders
+      float offI = k * si - a0, offJ = k * sj - b0;
+      int I = (int)floor(offI), J = (int)floor(offJ);
+      float fi = offI - I, fj = offJ - J;
+      // cull slices behind the image plane
+      float depth0 = k * depthK - translateVec.z;
+      float depthMin = depth0 + std::min(0.0f, (vol.ni - 1) * depthI) +
+                       std::min(0.0f, (vol.nj - 1) * depthJ),
+            depthMax = depth0 + std::max(0.0f, (vol.ni - 1) * depthI) +
+                       std::max(0.0f, (vol.nj - 1) * depthJ);
+      if (depthMin > 0) {
+        continue;
+      }
+      bool checkDepth = depthMax > 0;
+
+      for (int b = bLow; b < bHigh; b++) {
+        int j0 = b + J, j1 = j0 + 1;
+        if (j1 < 0 || j0 > vol.nj - 1) {
+          continue;
+        }
+        // cursors of the two scanlines under intermediate row b
+        _RunCursor rows[2];
+        for (int r = 0; r < 2; r++) {
+          int j = j0 + r;
+          int line = k * vol.nj + j;
+          bool valid = j >= 0 && j < vol.nj;
+          const VoxelRun *first =
+              vol.runs.data() + (valid ? vol.lineRuns[line] : 0);
+          rows[r] = {first,
+                     valid ? vol.runs.data() + vol.lineRuns[line + 1] : first,
+                     vol.voxels.data()};
+        }
+        // run-length skipping: pixel a is affected by voxels a + I and
+        // a + I + 1, so visit merged spans of runs from both scanlines
+        const VoxelRun *p[2] = {rows[0].run, rows[1].run};
+        int spanLow = 0, spanHigh = -1;
+        while (true) {
+          int next = -1;
+          for (int r = 0; r < 2; r++) {
+            if (p[r] != rows[r].end &&
+                (next == -1 || p[r]->start < p[next]->start)) {
+              next = r;
+            }
+          }
+          int low = next == -1 ? INT_MAX : p[next]->start - I - 1,
+              high = next == -1 ? INT_MAX : p[next]->start + p[next]->length -
+                                                1 - I;
+          if (next != -1 && low <= spanHigh + 1) {
+            spanHigh = std::max(spanHigh, high);
+            p[next]++;
+            continue;
+          }
+          // flush the current span
+          for (int a = std::max(spanLow, 0); a <= std::min(spanHigh, na - 1);
+               a++) {
+            RGBAColor &acc = intermediate[b * na + a];
+            if (acc.a >= 1) {
+              continue; // early ray termination
+            }
+            // fetch in increasing positions for the cursors
+            int i = a + I;
+            RGBAColor v00 = rows[0].at(i), v10 = rows[0].at(i + 1),
+                      v01 = rows[1].at(i), v11 = rows[1].at(i + 1);
+            RGBAColor sample = (1 - fj) * ((1 - fi) * v00 + fi * v10) +
+                               fj * ((1 - fi) * v01 + fi * v11);
+            if (sample.a <= 0) {
+              continue;
+            }
+            if (checkDepth &&
+                depth0 + (i + fi) * depthI + (j0 + fj) * depthJ > 0) {
+              continue;
+            }
+            clipRGBA(sample);
+            sample.a = alphaLUT[int(sample.a * lutSize)];
+            if (lighting) {
+              vec3 pos;
+              pos[iAxis] = i + fi, pos[jAxis] = j0 + fj, pos[axis] = k;
+              lighting(sample, pos);
+            }
+            for (int c = 0; c < 3; c++) {
+              acc[c] = acc[c] + (1 - acc.a) * sample.a * sample[c];
+            }
+            acc.a = acc.a + (1 - acc.a) * sample.a;
+            count++;
+          }
+          if (next == -1) {
+            break;
+          }
+          spanLow = low, spanHigh = high;
+          p[next]++;
+        }
+      }
+    }
+    samples[worker] = count;
+  };
+
+  vector<std::thread> workers;
+  for (int t = 0; t < nThreads; t++) {
+    workers.push_back(std::thread(compositeRows, t, nb * t / nThreads,
+                                  nb * (t + 1) / nThreads));
+  }
+  for (auto &t : workers) {
+    t.join();
+  }
+
+  // ### Warp intermediate image into image plane ###
+  // pixel (u, v) maps to intermediate pixel affinely, following its ray back
+  // to slice 0
+  auto intermediatePos = [&](float u, float v) {
+    vec3 source = (vec3(u, v, 0) + translateVec) * rotateMat / spacing;
+    return vec2(source[iAxis] - source[axis] * si + a0,
+                source[jAxis] - source[axis] * sj + b0);
+  };
+  vec2 origin = intermediatePos(0, 0),
+       du = intermediatePos(1, 0) - origin, dv = intermediatePos(0, 1) - origin;
+  auto warpRows = [&](int vLow, int vHigh) {
+    for (int v = vLow; v < vHigh; v++) {
+      for (int u = 0; u < w; u++) {
+        vec2 pos = origin + (float)u * du + (float)v * dv;
+        int a = (int)floor(pos.x), b = (int)floor(pos.y);
+        float fa = pos.x - a, fb = pos.y - b;
+        RGBAColor res = Transparent;
+        for (int q = 0; q < 4; q++) {
+          int qa = a + (q & 1), qb = b + (q >> 1);
+          if (qa >= 0 && qa < na && qb >= 0 && qb < nb) {
+            res += ((q & 1) ? fa : 1 - fa) * ((q >> 1) ? fb : 1 - fb) *
+                   intermediate[qb * na + qa];
+          }
+        }
+        clipRGBA(res);
+        imagePlane[(h - 1 - v) * w + u] = res.a > 0 ? res : background;
+      }
+    }
+  };
+  workers.clear();
+  for (int t = 0; t < nThreads; t++) {
+    workers.push_back(
+        std::thread(warpRows, h * t / nThreads, h * (t + 1) / nThreads));
+  }
+  for (auto &t : workers) {
+    t.join();
+  }
+
+  long long total = 0;
+  for (auto c : samples) {
+    total += c;
+  }
+  return total;
+}
+
+} // namespace zx
+
+#endif
@@ -0,0 +1,165 @@
+#pragma once
+
+// Sparse classified volume for Ray Casting
+// by z0gSh1u (Zhuo Xu) @ https://github.com/z0gSh1u/seu-viz
+// Like the leaf level of OpenVDB, the classified volume is kept as a grid of
+// bricks of BRICK_SIZE^3 voxels, where only bricks with some non-transparent
+// voxel are allocated, and the others share one transparent brick. Each brick
+// also holds the first voxels of its neighbours (an apron of 1 voxel), so that
+// trilinear interpolation reads a single brick. Memory then scales with the
+// visible anatomy rather than the bounding box.
+
+#ifndef SPARSEVOLUME_HPP_
+#define SPARSEVOLUME_HPP_
+
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include "../framework/ReNow.hpp"
+#include "../framework/Utils.hpp"
+
+using std::function;
+
+namespace zx {
+
+#define BRICK_LOG2 3
+#define BRICK_SIZE (1 << BRICK_LOG2)
+#define BRICK_SPAN (BRICK_SIZE + 1) // voxels along each axis, with apron
+#define BRICK_VOXELS (BRICK_SPAN * BRICK_SPAN * BRICK_SPAN)
+
+// TriLinear blend of the 8 colors at `base` and offsets `dx`, `dy`, `dz` (and
+// their sums) by remainders `xd`, `yd`, `zd`, clipped to [0, 1]. Written per
+// channel on floats, so that it stays straight-line code in the ray march
+// whatever the compiler inlines of the vector operators.
+inline RGBAColor blendTriLinear(const RGBAColor *base, int dx, int dy, int dz,
+                                float xd, float yd, float zd) {
+  float w[8] = {(1 - xd) * (1 - yd) * (1 - zd), xd * (1 - yd) * (1 - zd),
+                (1 - xd) * yd * (1 - zd),       (1 - xd) * (1 - yd) * zd,
+                xd * yd * (1 - zd),             xd * (1 - yd) * zd,
+                (1 - xd) * yd * zd,             xd * yd * zd};
+  const RGBAColor &c0 = base[0], &c1 = base[dx], &c2 = base[dy],
+                  &c3 = base[dz], &c4 = base[dx + dy], &c5 = base[dx + dz],
+                  &c6 = base[dy + dz], &c7 = base[dx + dy + dz];
+  RGBAColor res;
+  for (int i = 0; i < 4; i++) {
+    float v = w[0] * c0[i] + w[1] * c1[i] + w[2] * c2[i] + w[3] * c3[i] +
+              w[4] * c4[i] + w[5] * c5[i] + w[6] * c6[i] + w[7] * c7[i];
+    res[i] = zx::minmaxClip(v, 0.0f, 1.0f);
+  }
+  return res;
+}
+
+// Classified volume of allocated bricks.
+class BrickedVolume {
+private:
+  int _w = 0, _h = 0, _d = 0;
+  int _bw = 0, _bh = 0, _bd = 0; // # bricks along each axis
+  vector<const RGBAColor *> _bricks; // top level, x fastest
+  vector<vector<RGBAColor>> _pools;  // allocated bricks, by builder thread
+  vector<RGBAColor> _emptyBrick = vector<RGBAColor>(BRICK_VOXELS, Transparent);
+  int _activeBricks = 0;
+
+public:
+  // Classify `volumeData` of `w * h * d` by `tf` into bricks, using
+  // `nThreads` threads, each taking slabs of bricks along z.
+  void build(const uint16 *volumeData, int w, int h, int d,
+             const function<void(const uint16 *, int, RGBAColor *)> &tf,
+             int nThreads) {
+    _w = w, _h = h, _d = d;
+    _bw = (w + BRICK_SIZE - 1) >> BRICK_LOG2;
+    _bh = (h + BRICK_SIZE - 1) >> BRICK_LOG2;
+    _bd = (d + BRICK_SIZE - 1) >> BRICK_LOG2;
+    nThreads = std::max(1, std::min(nThreads, _bd));
+    _bricks.assign((size_t)_bw * _bh * _bd, _emptyBrick.data());
+    _pools.assign(nThreads, vector<RGBAColor>());
+
+    // brick of each thread, by index into its pool, resolved after join
+    vector<vector<std::pair<size_t, size_t>>> allocated(nThreads);
+    vector<std::thread> workers;
+    for (int t = 0; t < nThreads; t++) {
+      workers.push_back(std::thread([&, t]() {
+        vector<uint16> values(BRICK_VOXELS);
+        vector<RGBAColor> colors(BRICK_VOXELS);
+        for (int bz = _bd * t / nThreads; bz < _bd * (t + 1) / nThreads;
+             bz++) {
+          for (int by = 0; by < _bh; by++) {
+            for (int bx = 0; bx < _bw; bx++) {
+              // gather the brick with apron, clamped to the volume
+              int i = 0;
+              for (int z = 0; z < BRICK_SPAN; z++) {
+                int vz = std::min((bz << BRICK_LOG2) + z, d - 1);
+                for (int y = 0; y < BRICK_SPAN; y++) {
+                  int vy = std::min((by << BRICK_LOG2) + y, h - 1);
+                  const uint16 *row = volumeData + ((size_t)vz * h + vy) * w;
+                  for (int x = 0; x < BRICK_SPAN; x++) {
+                    values[i++] = row[std::min((bx << BRICK_LOG2) + x, w - 1)];
+                  }
+                }
+              }
+              tf(values.data(), BRICK_VOXELS, colors.data());
+              if (std::none_of(colors.begin(), colors.end(),
+                               [](const RGBAColor &c) { return c.a > 0; })) {
+                continue;
+              }
+              size_t brick = ((size_t)bz * _bh + by) * _bw + bx;
+              allocated[t].push_back({brick, _pools[t].size()});
+              _pools[t].insert(_pools[t].end(), colors.begin(), colors.end());
+            }
+          }
+        }
+      }));
+    }
+    for (auto &worker : workers) {
+      worker.join();
+    }
+
+    _activeBricks = 0;
+    for (int t = 0; t < nThreads; t++) {
+      _pools[t].shrink_to_fit();
+      for (const auto &a : allocated[t]) {
+        _bricks[a.first] = _pools[t].data() + a.second;
+        _activeBricks++;
+      }
+    }
+  }
+
+  // Interpolated color of `pos` in [0, size - 1] using TriLinear method, the
+  // same as on the dense volume.
+  RGBAColor interpolate(const vec3 &pos) const {
+    int x0 = int(pos.x), y0 = int(pos.y), z0 = int(pos.z);
+    float xd = pos.x - x0, yd = pos.y - y0, zd = pos.z - z0;
+    const RGBAColor *brick =
+        _bricks[((size_t)(z0 >> BRICK_LOG2) * _bh + (y0 >> BRICK_LOG2)) * _bw +
+                (x0 >> BRICK_LOG2)];
+    const int mask = BRICK_SIZE - 1;
+    const int dx = 1, dy = BRICK_SPAN, dz = BRICK_SPAN * BRICK_SPAN;
+    const RGBAColor *base =
+        brick + (z0 & mask) * dz + (y0 & mask) * dy + (x0 & mask);
+    return blendTriLinear(base, dx, dy, dz, xd, yd, zd);
+  }
+
+  int activeBricks() const { return _activeBricks; }
+  int totalBricks() const { return (int)_bricks.size(); }
+
+  // Bytes held, including the top level.
+  size_t bytes() const {
+    size_t res = _bricks.size() * sizeof(RGBAColor *) +
+                 _emptyBrick.size() * sizeof(RGBAColor);
+    for (const auto &pool : _pools) {
+      res += pool.size() * sizeof(RGBAColor);
+    }
+    return res;
+  }
+
+  // Free the bricks.
+  void clear() {
+    _bricks.clear();
+    _pools.clear();
+    _activeBricks = 0;
+  }
+};
+
+} // namespace zx
+
+#endif
@@ -0,0 +1,269 @@
+#pragma once
+
+// On-disk cache of derived volume data for Ray Casting
+// by z0gSh1u (Zhuo Xu) @ https://github.com/z0gSh1u/seu-viz
+// Data derived from the volume, such as decoded voxels and the classified
+// volume, are kept as files in a cache directory, one per product and name,
+// e.g. per volume and transfer function. Each file holds a header, the key of
+// everything the data depend on, and the data aligned for mapping, so that a
+// later run maps them instead of deriving them again, as long as the key
+// matches. Files are written by a background thread, aside and then renamed,
+// so rendering does not wait for disk and no reader sees a partial file.
+
+#ifndef VOLUMECACHE_HPP_
+#define VOLUMECACHE_HPP_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <cstdio>
+#include <thread>
+#include <fstream>
+#include <iostream>
+#include <functional>
+#include <condition_variable>
+#include "../framework/ReNow.hpp"
+#include "../framework/Utils.hpp"
+#include "../framework/MappedFile.hpp"
+#include "imageCache.hpp"
+
+using std::function;
+
+// "RNVC" in file
+#define VOLUME_CACHE_MAGIC 0x43564E52
+// bump when layout of the cache file changes
+#define VOLUME_CACHE_VERSION 1
+// data start at a multiple of this in file
+#define VOLUME_CACHE_ALIGN 64
+// bytes written between checks for cancelling
+#define VOLUME_CACHE_CHUNK (64 << 20)
+
+namespace zx {
+
+// Header of a volume cache file, followed by the key, and then the data at
+// `dataOffset`.
+struct _VolumeCacheHeader {
+  unsigned int magic, version;
+  unsigned long long keySize, dataOffset, dataBytes;
+};
+
+// Digest of transfer function `tf` by its colors of all voxel values, so that
+// a changed definition of the same name is told apart.
+unsigned long long transferFunctionDigest(
+    const function<void(const uint16 *, int, RGBAColor *)> &tf) {
+  const int n = 1 << 16;
+  vector<uint16> values(n);
+  for (int i = 0; i < n; i++) {
+    values[i] = i;
+  }
+  vector<RGBAColor> colors(n);
+  tf(values.data(), n, colors.data());
+  // 64-bit FNV-1a over the bytes
+  unsigned long long hash = 14695981039346656037ULL;
+  const unsigned char *p = (const unsigned char *)colors.data();
+  for (size_t i = 0; i < colors.size() * sizeof(RGBAColor); i++) {
+    hash = (hash ^ p[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Derived volume data mapped from cache file.
+class CachedVolumeData {
+private:
+  std::unique_ptr<MappedFile> _file;
+  const char *_data;
+  size_t _bytes;
+
+public:
+  CachedVolumeData(std::unique_ptr<MappedFile> &&file, size_t offset,
+                   size_t bytes)
+      : _file(std::move(file)), _data(_file->data() + offset),
+        _bytes(bytes) {}
+
+  const void *data() const { return _data; }
+  size_t bytes() const { return _bytes; }
+};
+
+// Cache directory of derived volume data.
+class VolumeCache {
+private:
+  struct _Job {
+    string path, key;
+    const void *data;
+    size_t bytes;
+  };
+
+  string _dir; // disabled if empty
+  std::thread _thread;
+  std::mutex _mutex;
+  std::condition_variable _queued, _drained;
+  std::deque<_Job> _queue;
+  const void *_writing = nullptr; // data of the job being written
+  std::atomic<bool> _cancel{false};
+  bool _stopping = false;
+
+  string _path(const string &product, const string &name) const {
+    char hash[32];
+    snprintf(hash, sizeof(hash), "%016llx", _fnv1a(name));
+    return _dir + "/" + product + "_" + hash + ".rnvol";
+  }
+
+  // Write `job` aside and rename it into place. Returns false on failure or
+  // if cancelled.
+  bool _write(const _Job &job) {
+    _VolumeCacheHeader header = {};
+    header.magic = VOLUME_CACHE_MAGIC, header.version = VOLUME_CACHE_VERSION;
+    header.keySize = job.key.size();
+    header.dataOffset =
+        (sizeof(header) + job.key.size() + VOLUME_CACHE_ALIGN - 1) /
+        VOLUME_CACHE_ALIGN * VOLUME_CACHE_ALIGN;
+    header.dataBytes = job.bytes;
+    string tempPath = job.path + ".tmp";
+    bool ok;
+    {
+      std::ofstream file(tempPath, ios::binary | ios::trunc);
+      file.write((const char *)&header, sizeof(header));
+      file.write(job.key.data(), job.key.size());
+      string padding(header.dataOffset - sizeof(header) - job.key.size(), 0);
+      file.write(padding.data(), padding.size());
+      const char *data = (const char *)job.data;
+      for (size_t done = 0; done < job.bytes && file.good() && !_cancel;
+           done += VOLUME_CACHE_CHUNK) {
+        file.write(data + done,
+                   std::min((size_t)VOLUME_CACHE_CHUNK, job.bytes - done));
+      }
+      ok = file.good() && !_cancel;
+    }
+    if (!ok) {
+      std::remove(tempPath.c_str());
+      return false;
+    }
+    std::remove(job.path.c_str());
+    return std::rename(tempPath.c_str(), job.path.c_str()) == 0;
+  }
+
+  void _run() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+      _queued.wait(lock, [this]() { return _stopping || !_queue.empty(); });
+      if (_stopping) {
+        return;
+      }
+      _Job job = std::move(_queue.front());
+      _queue.pop_front();
+      _writing = job.data;
+      _cancel = false;
+      lock.unlock();
+      if (!_write(job) && !_cancel) {
+        std::cerr << "[WARN] Cannot write volume cache: " << job.path
+                  << std::endl;
+      }
+      lock.lock();
+      _writing = nullptr;
+      _drained.notify_all();
+    }
+  }
+
+public:
+  // Drop what is queued before leaving, since its data may be gone.
+  ~VolumeCache() {
+    if (_thread.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queue.clear();
+        _stopping = true;
+        _cancel = true;
+      }
+      _queued.notify_one();
+      _thread.join();
+    }
+  }
+
+  // Keep cache files in directory `dir`, created if not present, or disable
+  // the cache if `dir` is empty.
+  void configure(const string &dir) {
+    flush();
+    _dir = dir;
+    if (!_dir.empty()) {
+      _makeDirectory(_dir);
+    }
+  }
+
+  bool enabled() const { return !_dir.empty(); }
+
+  // Map `product` of `name` if it is cached with `key` and holds `bytes`.
+  // Returns nullptr if not.
+  std::unique_ptr<CachedVolumeData> find(const string &product,
+                                         const string &name,
+                                         const string &key, size_t bytes) {
+    if (_dir.empty()) {
+      return nullptr;
+    }
+    string path = _path(product, name);
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0 ||
+        (size_t)info.st_size < sizeof(_VolumeCacheHeader)) {
+      return nullptr;
+    }
+    std::unique_ptr<MappedFile> file(new MappedFile(path));
+    const _VolumeCacheHeader &header =
+        *(const _VolumeCacheHeader *)file->data();
+    if (header.magic != VOLUME_CACHE_MAGIC ||
+        header.version != VOLUME_CACHE_VERSION ||
+        header.keySize != key.size() || header.dataBytes != bytes ||
+        header.dataOffset % VOLUME_CACHE_ALIGN != 0 ||
+        header.dataOffset < sizeof(header) + key.size() ||
+        file->size() != header.dataOffset + bytes ||
+        key.compare(0, key.size(), file->data() + sizeof(header),
+                    key.size()) != 0) {
+      return nullptr;
+    }
+    size_t offset = header.dataOffset;
+    return std::unique_ptr<CachedVolumeData>(
+        new CachedVolumeData(std::move(file), offset, bytes));
+  }
+
+  // Write `bytes` of `data` as `product` of `name` with `key` in background.
+  // `data` must stay unchanged until written, see `cancel`.
+  void store(const string &product, const string &name, const string &key,
+             const void *data, size_t bytes) {
+    if (_dir.empty()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _queue.push_back({_path(product, name), key, data, bytes});
+      if (!_thread.joinable()) {
+        _thread = std::thread(&VolumeCache::_run, this);
+      }
+    }
+    _queued.notify_one();
+  }
+
+  // Drop writes of `data`, and stop the one in progress, e.g. before `data`
+  // changes or is freed.
+  void cancel(const void *data) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (auto it = _queue.begin(); it != _queue.end();) {
+      it = it->data == data ? _queue.erase(it) : it + 1;
+    }
+    if (_writing == data && data != nullptr) {
+      _cancel = true;
+      _drained.wait(lock, [this, data]() { return _writing != data; });
+    }
+  }
+
+  // Wait until every queued write is done.
+  void flush() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _drained.wait(lock,
+                  [this]() { return _queue.empty() && _writing == nullptr; });
+  }
+};
+
+} // namespace zx
+
+#endif
@@ -0,0 +1,540 @@
+#pragma once
+
+// Volume file readers for Ray Casting
+// by z0gSh1u (Zhuo Xu) @ https://github.com/z0gSh1u/seu-viz
+// Reads NRRD (.nrrd, .nhdr), MetaImage (.mhd, .mha) and headerless raw
+// volumes, either raw or gzip encoded. Dimensions, spacing and voxel type come
+// from the header, and voxels are decoded in one streaming pass straight into
+// the 16-bit layout that the renderer uses.
+// @see http://teem.sourceforge.net/nrrd/format.html
+// @see https://itk.org/Wiki/ITK/MetaIO/Documentation
+
+#ifndef VOLUMEFILE_HPP_
+#define VOLUMEFILE_HPP_
+
+#include <zlib.h>
+#include <map>
+#include <cmath>
+#include <cctype>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <type_traits>
+#include "../framework/ReNow.hpp"
+#include "../framework/Utils.hpp"
+
+// Signed voxels are taken as CT HU values, and shifted by this offset into
+// the unsigned range that transfer functions expect (see `HU`).
+#define SIGNED_VOXEL_OFFSET 1024
+
+namespace zx {
+
+// Voxel types of volume files.
+enum VoxelType {
+  VOXEL_INT8,
+  VOXEL_UINT8,
+  VOXEL_INT16,
+  VOXEL_UINT16,
+  VOXEL_INT32,
+  VOXEL_UINT32,
+  VOXEL_FLOAT32,
+  VOXEL_FLOAT64,
+};
+
+// Bytes per voxel of VoxelType.
+int voxelTypeSize(VoxelType type) {
+  const int sizes[] = {1, 1, 2, 2, 4, 4, 4, 8};
+  return sizes[type];
+}
+
+// Parse VoxelType from type names of NRRD, MetaImage or config file.
+VoxelType parseVoxelType(const string &name) {
+  static const std::map<string, VoxelType> types = {
+      // NRRD
+      {"signed char", VOXEL_INT8},
+      {"int8", VOXEL_INT8},
+      {"int8_t", VOXEL_INT8},
+      {"uchar", VOXEL_UINT8},
+      {"unsigned char", VOXEL_UINT8},
+      {"uint8", VOXEL_UINT8},
+      {"uint8_t", VOXEL_UINT8},
+      {"short", VOXEL_INT16},
+      {"short int", VOXEL_INT16},
+      {"signed short", VOXEL_INT16},
+      {"signed short int", VOXEL_INT16},
+      {"int16", VOXEL_INT16},
+      {"int16_t", VOXEL_INT16},
+      {"ushort", VOXEL_UINT16},
+      {"unsigned short", VOXEL_UINT16},
+      {"unsigned short int", VOXEL_UINT16},
+      {"uint16", VOXEL_UINT16},
+      {"uint16_t", VOXEL_UINT16},
+      {"int", VOXEL_INT32},
+      {"signed int", VOXEL_INT32},
+      {"int32", VOXEL_INT32},
+      {"int32_t", VOXEL_INT32},
+      {"uint", VOXEL_UINT32},
+      {"unsigned int", VOXEL_UINT32},
+      {"uint32", VOXEL_UINT32},
+      {"uint32_t", VOXEL_UINT32},
+      {"float", VOXEL_FLOAT32},
+      {"double", VOXEL_FLOAT64},
+      // MetaImage
+      {"MET_CHAR", VOXEL_INT8},
+      {"MET_UCHAR", VOXEL_UINT8},
+      {"MET_SHORT", VOXEL_INT16},
+      {"MET_USHORT", VOXEL_UINT16},
+      {"MET_INT", VOXEL_INT32},
+      {"MET_UINT", VOXEL_UINT32},
+      {"MET_FLOAT", VOXEL_FLOAT32},
+      {"MET_DOUBLE", VOXEL_FLOAT64},
+  };
+  auto it = types.find(name);
+  ASSERT(it != types.end(), "[ERROR] Unsupported voxel type: " + name);
+  return it->second;
+}
+
+// Where and how voxels are stored in a volume file.
+struct VolumeFileInfo {
+  string dataPath;      // file holding the voxels
+  long long dataOffset; // byte offset of voxels (compressed or not) in it,
+                        // -1 means they end the file
+  long long skipBytes;  // bytes to skip after decompression
+  int width, height, zCount;
+  vec3 spacing; // physical size of voxel
+  VoxelType type;
+  bool bigEndian;
+  bool compressed; // gzip or zlib stream
+};
+
+// Info of headerless raw volume file.
+VolumeFileInfo rawVolumeInfo(const string &path, int w, int h, int d,
+                             VoxelType type) {
+  return {path, 0, 0, w, h, d, vec3(1, 1, 1), type, false, false};
+}
+
+// Remove leading and trailing whitespaces.
+string _trimString(const string &str) {
+  size_t l = 0, r = str.size();
+  while (l < r && isspace((unsigned char)str[l])) {
+    l++;
+  }
+  while (r > l && isspace((unsigned char)str[r - 1])) {
+    r--;
+  }
+  return str.substr(l, r - l);
+}
+
+// Resolve `path` relative to the directory of `headerPath`.
+string _resolveDataPath(const string &headerPath, const string &path) {
+  bool absolute = stringStartsWith(path, "/") || stringStartsWith(path, "\\") ||
+                  (path.size() > 1 && path[1] == ':');
+  size_t slash = headerPath.find_last_of("/\\");
+  return absolute || slash == string::npos
+             ? path
+             : headerPath.substr(0, slash + 1) + path;
+}
+
+// Byte offset after the first `lines` lines of file.
+long long _offsetAfterLines(const string &path, int lines) {
+  std::ifstream s(path, ios::binary);
+  string line;
+  for (int i = 0; i < lines; i++) {
+    ASSERT(bool(std::getline(s, line)), "[ERROR] Cannot skip lines: " + path);
+  }
+  return s.tellg();
+}
+
+// Read header of NRRD file (.nrrd with attached data, or detached .nhdr).
+VolumeFileInfo readNRRDHeader(const string &path) {
+  std::ifstream s(path, ios::binary);
+  ASSERT(s.good(), "[ERROR] Cannot open volume file: " + path);
+  string line;
+  std::getline(s, line);
+  ASSERT(stringStartsWith(line, "NRRD"), "[ERROR] Not a NRRD file: " + path);
+
+  // "<field>: <desc>" lines, until an empty line. Comments start with #, and
+  // "<key>:=<value>" pairs are ignored.
+  std::map<string, string> fields;
+  while (std::getline(s, line)) {
+    line = _trimString(line);
+    if (line.empty()) {
+      break;
+    }
+    size_t colon = line.find(": ");
+    if (line[0] == '#' || colon == string::npos) {
+      continue;
+    }
+    fields[line.substr(0, colon)] = _trimString(line.substr(colon + 2));
+  }
+  long long headerEnd = s.tellg();
+  auto field = [&](const string &key, const string &def) {
+    return fields.count(key) ? fields[key] : def;
+  };
+  const regex blank("\\s+");
+
+  VolumeFileInfo info;
+  ASSERT(field("dimension", "") == "3",
+         "[ERROR] Only 3D NRRD is supported: " + path);
+  vector<int> sizes = mapParseInt(stringSplit(field("sizes", ""), blank));
+  ASSERT(sizes.size() == 3, "[ERROR] Invalid NRRD sizes: " + path);
+  info.width = sizes[0], info.height = sizes[1], info.zCount = sizes[2];
+  info.type = parseVoxelType(field("type", ""));
+  info.bigEndian = field("endian", "little") == "big";
+
+  info.spacing = vec3(1, 1, 1);
+  if (fields.count("spacings")) {
+    vector<float> spacings =
+        mapParseFloat(stringSplit(fields["spacings"], blank));
+    for (int i = 0; i < 3 && i < (int)spacings.size(); i++) {
+      info.spacing[i] = std::isnan(spacings[i]) ? 1 : fabs(spacings[i]);
+    }
+  } else if (fields.count("space directions")) {
+    // one vector per axis, such as (0.7,0,0) (0,0.7,0) (0,0,2.5)
+    vector<string> directions =
+        stringSplit(fields["space directions"], regex("\\)\\s*"));
+    for (int i = 0; i < 3 && i < (int)directions.size(); i++) {
+      vector<float> d = mapParseFloat(
+          stringSplit(directions[i].substr(directions[i].find('(') + 1),
+                      regex("\\s*,\\s*")));
+      float len = 0;
+      for (float c : d) {
+        len += c * c;
+      }
+      info.spacing[i] = d.size() == 3 && len > 0 ? sqrt(len) : 1;
+    }
+  }
+
+  string encoding = field("encoding", "");
+  ASSERT(encoding == "raw" || encoding == "gzip" || encoding == "gz",
+         "[ERROR] Unsupported NRRD encoding: " + encoding);
+  info.compressed = encoding != "raw";
+
+  string dataFile = field("data file", field("datafile", ""));
+  if (dataFile.empty()) {
+    info.dataPath = path;
+    info.dataOffset = headerEnd;
+  } else {
+    ASSERT(dataFile.find("LIST") != 0 && dataFile.find('%') == string::npos,
+           "[ERROR] Multiple NRRD data files are not supported: " + path);
+    info.dataPath = _resolveDataPath(path, dataFile);
+    info.dataOffset = _offsetAfterLines(
+        info.dataPath, atoi(field("line skip", "0").c_str()));
+  }
+  long long byteSkip = atoll(field("byte skip", "0").c_str());
+  info.skipBytes = info.compressed ? byteSkip : 0;
+  if (!info.compressed) {
+    info.dataOffset = byteSkip == -1 ? -1 : info.dataOffset + byteSkip;
+  }
+  return info;
+}
+
+// Read header of MetaImage file (.mha with local data, or .mhd).
+VolumeFileInfo readMetaImageHeader(const string &path) {
+  std::ifstream s(path, ios::binary);
+  ASSERT(s.good(), "[ERROR] Cannot open volume file: " + path);
+
+  // "<Key> = <Value>" lines, ElementDataFile being the last one
+  std::map<string, string> fields;
+  string line;
+  while (std::getline(s, line)) {
+    size_t eq = line.find('=');
+    if (eq == string::npos) {
+      continue;
+    }
+    string key = _trimString(line.substr(0, eq));
+    fields[key] = _trimString(line.substr(eq + 1));
+    if (key == "ElementDataFile") {
+      break;
+    }
+  }
+  long long headerEnd = s.tellg();
+  auto field = [&](const string &key, const string &def) {
+    return fields.count(key) ? fields[key] : def;
+  };
+  auto isTrue = [](const string &v) { return v == "True" || v == "true"; };
+  const regex blank("\\s+");
+
+  VolumeFileInfo info;
+  ASSERT(field("NDims", "") == "3",
+         "[ERROR] Only 3D MetaImage is supported: " + path);
+  ASSERT(field("ElementNumberOfChannels", "1") == "1",
+         "[ERROR] Only single channel MetaImage is supported: " + path);
+  vector<int> sizes = mapParseInt(stringSplit(field("DimSize", ""), blank));
+  ASSERT(sizes.size() == 3, "[ERROR] Invalid MetaImage DimSize: " + path);
+  info.width = sizes[0], info.height = sizes[1], info.zCount = sizes[2];
+  info.type = parseVoxelType(field("ElementType", ""));
+  info.bigEndian = isTrue(field("ElementByteOrderMSB",
+                                field("BinaryDataByteOrderMSB", "False")));
+  info.compressed = isTrue(field("CompressedData", "False"));
+  info.skipBytes = 0;
+
+  info.spacing = vec3(1, 1, 1);
+  vector<float> spacings = mapParseFloat(
+      stringSplit(field("ElementSpacing", field("ElementSize", "")), blank));
+  for (int i = 0; i < 3 && i < (int)spacings.size(); i++) {
+    info.spacing[i] = spacings[i] > 0 ? spacings[i] : 1;
+  }
+
+  string dataFile = field("ElementDataFile", "");
+  ASSERT(!dataFile.empty(), "[ERROR] Missing ElementDataFile: " + path);
+  if (dataFile == "LOCAL") {
+    info.dataPath = path;
+    info.dataOffset = headerEnd;
+  } else {
+    ASSERT(dataFile.find("LIST") != 0 && dataFile.find('%') == string::npos,
+           "[ERROR] Multiple MetaImage data files are not supported: " + path);
+    info.dataPath = _resolveDataPath(path, dataFile);
+    info.dataOffset = atoll(field("HeaderSize", "0").c_str());
+  }
+  return info;
+}
+
+// Read header of volume file according to its extension. Returns false if it
+// is a headerless raw file.
+bool readVolumeHeader(const string &path, VolumeFileInfo &info) {
+  size_t dot = path.find_last_of('.');
+  string ext = dot == string::npos ? "" : path.substr(dot + 1);
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  if (ext == "nrrd" || ext == "nhdr") {
+    info = readNRRDHeader(path);
+  } else if (ext == "mhd" || ext == "mha") {
+    info = readMetaImageHeader(path);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Whether this machine is big endian.
+bool _isBigEndianHost() {
+  const uint16 probe = 1;
+  return *(const uint8 *)&probe == 0;
+}
+
+template <typename T>
+void _convertVoxels(const uint8 *src, size_t count, bool swapBytes,
+                    uint16 *dst) {
+  const double offset = std::is_signed<T>::value ? SIGNED_VOXEL_OFFSET : 0;
+  uint8 bytes[sizeof(T)];
+  T v;
+  for (size_t i = 0; i < count; i++) {
+    memcpy(bytes, src + i * sizeof(T), sizeof(T));
+    if (swapBytes) {
+      std::reverse(bytes, bytes + sizeof(T));
+    }
+    memcpy(&v, bytes, sizeof(T));
+    double x = double(v) + offset;
+    dst[i] = std::isnan(x) ? 0 : uint16(minmaxClip(round(x), 0, 65535));
+  }
+}
+
+// Convert `count` voxels of `info.type` at `src` into 16-bit voxels at `dst`.
+void convertVoxels(const uint8 *src, size_t count, const VolumeFileInfo &info,
+                   uint16 *dst) {
+  bool swapBytes = info.bigEndian != _isBigEndianHost();
+  switch (info.type) {
+  case VOXEL_INT8:
+    return _convertVoxels<signed char>(src, count, false, dst);
+  case VOXEL_UINT8:
+    return _convertVoxels<unsigned char>(src, count, false, dst);
+  case VOXEL_INT16:
+    return _convertVoxels<short>(src, count, swapBytes, dst);
+  case VOXEL_UINT16:
+    return _convertVoxels<unsigned short>(src, count, swapBytes, dst);
+  case VOXEL_INT32:
+    return _convertVoxels<int>(src, count, swapBytes, dst);
+  case VOXEL_UINT32:
+    return _convertVoxels<unsigned int>(src, count, swapBytes, dst);
+  case VOXEL_FLOAT32:
+    return _convertVoxels<float>(src, count, swapBytes, dst);
+  case VOXEL_FLOAT64:
+    return _convertVoxels<double>(src, count, swapBytes, dst);
+  }
+}
+
+// Whether voxels are in the renderer's layout already, so that they can be
+// decoded into it without conversion.
+bool _isNativeLayout(const VolumeFileInfo &info) {
+  return info.type == VOXEL_UINT16 && info.bigEndian == _isBigEndianHost();
+}
+
+// Whether loading the volume file takes more than reading its voxels, i.e.
+// decompression or conversion.
+bool volumeFileNeedsDecoding(const VolumeFileInfo &info) {
+  return info.compressed || !_isNativeLayout(info);
+}
+
+// Voxels decoded per chunk.
+#define VOLUME_CHUNK_VOXELS (1 << 20)
+
+// Decode voxels [low, high) of uncompressed volume file into `store`.
+// Returns false if the file is too short.
+bool _decodeRawRange(const VolumeFileInfo &info, long long dataOffset,
+                     size_t low, size_t high, uint16 *store) {
+  std::ifstream s(info.dataPath, ios::binary);
+  int voxelSize = voxelTypeSize(info.type);
+  s.seekg(dataOffset + (long long)low * voxelSize);
+  bool native = _isNativeLayout(info);
+  vector<uint8> buffer(native ? 0 : (size_t)VOLUME_CHUNK_VOXELS * voxelSize);
+  for (size_t i = low; i < high; i += VOLUME_CHUNK_VOXELS) {
+    size_t n = std::min((size_t)VOLUME_CHUNK_VOXELS, high - i);
+    char *target = native ? (char *)(store + i) : (char *)buffer.data();
+    s.read(target, n * voxelSize);
+    if (s.gcount() != (std::streamsize)(n * voxelSize)) {
+      return false;
+    }
+    if (!native) {
+      convertVoxels(buffer.data(), n, info, store + i);
+    }
+  }
+  return true;
+}
+
+// Inflate exactly `bytes` bytes into `out`, reading input from `s` on demand.
+// Returns false if the stream ends early or is corrupted.
+bool _inflateExactly(z_stream &zs, std::ifstream &s, vector<uint8> &input,
+                     uint8 *out, size_t bytes) {
+  while (bytes > 0) {
+    // avail_out is 32-bit
+    uInt piece = (uInt)std::min(bytes, (size_t)1 << 30);
+    zs.next_out = out;
+    zs.avail_out = piece;
+    while (zs.avail_out > 0) {
+      if (zs.avail_in == 0) {
+        s.read((char *)input.data(), input.size());
+        zs.next_in = input.data();
+        zs.avail_in = (uInt)s.gcount();
+        if (zs.avail_in == 0) {
+          return false;
+        }
+      }
+      int ret = inflate(&zs, Z_NO_FLUSH);
+      if (ret == Z_STREAM_END && zs.avail_out > 0) {
+        return false;
+      }
+      if (ret != Z_OK && ret != Z_STREAM_END) {
+        return false;
+      }
+    }
+    out += piece;
+    bytes -= piece;
+  }
+  return true;
+}
+
+// Decode `count` voxels of compressed volume file into `store`. Inflating is
+// sequential by nature, so chunks are inflated in batches of `nThreads`, and
+// converted by `nThreads` threads while the next batch is being inflated.
+void _decodeCompressed(const VolumeFileInfo &info, size_t count,
+                       uint16 *store, int nThreads) {
+  std::ifstream s(info.dataPath, ios::binary);
+  s.seekg(info.dataOffset);
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  // detect gzip or zlib header automatically
+  ASSERT(inflateInit2(&zs, 15 + 32) == Z_OK, "[ERROR] Cannot init zlib.");
+  vector<uint8> input(1 << 20);
+  string corrupted = "[ERROR] Volume file is truncated or corrupted: " +
+                     info.dataPath;
+
+  vector<uint8> skipped(std::min(info.skipBytes, (long long)1 << 20));
+  for (long long left = info.skipBytes; left > 0; left -= skipped.size()) {
+    size_t n = (size_t)std::min(left, (long long)skipped.size());
+    ASSERT(_inflateExactly(zs, s, input, skipped.data(), n), corrupted);
+  }
+
+  int voxelSize = voxelTypeSize(info.type);
+  if (_isNativeLayout(info)) {
+    // no conversion, inflate straight into place
+    bool ok = _inflateExactly(zs, s, input, (uint8 *)store, count * voxelSize);
+    inflateEnd(&zs);
+    ASSERT(ok, corrupted);
+    return;
+  }
+
+  // double-buffered batches: [batch][thread]
+  vector<vector<uint8>> buffers[2];
+  vector<size_t> firsts[2], counts[2];
+  for (int b = 0; b < 2; b++) {
+    buffers[b].assign(nThreads,
+                      vector<uint8>((size_t)VOLUME_CHUNK_VOXELS * voxelSize));
+    firsts[b].assign(nThreads, 0);
+    counts[b].assign(nThreads, 0);
+  }
+  vector<std::thread> converters;
+  bool ok = true;
+  size_t next = 0;
+  for (int b = 0; next < count && ok; b ^= 1) {
+    for (int t = 0; t < nThreads; t++) {
+      size_t n = std::min((size_t)VOLUME_CHUNK_VOXELS, count - next);
+      firsts[b][t] = next, counts[b][t] = n;
+      ok = ok && _inflateExactly(zs, s, input, buffers[b][t].data(),
+                                 n * voxelSize);
+      next += n;
+    }
+    // the previous batch has been converted meanwhile
+    for (auto &t : converters) {
+      t.join();
+    }
+    converters.clear();
+    for (int t = 0; t < nThreads && ok; t++) {
+      converters.push_back(std::thread([&info, &buffers, &firsts, &counts,
+                                        store, b, t]() {
+        convertVoxels(buffers[b][t].data(), counts[b][t], info,
+                      store + firsts[b][t]);
+      }));
+    }
+  }
+  for (auto &t : converters) {
+    t.join();
+  }
+  inflateEnd(&zs);
+  ASSERT(ok, corrupted);
+}
+
+// Decode all voxels of volume file into `store`, which holds
+// `info.width * info.height * info.zCount` voxels, using `nThreads` threads.
+void loadVolumeFile(const VolumeFileInfo &info, uint16 *store, int nThreads) {
+  size_t count = (size_t)info.width * info.height * info.zCount;
+  nThreads = std::max(1, nThreads);
+  ASSERT(std::ifstream(info.dataPath, ios::binary).good(),
+         "[ERROR] Cannot open volume file: " + info.dataPath);
+  if (info.compressed) {
+    ASSERT(info.dataOffset != -1,
+           "[ERROR] Compressed voxels need a known offset: " + info.dataPath);
+    _decodeCompressed(info, count, store, nThreads);
+    return;
+  }
+
+  long long dataOffset = info.dataOffset;
+  if (dataOffset == -1) {
+    // voxels end the file
+    std::ifstream s(info.dataPath, ios::binary | ios::ate);
+    dataOffset = (long long)s.tellg() - (long long)count *
+                                            voxelTypeSize(info.type);
+  }
+  // contiguous ranges, each read by its own thread through its own stream
+  std::atomic<bool> ok(true);
+  vector<std::thread> workers;
+  for (int t = 0; t < nThreads; t++) {
+    size_t low = count * t / nThreads, high = count * (t + 1) / nThreads;
+    workers.push_back(std::thread([&info, &ok, dataOffset, low, high,
+                                   store]() {
+      if (!_decodeRawRange(info, dataOffset, low, high, store)) {
+        ok = false;
+      }
+    }));
+  }
+  for (auto &t : workers) {
+    t.join();
+  }
+  ASSERT(ok, "[ERROR] Volume file is truncated: " + info.dataPath);
+}
+
+} // namespace zx
+
+#endif
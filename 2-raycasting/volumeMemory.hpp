@@ -0,0 +1,192 @@
+#pragma once
+
+// Memory placement helpers for Ray Casting
+// by z0gSh1u (Zhuo Xu) @ https://github.com/z0gSh1u/seu-viz
+// Large volume buffers are allocated untouched (optionally on huge pages), so
+// that pages land on the NUMA node of the worker that touches them first.
+// Workers can be pinned to cores to keep that locality while rendering.
+
+#ifndef VOLUMEMEMORY_HPP_
+#define VOLUMEMEMORY_HPP_
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#pragma comment(lib, "Advapi32.lib")
+#else
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
+
+#include <thread>
+#include <vector>
+#include <iostream>
+#include "../framework/ReNow.hpp"
+#include "../framework/Utils.hpp"
+
+namespace zx {
+
+// How to back large buffers with huge pages.
+enum HugePageMode {
+  HUGE_PAGE_NONE,        // regular pages
+  HUGE_PAGE_TRANSPARENT, // hint the kernel to use transparent huge pages
+  HUGE_PAGE_EXPLICIT,    // reserved huge pages, fall back to regular pages
+};
+
+// Parse HugePageMode from config value "none", "transparent" or "explicit".
+HugePageMode parseHugePageMode(const string &name) {
+  if (name == "transparent") {
+    return HUGE_PAGE_TRANSPARENT;
+  } else if (name == "explicit") {
+    return HUGE_PAGE_EXPLICIT;
+  }
+  ASSERT(name == "none", "[ERROR] Invalid huge page mode: " + name);
+  return HUGE_PAGE_NONE;
+}
+
+// Round `bytes` up to a multiple of 2 MiB, the default huge page size.
+size_t roundUpToHugePage(size_t bytes) {
+  const size_t hugePage = 2 << 20;
+  return (bytes + hugePage - 1) / hugePage * hugePage;
+}
+
+#ifdef _WIN32
+// Enable SeLockMemoryPrivilege of the process, which large pages require,
+// once. It is enabled only if the user holds it, i.e. "Lock pages in memory"
+// is granted by the local security policy. Returns whether it is enabled.
+bool _enableLockMemoryPrivilege() {
+  static int enabled = -1;
+  if (enabled >= 0) {
+    return enabled == 1;
+  }
+  enabled = 0;
+  HANDLE token;
+  if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES,
+                        &token)) {
+    return false;
+  }
+  TOKEN_PRIVILEGES privileges = {};
+  privileges.PrivilegeCount = 1;
+  privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+  // fails with ERROR_NOT_ALL_ASSIGNED if not held
+  if (LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME,
+                           &privileges.Privileges[0].Luid) &&
+      AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) &&
+      GetLastError() == ERROR_SUCCESS) {
+    enabled = 1;
+  }
+  CloseHandle(token);
+  if (enabled == 0) {
+    std::cerr << "[WARN] Large pages need \"Lock pages in memory\" "
+                 "privilege, using regular pages."
+              << std::endl;
+  }
+  return enabled == 1;
+}
+#endif
+
+// Allocate `bytes` of page-aligned memory without touching it.
+// Release it using `freeLargeBuffer` with the same `bytes`.
+void *allocateLargeBuffer(size_t bytes, HugePageMode mode) {
+  void *ptr = nullptr;
+#ifdef _WIN32
+  // Windows has no transparent huge pages, and large pages require the
+  // SeLockMemoryPrivilege. Otherwise we fall back to regular pages.
+  size_t largePage = GetLargePageMinimum();
+  if (mode == HUGE_PAGE_EXPLICIT && largePage > 0 &&
+      _enableLockMemoryPrivilege()) {
+    size_t rounded = (bytes + largePage - 1) / largePage * largePage;
+    ptr = VirtualAlloc(NULL, rounded,
+                       MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                       PAGE_READWRITE);
+  }
+  if (ptr == nullptr) {
+    ptr = VirtualAlloc(NULL, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+  }
+#else
+  // mappings are rounded up to huge page size, whether they get huge pages
+  // or not, so that `freeLargeBuffer` knows the exact size
+  bytes = roundUpToHugePage(bytes);
+#ifdef MAP_HUGETLB
+  if (mode == HUGE_PAGE_EXPLICIT) {
+    ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    ptr = ptr == MAP_FAILED ? nullptr : ptr;
+  }
+#endif
+  if (ptr == nullptr) {
+    ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+               -1, 0);
+    ptr = ptr == MAP_FAILED ? nullptr : ptr;
+#ifdef MADV_HUGEPAGE
+    if (ptr != nullptr && mode == HUGE_PAGE_TRANSPARENT) {
+      madvise(ptr, bytes, MADV_HUGEPAGE);
+    }
+#endif
+  }
+#endif
+  ASSERT(ptr != nullptr, "[ERROR] Cannot allocate " + std::to_string(bytes) +
+                             " bytes for volume.");
+  return ptr;
+}
+
+// Free memory from `allocateLargeBuffer`.
+void freeLargeBuffer(void *ptr, size_t bytes) {
+  if (ptr == nullptr) {
+    return;
+  }
+#ifdef _WIN32
+  VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+  munmap(ptr, roundUpToHugePage(bytes));
+#endif
+}
+
+// Pin the calling thread to `core`, numbered across all processor groups on
+// Windows. Returns whether it succeeded, false if there is no such core.
+bool pinCurrentThread(int core) {
+  if (core < 0) {
+    return false;
+  }
+#ifdef _WIN32
+  // a group has at most 64 processors, so find the group of `core`
+  WORD nGroups = GetActiveProcessorGroupCount();
+  for (WORD g = 0; g < nGroups; g++) {
+    int n = (int)GetActiveProcessorCount(g);
+    if (core < n) {
+      GROUP_AFFINITY affinity = {};
+      affinity.Group = g;
+      affinity.Mask = KAFFINITY(1) << core;
+      return SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL) != 0;
+    }
+    core -= n;
+  }
+  return false;
+#else
+  if (core >= CPU_SETSIZE) {
+    return false;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(core, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif
+}
+
+// Core for worker `i` of `nWorkers` when not configured explicitly. Workers
+// are spread evenly over all cores, so that they span every socket instead of
+// filling the first one.
+int defaultCoreOfWorker(int i, int nWorkers) {
+  int nCores = std::max(1, (int)std::thread::hardware_concurrency());
+  return nWorkers >= nCores ? i % nCores : i * (nCores / nWorkers);
+}
+
+} // namespace zx
+
+#endif
@@ -0,0 +1,258 @@
+#pragma once
+
+// Time-varying (4D) volume for Ray Casting
+// by z0gSh1u (Zhuo Xu) @ https://github.com/z0gSh1u/seu-viz
+// Frames of the same size are held in a ring of volume slots. While the
+// current frame renders, a background thread loads the next frames into the
+// other slots, and optionally classifies them, so that playback runs at
+// rendering speed rather than disk speed.
+
+#ifndef VOLUMESEQUENCE_HPP_
+#define VOLUMESEQUENCE_HPP_
+
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+#include "../framework/ReNow.hpp"
+#include "../framework/Utils.hpp"
+#include "volumeFile.hpp"
+#include "volumeMemory.hpp"
+
+using std::function;
+
+namespace zx {
+
+// State of a volume slot.
+enum VolumeSlotState {
+  SLOT_EMPTY,   // holds no frame
+  SLOT_LOADING, // being loaded by the background thread
+  SLOT_READY,   // holds `frame`
+  SLOT_FAILED,  // failed to load `frame`, see `error`
+};
+
+// Buffers of one frame in the ring.
+struct VolumeSlot {
+  uint16 *volume = nullptr;
+  RGBAColor *colored = nullptr;
+  int frame = -1;
+  string transferFunction; // `colored` is classified by, empty if not
+  VolumeSlotState state = SLOT_EMPTY;
+  string error;
+};
+
+// Frames of a time-varying volume, loaded ahead of the current one.
+class VolumeSequence {
+private:
+  vector<VolumeFileInfo> _frames;
+  vector<VolumeSlot> _slots;
+  size_t _voxelCount = 0;
+  int _prefetch = 0; // # frames loaded ahead of the current one
+  int _nThreads = 1; // to decode and classify a frame
+  int _current = 0;
+  // classifies loaded frames if set
+  string _transferFunctionName;
+  function<void(const uint16 *, int, RGBAColor *)> _transferFunction;
+
+  std::thread _thread;
+  std::mutex _mutex;
+  std::condition_variable _wake, _loaded;
+  bool _stopping = false;
+
+  // Whether `frame` is within `_prefetch` frames from the current one. The
+  // sequence loops.
+  bool _inWindow(int frame) const {
+    int n = _frames.size();
+    return (frame - _current + n) % n <= _prefetch;
+  }
+
+  // Slot holding or loading `frame`, or -1.
+  int _find(int frame) const {
+    for (int i = 0; i < (int)_slots.size(); i++) {
+      if (_slots[i].frame == frame && _slots[i].state != SLOT_EMPTY) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  // The nearest frame in window that is not held yet, and a slot whose frame
+  // has left the window. Returns false if there is no such job.
+  bool _nextJob(int &frame, int &slot) const {
+    int n = _frames.size();
+    for (int i = 0; i <= _prefetch && i < n; i++) {
+      frame = (_current + i) % n;
+      if (_find(frame) != -1) {
+        continue;
+      }
+      for (slot = 0; slot < (int)_slots.size(); slot++) {
+        const VolumeSlot &s = _slots[slot];
+        if (s.state == SLOT_EMPTY ||
+            (s.state != SLOT_LOADING && !_inWindow(s.frame))) {
+          return true;
+        }
+      }
+      return false;
+    }
+    return false;
+  }
+
+  // Classify `slot` by `tf` in `_nThreads` contiguous ranges.
+  void _classify(VolumeSlot &slot,
+                 const function<void(const uint16 *, int, RGBAColor *)> &tf) {
+    vector<std::thread> workers;
+    for (int t = 0; t < _nThreads; t++) {
+      size_t low = _voxelCount * t / _nThreads,
+             high = _voxelCount * (t + 1) / _nThreads;
+      workers.push_back(std::thread([&slot, &tf, low, high]() {
+        tf(slot.volume + low, int(high - low), slot.colored + low);
+      }));
+    }
+    for (auto &t : workers) {
+      t.join();
+    }
+  }
+
+  void _run() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+      int frame, slot;
+      _wake.wait(lock,
+                 [&]() { return _stopping || _nextJob(frame, slot); });
+      if (_stopping) {
+        return;
+      }
+      VolumeSlot &s = _slots[slot];
+      s.frame = frame;
+      s.state = SLOT_LOADING;
+      s.transferFunction = "";
+      string tfName = _transferFunctionName;
+      auto tf = _transferFunction;
+      lock.unlock();
+      string error;
+      try {
+        loadVolumeFile(_frames[frame], s.volume, _nThreads);
+        if (tf && s.colored != nullptr) {
+          _classify(s, tf);
+        }
+      } catch (const runtime_error &e) {
+        error = e.what();
+      }
+      lock.lock();
+      s.state = error.empty() ? SLOT_READY : SLOT_FAILED;
+      s.error = error;
+      s.transferFunction =
+          error.empty() && tf && s.colored != nullptr ? tfName : "";
+      _loaded.notify_all();
+    }
+  }
+
+  // Stop the background thread, leaving slots as they are.
+  void _stop() {
+    if (_thread.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+      }
+      _wake.notify_one();
+      _thread.join();
+    }
+    _stopping = false;
+  }
+
+public:
+  ~VolumeSequence() { release(); }
+
+  // Hold `frames` (all of the same size) in slots for the current frame and
+  // `prefetch` frames ahead, allocated on `hugePages`, with buffers for the
+  // classified volume if `classified`. Frames are decoded and classified by
+  // `nThreads` threads each.
+  void configure(const vector<VolumeFileInfo> &frames, HugePageMode hugePages,
+                 int prefetch, int nThreads, bool classified = true) {
+    release();
+    ASSERT(!frames.empty(), "[ERROR] No frame in volume sequence.");
+    _frames = frames;
+    _voxelCount = (size_t)frames[0].width * frames[0].height * frames[0].zCount;
+    _prefetch = std::max(0, prefetch);
+    _nThreads = std::max(1, nThreads);
+    _current = 0;
+    int nSlots = std::min(_prefetch + 1, (int)frames.size());
+    _slots = vector<VolumeSlot>(nSlots);
+    for (auto &slot : _slots) {
+      slot.volume = (uint16 *)allocateLargeBuffer(sizeof(uint16) * _voxelCount,
+                                                  hugePages);
+      if (classified) {
+        slot.colored = (RGBAColor *)allocateLargeBuffer(
+            sizeof(RGBAColor) * _voxelCount, hugePages);
+      }
+    }
+  }
+
+  // Classify frames loaded from now on by transfer function `tf` named
+  // `name`, or not if `tf` is empty.
+  void setTransferFunction(
+      const string &name,
+      const function<void(const uint16 *, int, RGBAColor *)> &tf) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _transferFunctionName = tf ? name : "";
+    _transferFunction = tf;
+  }
+
+  // Whether `frame` is loaded.
+  bool ready(int frame) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    int s = _find(frame);
+    return s != -1 && _slots[s].state == SLOT_READY;
+  }
+
+  // Make `frame` the current one, waiting until it is loaded, and load the
+  // frames after it in background. Its slot is left alone until another
+  // frame becomes current.
+  const VolumeSlot *acquire(int frame) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    ASSERT(frame >= 0 && frame < (int)_frames.size(),
+           "[ERROR] Invalid frame: " + std::to_string(frame));
+    _current = frame;
+    if (!_thread.joinable()) {
+      _thread = std::thread(&VolumeSequence::_run, this);
+    }
+    _wake.notify_one();
+    int s;
+    _loaded.wait(lock, [&]() {
+      s = _find(frame);
+      return s != -1 && (_slots[s].state == SLOT_READY ||
+                         _slots[s].state == SLOT_FAILED);
+    });
+    if (_slots[s].state == SLOT_FAILED) {
+      // try again next time
+      _slots[s].state = SLOT_EMPTY;
+      ASSERT(false, _slots[s].error);
+    }
+    return &_slots[s];
+  }
+
+  // Record that the current frame in `slot` is classified by transfer
+  // function `name`.
+  void markClassified(const VolumeSlot *slot, const string &name) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _slots.at(slot - _slots.data()).transferFunction = name;
+  }
+
+  int frameCount() const { return _frames.size(); }
+
+  // Stop loading and free the slots.
+  void release() {
+    _stop();
+    for (auto &slot : _slots) {
+      freeLargeBuffer(slot.volume, sizeof(uint16) * _voxelCount);
+      freeLargeBuffer(slot.colored, sizeof(RGBAColor) * _voxelCount);
+    }
+    _slots.clear();
+    _frames.clear();
+  }
+};
+
+} // namespace zx
+
+#endif
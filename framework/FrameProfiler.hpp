@@ -0,0 +1,350 @@
+#pragma once
+
+// Frame profiler of ReNow Framework
+// by z0gSh1u (Zhuo Xu) @ https://github.com/z0gSh1u/seu-viz
+// See:
+// https://github.com/z0gSh1u/typed-webgl
+// https://github.com/z0gSh1u/renow-ts
+// https://github.com/z0gSh1u/renow-c
+
+#ifndef FRAMEPROFILER_HPP_
+#define FRAMEPROFILER_HPP_
+
+#include <glad/glad.h>
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+
+#include "Utils.hpp"
+
+using std::string;
+using std::vector;
+
+namespace zx {
+
+// Times passes of each frame on CPU, and on GPU by timer queries, and counts
+// draw calls and state changes in them. Query results are read a few frames
+// later and only once available, so the profiler never stalls the pipeline.
+// Without timer queries, e.g. on some software drivers, only CPU times are
+// reported.
+class FrameProfiler {
+private:
+  typedef std::chrono::steady_clock _Clock;
+  static const int FramesInFlight = 3; // query sets, frames read back later
+
+  struct _Pass {
+    int id; // in _passNames
+    double cpuMs, gpuMs;
+    long long drawCalls, stateChanges;
+  };
+  // a frame with GPU times maybe not available yet
+  struct _Frame {
+    long long index = -1; // none if < 0
+    double cpuMs, gpuMs;
+    long long drawCalls, stateChanges;
+    vector<_Pass> passes;
+    vector<GLuint> passQueries;  // GL_TIME_ELAPSED of each pass
+    GLuint frameQueries[2] = {}; // GL_TIMESTAMP at begin and end
+  };
+  // sums of a pass over a report period
+  struct _PassTotal {
+    int count = 0, gpuCount = 0;
+    double cpuMs = 0, gpuMs = 0;
+    long long drawCalls = 0, stateChanges = 0;
+  };
+
+  bool _enabled = false, _gpu = false;
+  int _reportEvery = 0;
+  std::ofstream _csv;
+  vector<string> _passNames;
+  vector<_Frame> _frames = vector<_Frame>(FramesInFlight);
+  long long _frameIndex = 0;
+
+  // current frame and pass
+  _Clock::time_point _frameBegin, _passBegin;
+  int _pass = -1;
+  long long _drawCalls = 0, _stateChanges = 0; // counted so far
+  long long _frameDrawCalls, _frameStateChanges, _passDrawCalls,
+      _passStateChanges; // counted before
+
+  // over the report period and the whole run
+  vector<double> _periodFrameMs, _allFrameMs;
+  vector<_PassTotal> _periodPasses;
+  double _periodGpuMs = 0;
+  int _periodGpuCount = 0;
+
+  static double _msSince(const _Clock::time_point &tic) {
+    return std::chrono::duration<double, std::milli>(_Clock::now() - tic)
+        .count();
+  }
+
+  // Read GPU times of `frame` if they are available, or wait for them if
+  // `wait`. Otherwise they are dropped.
+  void _readBack(_Frame &frame, bool wait) {
+    frame.gpuMs = -1;
+    for (auto &pass : frame.passes) {
+      pass.gpuMs = -1;
+    }
+    if (!_gpu) {
+      return;
+    }
+    GLint available = 0;
+    glGetQueryObjectiv(frame.frameQueries[1], GL_QUERY_RESULT_AVAILABLE,
+                       &available);
+    if (!available && !wait) {
+      return;
+    }
+    // queries complete in order, so the others are available too
+    GLuint64 begin, end, elapsed;
+    glGetQueryObjectui64v(frame.frameQueries[0], GL_QUERY_RESULT, &begin);
+    glGetQueryObjectui64v(frame.frameQueries[1], GL_QUERY_RESULT, &end);
+    frame.gpuMs = (end - begin) * 1e-6;
+    for (size_t i = 0; i < frame.passes.size(); i++) {
+      glGetQueryObjectui64v(frame.passQueries[i], GL_QUERY_RESULT, &elapsed);
+      frame.passes[i].gpuMs = elapsed * 1e-6;
+    }
+  }
+
+  // Log `frame` finished earlier, and add it to the report period.
+  void _retire(_Frame &frame, bool wait) {
+    if (frame.index < 0) {
+      return;
+    }
+    _readBack(frame, wait);
+    if (_csv.is_open()) {
+      auto row = [&](const string &name, double cpuMs, double gpuMs,
+                     long long drawCalls, long long stateChanges) {
+        _csv << frame.index << "," << name << "," << cpuMs << ",";
+        if (gpuMs >= 0) {
+          _csv << gpuMs;
+        }
+        _csv << "," << drawCalls << "," << stateChanges << "\n";
+      };
+      row("frame", frame.cpuMs, frame.gpuMs, frame.drawCalls,
+          frame.stateChanges);
+      for (const auto &pass : frame.passes) {
+        row(_passNames[pass.id], pass.cpuMs, pass.gpuMs, pass.drawCalls,
+            pass.stateChanges);
+      }
+    }
+    if (frame.gpuMs >= 0) {
+      _periodGpuMs += frame.gpuMs, _periodGpuCount++;
+    }
+    for (const auto &pass : frame.passes) {
+      _periodPasses.resize(_passNames.size());
+      _PassTotal &total = _periodPasses[pass.id];
+      total.count++, total.cpuMs += pass.cpuMs;
+      total.drawCalls += pass.drawCalls;
+      total.stateChanges += pass.stateChanges;
+      if (pass.gpuMs >= 0) {
+        total.gpuCount++, total.gpuMs += pass.gpuMs;
+      }
+    }
+    frame.index = -1;
+  }
+
+  // Print frame time percentiles of `frameMs` to `out`.
+  static void _printPercentiles(std::ostream &out, vector<double> frameMs) {
+    double sum = 0;
+    for (double ms : frameMs) {
+      sum += ms;
+    }
+    out << std::fixed << std::setprecision(2) << sum / frameMs.size()
+        << " ms avg, p50 " << percentile(frameMs, 50) << ", p95 "
+        << percentile(frameMs, 95) << ", p99 " << percentile(frameMs, 99)
+        << ", max " << percentile(frameMs, 100) << " ms";
+  }
+
+public:
+  // The `p`-th percentile of `values` (nearest rank), 0 if none.
+  static double percentile(vector<double> values, double p) {
+    if (values.empty()) {
+      return 0;
+    }
+    size_t rank = (size_t)std::ceil(p / 100 * values.size());
+    size_t k = std::min(values.size() - 1, rank == 0 ? 0 : rank - 1);
+    std::nth_element(values.begin(), values.begin() + k, values.end());
+    return values[k];
+  }
+
+  // Start profiling in current GL context. Each frame is logged to
+  // `csvPath` if not empty, and a report is printed every `reportEvery`
+  // frames if not 0.
+  void enable(const string &csvPath = "", int reportEvery = 120) {
+    GLint timestampBits = 0, elapsedBits = 0;
+    if (GLAD_GL_VERSION_3_3) {
+      glGetQueryiv(GL_TIMESTAMP, GL_QUERY_COUNTER_BITS, &timestampBits);
+      glGetQueryiv(GL_TIME_ELAPSED, GL_QUERY_COUNTER_BITS, &elapsedBits);
+    }
+    _gpu = timestampBits > 0 && elapsedBits > 0;
+    if (!_gpu) {
+      std::cout << "[Profiler] No GPU timer queries, CPU times only."
+                << std::endl;
+    }
+    if (!csvPath.empty()) {
+      _csv.open(csvPath, std::ios::trunc);
+      ASSERT(_csv.is_open(), "Cannot write profile: " + csvPath);
+      _csv << "frame,pass,cpu_ms,gpu_ms,draw_calls,state_changes\n";
+    }
+    _reportEvery = reportEvery;
+    _enabled = true;
+  }
+
+  bool enabled() const { return _enabled; }
+
+  // Count a draw call or a state change, e.g. a bind. Cheap enough to call
+  // when not enabled.
+  void countDrawCall() { _drawCalls++; }
+  void countStateChange() { _stateChanges++; }
+
+  void beginFrame() {
+    if (!_enabled) {
+      return;
+    }
+    _Frame &frame = _frames[_frameIndex % FramesInFlight];
+    _retire(frame, false);
+    frame.index = _frameIndex;
+    frame.passes.clear();
+    if (_gpu) {
+      if (frame.frameQueries[0] == 0) {
+        glGenQueries(2, frame.frameQueries);
+      }
+      glQueryCounter(frame.frameQueries[0], GL_TIMESTAMP);
+    }
+    _frameDrawCalls = _drawCalls, _frameStateChanges = _stateChanges;
+    _frameBegin = _Clock::now();
+  }
+
+  // Begin pass `name` of current frame. Passes do not nest.
+  void beginPass(const string &name) {
+    if (!_enabled) {
+      return;
+    }
+    ASSERT(_pass < 0, "Pass " + name + " begins in another pass.");
+    _pass = (int)(std::find(_passNames.begin(), _passNames.end(), name) -
+                  _passNames.begin());
+    if (_pass == (int)_passNames.size()) {
+      _passNames.push_back(name);
+    }
+    _Frame &frame = _frames[_frameIndex % FramesInFlight];
+    if (_gpu) {
+      if (frame.passQueries.size() <= frame.passes.size()) {
+        GLuint query;
+        glGenQueries(1, &query);
+        frame.passQueries.push_back(query);
+      }
+      glBeginQuery(GL_TIME_ELAPSED, frame.passQueries[frame.passes.size()]);
+    }
+    _passDrawCalls = _drawCalls, _passStateChanges = _stateChanges;
+    _passBegin = _Clock::now();
+  }
+
+  void endPass() {
+    if (!_enabled) {
+      return;
+    }
+    ASSERT(_pass >= 0, "Pass ends without beginning.");
+    if (_gpu) {
+      glEndQuery(GL_TIME_ELAPSED);
+    }
+    _frames[_frameIndex % FramesInFlight].passes.push_back(
+        {_pass, _msSince(_passBegin), -1, _drawCalls - _passDrawCalls,
+         _stateChanges - _passStateChanges});
+    _pass = -1;
+  }
+
+  void endFrame() {
+    if (!_enabled) {
+      return;
+    }
+    _Frame &frame = _frames[_frameIndex % FramesInFlight];
+    if (_gpu) {
+      glQueryCounter(frame.frameQueries[1], GL_TIMESTAMP);
+    }
+    frame.cpuMs = _msSince(_frameBegin);
+    frame.drawCalls = _drawCalls - _frameDrawCalls;
+    frame.stateChanges = _stateChanges - _frameStateChanges;
+    _periodFrameMs.push_back(frame.cpuMs);
+    _allFrameMs.push_back(frame.cpuMs);
+    _frameIndex++;
+    if (_reportEvery > 0 && _frameIndex % _reportEvery == 0) {
+      report(std::cout);
+    }
+  }
+
+  // Print frame times and passes of frames since last report to `out`. GPU
+  // times are of frames read back by now.
+  void report(std::ostream &out) {
+    if (_periodFrameMs.empty()) {
+      return;
+    }
+    std::ios::fmtflags flags = out.flags();
+    out << "[Profiler] Frame " << _frameIndex - _periodFrameMs.size() << "-"
+        << _frameIndex - 1 << ": ";
+    _printPercentiles(out, _periodFrameMs);
+    if (_periodGpuCount > 0) {
+      out << ", GPU " << _periodGpuMs / _periodGpuCount << " ms avg";
+    }
+    out << std::endl
+        << "  " << std::left << std::setw(12) << "pass" << std::right
+        << std::setw(10) << "cpu ms" << std::setw(10) << "gpu ms"
+        << std::setw(8) << "draws" << std::setw(8) << "changes" << std::endl;
+    for (size_t i = 0; i < _periodPasses.size(); i++) {
+      const _PassTotal &total = _periodPasses[i];
+      if (total.count == 0) {
+        continue;
+      }
+      out << "  " << std::left << std::setw(12) << _passNames[i] << std::right
+          << std::setw(10) << total.cpuMs / total.count << std::setw(10);
+      if (total.gpuCount > 0) {
+        out << total.gpuMs / total.gpuCount;
+      } else {
+        out << "-";
+      }
+      out << std::setw(8) << total.drawCalls / total.count << std::setw(8)
+          << total.stateChanges / total.count << std::endl;
+    }
+    out.flags(flags);
+    _periodFrameMs.clear();
+    _periodPasses.clear();
+    _periodGpuMs = 0, _periodGpuCount = 0;
+  }
+
+  // Read back pending frames, close the log and print frame time
+  // percentiles of the whole run. Queries are deleted.
+  void finish() {
+    if (!_enabled) {
+      return;
+    }
+    for (long long i = 0; i < FramesInFlight; i++) {
+      _retire(_frames[(_frameIndex + i) % FramesInFlight], true);
+    }
+    for (auto &frame : _frames) {
+      if (_gpu && frame.frameQueries[0] != 0) {
+        glDeleteQueries(2, frame.frameQueries);
+        glDeleteQueries((GLsizei)frame.passQueries.size(),
+                        frame.passQueries.data());
+      }
+      frame = _Frame();
+    }
+    _csv.close();
+    if (!_allFrameMs.empty()) {
+      std::ios::fmtflags flags = std::cout.flags();
+      std::cout << "[Profiler] " << _allFrameMs.size() << " frames: ";
+      _printPercentiles(std::cout, _allFrameMs);
+      std::cout << std::endl;
+      std::cout.flags(flags);
+    }
+    _allFrameMs.clear(), _periodFrameMs.clear(), _periodPasses.clear();
+    _enabled = false;
+  }
+};
+
+} // namespace zx
+
+#endif
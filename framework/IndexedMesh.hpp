@@ -0,0 +1,229 @@
+#pragma once
+
+// Indexed mesh of ReNow Framework
+// by z0gSh1u (Zhuo Xu) @ https://github.com/z0gSh1u/seu-viz
+// See:
+// https://github.com/z0gSh1u/typed-webgl
+// https://github.com/z0gSh1u/renow-ts
+// https://github.com/z0gSh1u/renow-c
+
+#ifndef INDEXEDMESH_HPP_
+#define INDEXEDMESH_HPP_
+
+#include <glm/glm.hpp>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+#include "OBJProcessor.hpp"
+#include "Utils.hpp"
+
+using glm::vec3;
+using std::vector;
+
+namespace zx {
+
+// Interleaved vertex attributes.
+struct MeshVertex {
+  vec3 position;
+  vec3 normal;
+};
+
+// Triangle mesh whose vertices are shared through indices.
+struct IndexedMesh {
+  vector<MeshVertex> vertices;
+  vector<unsigned int> indices; // 3 per triangle
+  vec3 boundsMin = vec3(0), boundsMax = vec3(0); // axis-aligned
+};
+
+// Update bounds of `mesh` to enclose its vertices.
+void updateMeshBounds(IndexedMesh &mesh) {
+  if (mesh.vertices.empty()) {
+    return;
+  }
+  mesh.boundsMin = mesh.boundsMax = mesh.vertices[0].position;
+  for (const MeshVertex &vertex : mesh.vertices) {
+    mesh.boundsMin = glm::min(mesh.boundsMin, vertex.position);
+    mesh.boundsMax = glm::max(mesh.boundsMax, vertex.position);
+  }
+}
+
+// Build indexed mesh from faces of `proc`, sharing vertices of the same
+// position and normal indices. Normals are zero if the file has none.
+IndexedMesh buildIndexedMesh(const OBJProcessor &proc) {
+  IndexedMesh mesh;
+  const IVec3s &fs = proc.fs(), &fns = proc.fns();
+  bool hasNormal = fns.size() == fs.size();
+  std::unordered_map<unsigned long long, unsigned int> shared;
+  shared.reserve(fs.size() * 2);
+  mesh.indices.reserve(fs.size() * 3);
+
+  for (size_t i = 0; i < fs.size(); i++) {
+    for (int k = 0; k < 3; k++) {
+      int v = fs[i][k] - 1, vn = hasNormal ? fns[i][k] - 1 : -1;
+      unsigned long long key =
+          ((unsigned long long)(unsigned int)v << 32) | (unsigned int)(vn + 1);
+      auto it = shared.find(key);
+      if (it == shared.end()) {
+        MeshVertex vertex = {proc.vs().at(v),
+                             vn >= 0 ? proc.vns().at(vn) : vec3(0)};
+        it = shared.emplace(key, (unsigned int)mesh.vertices.size()).first;
+        mesh.vertices.push_back(vertex);
+      }
+      mesh.indices.push_back(it->second);
+    }
+  }
+  updateMeshBounds(mesh);
+  return mesh;
+}
+
+// Average # vertices transformed per triangle with a FIFO post-transform
+// cache of `cacheSize`, i.e. ACMR. 0.5 is ideal, 3 is no reuse at all.
+float vertexCacheMissRatio(const vector<unsigned int> &indices,
+                           size_t vertexCount, int cacheSize = 16) {
+  if (indices.empty()) {
+    return 0;
+  }
+  vector<long long> cachedAt(vertexCount, -cacheSize); // at which miss
+  long long misses = 0;
+  for (unsigned int index : indices) {
+    if (misses - cachedAt[index] >= cacheSize) {
+      cachedAt[index] = misses++;
+    }
+  }
+  return float(misses) / (indices.size() / 3);
+}
+
+// Reorder triangles for post-transform vertex cache locality, by the greedy
+// algorithm of Tom Forsyth (Linear-Speed Vertex Cache Optimisation), then
+// renumber vertices in order of first use for fetch locality.
+void optimizeVertexCache(IndexedMesh &mesh) {
+  const int CacheSize = 32;
+  const size_t nTri = mesh.indices.size() / 3, nVert = mesh.vertices.size();
+  const vector<unsigned int> &indices = mesh.indices;
+
+  // triangles of each vertex
+  vector<int> valence(nVert, 0), triOffset(nVert + 1, 0), triOfVert;
+  for (unsigned int index : indices) {
+    valence[index]++;
+  }
+  for (size_t v = 0; v < nVert; v++) {
+    triOffset[v + 1] = triOffset[v] + valence[v];
+  }
+  triOfVert.resize(indices.size());
+  vector<int> filled(nVert, 0);
+  for (size_t t = 0; t < nTri; t++) {
+    for (int k = 0; k < 3; k++) {
+      unsigned int v = indices[t * 3 + k];
+      triOfVert[triOffset[v] + filled[v]++] = (int)t;
+    }
+  }
+
+  // vertex score by cache position and # triangles left using it
+  auto vertexScore = [&](int cachePos, int remaining) -> float {
+    if (remaining == 0) {
+      return -1;
+    }
+    float score = 0;
+    if (cachePos >= 0) {
+      // the last triangle's vertices are scored equally
+      score = cachePos < 3 ? 0.75f
+                           : std::pow(1 - float(cachePos - 3) / (CacheSize - 3),
+                                      1.5f);
+    }
+    return score + 2.0f / std::sqrt((float)remaining);
+  };
+  vector<int> remaining(valence);
+  vector<float> vScore(nVert), tScore(nTri, 0);
+  vector<bool> emitted(nTri, false);
+  for (size_t v = 0; v < nVert; v++) {
+    vScore[v] = vertexScore(-1, remaining[v]);
+  }
+  for (size_t t = 0; t < nTri; t++) {
+    for (int k = 0; k < 3; k++) {
+      tScore[t] += vScore[indices[t * 3 + k]];
+    }
+  }
+
+  vector<unsigned int> ordered;
+  ordered.reserve(indices.size());
+  vector<int> cache, nextCache;
+  size_t scanFrom = 0; // all triangles before are emitted
+  int best = -1;
+  for (size_t emittedCount = 0; emittedCount < nTri; emittedCount++) {
+    if (best < 0) {
+      // nothing in cache is useful, take the best of the rest
+      while (emitted[scanFrom]) {
+        scanFrom++;
+      }
+      best = (int)scanFrom;
+      for (size_t t = scanFrom; t < nTri; t++) {
+        if (!emitted[t] && tScore[t] > tScore[best]) {
+          best = (int)t;
+        }
+      }
+    }
+    // emit it, and put its vertices to the front of cache
+    emitted[best] = true;
+    nextCache.clear();
+    for (int k = 0; k < 3; k++) {
+      unsigned int v = indices[best * 3 + k];
+      ordered.push_back(v);
+      nextCache.push_back((int)v);
+      remaining[v]--;
+      // swap-remove this triangle from the vertex's list
+      int *tris = &triOfVert[triOffset[v]];
+      for (int j = 0; j <= remaining[v]; j++) {
+        if (tris[j] == best) {
+          std::swap(tris[j], tris[remaining[v]]);
+          break;
+        }
+      }
+    }
+    for (int v : cache) {
+      if (std::find(nextCache.begin(), nextCache.end(), v) ==
+          nextCache.end()) {
+        nextCache.push_back(v);
+      }
+    }
+    // rescore vertices in cache or pushed out of it, then their triangles
+    for (size_t i = 0; i < nextCache.size(); i++) {
+      vScore[nextCache[i]] = vertexScore(i < CacheSize ? (int)i : -1,
+                                         remaining[nextCache[i]]);
+    }
+    best = -1;
+    for (size_t i = 0; i < nextCache.size(); i++) {
+      int v = nextCache[i];
+      for (int j = 0; j < remaining[v]; j++) {
+        int t = triOfVert[triOffset[v] + j];
+        tScore[t] = vScore[indices[t * 3]] + vScore[indices[t * 3 + 1]] +
+                    vScore[indices[t * 3 + 2]];
+        // only triangles in cache are candidates
+        if (i < CacheSize && (best < 0 || tScore[t] > tScore[best])) {
+          best = t;
+        }
+      }
+    }
+    nextCache.resize(std::min(nextCache.size(), (size_t)CacheSize));
+    std::swap(cache, nextCache);
+  }
+
+  // renumber vertices in order of first use
+  vector<int> newIndex(nVert, -1);
+  vector<MeshVertex> vertices;
+  vertices.reserve(nVert);
+  for (unsigned int &index : ordered) {
+    if (newIndex[index] < 0) {
+      newIndex[index] = (int)vertices.size();
+      vertices.push_back(mesh.vertices[index]);
+    }
+    index = newIndex[index];
+  }
+  mesh.vertices.swap(vertices);
+  mesh.indices.swap(ordered);
+}
+
+} // namespace zx
+
+#endif
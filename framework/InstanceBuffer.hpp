@@ -0,0 +1,145 @@
+#pragma once
+
+// Instance buffer of ReNow Framework
+// by z0gSh1u (Zhuo Xu) @ https://github.com/z0gSh1u/seu-viz
+// See:
+// https://github.com/z0gSh1u/typed-webgl
+// https://github.com/z0gSh1u/renow-ts
+// https://github.com/z0gSh1u/renow-c
+
+#ifndef INSTANCEBUFFER_HPP_
+#define INSTANCEBUFFER_HPP_
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#include "Utils.hpp"
+
+using glm::mat4;
+using glm::vec4;
+using std::vector;
+
+namespace zx {
+
+// Per-instance attributes, interleaved.
+struct InstanceData {
+  mat4 model;
+  vec4 color;
+};
+
+// Instances of a mesh drawn by one instanced draw call. Changed instances
+// are marked dirty and only they are uploaded.
+class InstanceBuffer {
+private:
+  // dirty runs closer than this are uploaded as one
+  static const size_t MergeGap = 16;
+
+  vector<InstanceData> _instances;
+  vector<bool> _dirty;
+  size_t _dirtyBegin = 0, _dirtyEnd = 0; // bounds of dirty instances
+  size_t _capacity = 0;                  // # instances allocated on GPU
+
+  void _markDirty(size_t i) {
+    _dirty[i] = true;
+    if (_dirtyBegin == _dirtyEnd) {
+      _dirtyBegin = i, _dirtyEnd = i + 1;
+    } else {
+      _dirtyBegin = std::min(_dirtyBegin, i);
+      _dirtyEnd = std::max(_dirtyEnd, i + 1);
+    }
+  }
+
+  void _subData(size_t begin, size_t end) {
+    glBufferSubData(GL_ARRAY_BUFFER,
+                    (GLintptr)(begin * sizeof(InstanceData)),
+                    (GLsizeiptr)((end - begin) * sizeof(InstanceData)),
+                    &_instances[begin]);
+  }
+
+public:
+  // Add an instance, returns its index.
+  size_t add(const mat4 &model, const vec4 &color) {
+    _instances.push_back({model, color});
+    _dirty.push_back(false);
+    _markDirty(_instances.size() - 1);
+    return _instances.size() - 1;
+  }
+
+  // Set instance `i`, and only mark it dirty if it changes.
+  void set(size_t i, const mat4 &model, const vec4 &color) {
+    InstanceData &instance = _instances.at(i);
+    if (std::memcmp(&instance.model, &model, sizeof(mat4)) != 0 ||
+        std::memcmp(&instance.color, &color, sizeof(vec4)) != 0) {
+      instance = {model, color};
+      _markDirty(i);
+    }
+  }
+  void setModel(size_t i, const mat4 &model) {
+    _instances.at(i).model = model;
+    _markDirty(i);
+  }
+  void setColor(size_t i, const vec4 &color) {
+    _instances.at(i).color = color;
+    _markDirty(i);
+  }
+
+  // Keep first `n` instances, or add identity ones up to `n`.
+  void resize(size_t n) {
+    while (_instances.size() < n) {
+      add(mat4(1), vec4(1));
+    }
+    _instances.resize(n), _dirty.resize(n);
+    _dirtyBegin = std::min(_dirtyBegin, n), _dirtyEnd = std::min(_dirtyEnd, n);
+    if (_dirtyBegin == _dirtyEnd) {
+      _dirtyBegin = _dirtyEnd = 0;
+    }
+  }
+
+  // Remove all instances.
+  void clear() { resize(0); }
+
+  size_t size() const { return _instances.size(); }
+  bool dirty() const { return _dirtyBegin != _dirtyEnd; }
+  const InstanceData &operator[](size_t i) const { return _instances[i]; }
+
+  // Upload dirty instances to the bound GL_ARRAY_BUFFER, reallocating it
+  // with room to grow if instances outnumber it.
+  void upload() {
+    if (_instances.size() > _capacity) {
+      _capacity = std::max(_instances.size(), _capacity * 2);
+      glBufferData(GL_ARRAY_BUFFER,
+                   (GLsizeiptr)(_capacity * sizeof(InstanceData)), NULL,
+                   GL_DYNAMIC_DRAW);
+      _subData(0, _instances.size());
+      std::fill(_dirty.begin(), _dirty.end(), false);
+      _dirtyBegin = _dirtyEnd = 0;
+      return;
+    }
+    size_t runBegin = _dirtyEnd, runEnd = _dirtyEnd;
+    for (size_t i = _dirtyBegin; i < _dirtyEnd; i++) {
+      if (!_dirty[i]) {
+        continue;
+      }
+      _dirty[i] = false;
+      if (runBegin != _dirtyEnd && i - runEnd >= MergeGap) {
+        _subData(runBegin, runEnd);
+        runBegin = _dirtyEnd;
+      }
+      if (runBegin == _dirtyEnd) {
+        runBegin = i;
+      }
+      runEnd = i + 1;
+    }
+    if (runBegin != _dirtyEnd) {
+      _subData(runBegin, runEnd);
+    }
+    _dirtyBegin = _dirtyEnd = 0;
+  }
+};
+
+} // namespace zx
+
+#endif
@@ -0,0 +1,105 @@
+#pragma once
+
+// Memory-mapped file of ReNow Framework
+// by z0gSh1u (Zhuo Xu) @ https://github.com/z0gSh1u/seu-viz
+// See:
+// https://github.com/z0gSh1u/typed-webgl
+// https://github.com/z0gSh1u/renow-ts
+// https://github.com/z0gSh1u/renow-c
+
+#ifndef MAPPEDFILE_HPP_
+#define MAPPEDFILE_HPP_
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <string>
+
+#include "Utils.hpp"
+
+using std::string;
+
+namespace zx {
+
+// Read-only view of a whole file, paged in on access.
+class MappedFile {
+private:
+  const char *_data = nullptr;
+  size_t _size = 0;
+#ifdef _WIN32
+  HANDLE _file = INVALID_HANDLE_VALUE, _mapping = NULL;
+#endif
+
+public:
+  MappedFile(const string &path) {
+#ifdef _WIN32
+    _file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                        OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    ASSERT(_file != INVALID_HANDLE_VALUE, "Cannot open file: " + path);
+    LARGE_INTEGER size;
+    GetFileSizeEx(_file, &size);
+    _size = (size_t)size.QuadPart;
+    if (_size > 0) {
+      _mapping = CreateFileMappingA(_file, NULL, PAGE_READONLY, 0, 0, NULL);
+      ASSERT(_mapping != NULL, "Cannot map file: " + path);
+      _data = (const char *)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+      ASSERT(_data != nullptr, "Cannot map file: " + path);
+    }
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    ASSERT(fd >= 0, "Cannot open file: " + path);
+    struct stat info;
+    fstat(fd, &info);
+    _size = (size_t)info.st_size;
+    if (_size > 0) {
+      void *p = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      ASSERT(p != MAP_FAILED, "Cannot map file: " + path);
+      _data = (const char *)p;
+      madvise(p, _size, MADV_SEQUENTIAL);
+    } else {
+      close(fd);
+    }
+#endif
+  }
+
+  ~MappedFile() {
+#ifdef _WIN32
+    if (_data != nullptr) {
+      UnmapViewOfFile(_data);
+    }
+    if (_mapping != NULL) {
+      CloseHandle(_mapping);
+    }
+    if (_file != INVALID_HANDLE_VALUE) {
+      CloseHandle(_file);
+    }
+#else
+    if (_data != nullptr) {
+      munmap((void *)_data, _size);
+    }
+#endif
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *data() const { return _data; }
+  size_t size() const { return _size; }
+};
+
+} // namespace zx
+
+#endif
@@ -0,0 +1,268 @@
+#pragma once
+
+// Binary mesh cache of ReNow Framework
+// by z0gSh1u (Zhuo Xu) @ https://github.com/z0gSh1u/seu-viz
+// See:
+// https://github.com/z0gSh1u/typed-webgl
+// https://github.com/z0gSh1u/renow-ts
+// https://github.com/z0gSh1u/renow-c
+
+#ifndef MESHCACHE_HPP_
+#define MESHCACHE_HPP_
+
+#include <glm/glm.hpp>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <functional>
+
+#include "Utils.hpp"
+#include "MappedFile.hpp"
+#include "OBJProcessor.hpp"
+#include "IndexedMesh.hpp"
+#include "MeshSimplify.hpp"
+
+using glm::vec3;
+using std::string;
+using std::vector;
+
+// "RNMC" in file
+#define MESH_CACHE_MAGIC 0x434D4E52
+// bump when layout of the cache file or MeshVertex changes
+#define MESH_CACHE_VERSION 2
+
+namespace zx {
+
+// How a cached mesh is built from its .obj. A cache file built otherwise is
+// built again.
+struct MeshBuildParams {
+  string tag;                             // e.g. names the build and options
+  float lodRatio = 0;                     // of a level of detail, else 0
+  unsigned long long targetTriangles = 0; // of a level of detail, else 0
+};
+
+// Header of a mesh cache file, followed by vertices and then indices.
+struct _MeshCacheHeader {
+  unsigned int magic, version;
+  long long sourceMtime, sourceSize; // of the .obj built from
+  unsigned long long vertexCount, indexCount;
+  float boundsMin[3], boundsMax[3];
+  unsigned int vertexSize; // sizeof(MeshVertex) when written
+  float lodRatio;          // MeshBuildParams
+  unsigned long long targetTriangles, buildTag; // buildTag hashes the tag
+};
+
+// 64-bit FNV-1a of `s`.
+unsigned long long _meshBuildTagHash(const string &s) {
+  unsigned long long hash = 14695981039346656037ULL;
+  for (unsigned char c : s) {
+    hash = (hash ^ c) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+// GPU-ready mesh, either mapped from its cache file or just built.
+class CachedMesh {
+private:
+  IndexedMesh _mesh;                  // if built
+  std::unique_ptr<MappedFile> _file;  // if mapped
+  const _MeshCacheHeader *_header = nullptr;
+
+public:
+  CachedMesh(IndexedMesh &&mesh) : _mesh(std::move(mesh)) {}
+  CachedMesh(std::unique_ptr<MappedFile> &&file) : _file(std::move(file)) {
+    _header = (const _MeshCacheHeader *)_file->data();
+  }
+
+  bool mapped() const { return _file != nullptr; }
+  size_t vertexCount() const {
+    return mapped() ? (size_t)_header->vertexCount : _mesh.vertices.size();
+  }
+  size_t indexCount() const {
+    return mapped() ? (size_t)_header->indexCount : _mesh.indices.size();
+  }
+  const MeshVertex *vertices() const {
+    return mapped() ? (const MeshVertex *)(_header + 1)
+                    : _mesh.vertices.data();
+  }
+  const unsigned int *indices() const {
+    return mapped() ? (const unsigned int *)(vertices() + vertexCount())
+                    : _mesh.indices.data();
+  }
+  vec3 boundsMin() const {
+    return mapped() ? vec3(_header->boundsMin[0], _header->boundsMin[1],
+                           _header->boundsMin[2])
+                    : _mesh.boundsMin;
+  }
+  vec3 boundsMax() const {
+    return mapped() ? vec3(_header->boundsMax[0], _header->boundsMax[1],
+                           _header->boundsMax[2])
+                    : _mesh.boundsMax;
+  }
+
+  // Copy out as IndexedMesh, e.g. to derive others from.
+  IndexedMesh toIndexedMesh() const {
+    if (!mapped()) {
+      return _mesh;
+    }
+    IndexedMesh mesh;
+    mesh.vertices.assign(vertices(), vertices() + vertexCount());
+    mesh.indices.assign(indices(), indices() + indexCount());
+    mesh.boundsMin = boundsMin(), mesh.boundsMax = boundsMax();
+    return mesh;
+  }
+};
+
+// Modification time and size of the file, or false if not available.
+bool _sourceStamp(const string &path, long long &mtime, long long &size) {
+  struct stat info;
+  if (stat(path.c_str(), &info) != 0) {
+    return false;
+  }
+  mtime = (long long)info.st_mtime, size = (long long)info.st_size;
+  return true;
+}
+
+// Map the cache file at `cachePath` if it is complete and built from the
+// current `objPath` with `params`.
+std::unique_ptr<MappedFile> _mapMeshCache(const string &objPath,
+                                          const string &cachePath,
+                                          const MeshBuildParams &params) {
+  long long mtime, size;
+  struct stat info;
+  if (!_sourceStamp(objPath, mtime, size) ||
+      stat(cachePath.c_str(), &info) != 0 ||
+      (size_t)info.st_size < sizeof(_MeshCacheHeader)) {
+    return nullptr;
+  }
+  std::unique_ptr<MappedFile> file(new MappedFile(cachePath));
+  const _MeshCacheHeader &header = *(const _MeshCacheHeader *)file->data();
+  if (header.magic != MESH_CACHE_MAGIC ||
+      header.version != MESH_CACHE_VERSION ||
+      header.vertexSize != sizeof(MeshVertex) ||
+      header.sourceMtime != mtime || header.sourceSize != size ||
+      header.lodRatio != params.lodRatio ||
+      header.targetTriangles != params.targetTriangles ||
+      header.buildTag != _meshBuildTagHash(params.tag) ||
+      file->size() != sizeof(_MeshCacheHeader) +
+                          header.vertexCount * sizeof(MeshVertex) +
+                          header.indexCount * sizeof(unsigned int)) {
+    return nullptr;
+  }
+  return file;
+}
+
+// Write `mesh` built from `objPath` with `params` to `cachePath`. Returns
+// false on failure.
+bool writeMeshCache(const IndexedMesh &mesh, const string &objPath,
+                    const string &cachePath,
+                    const MeshBuildParams &params = MeshBuildParams()) {
+  _MeshCacheHeader header = {};
+  header.magic = MESH_CACHE_MAGIC, header.version = MESH_CACHE_VERSION;
+  if (!_sourceStamp(objPath, header.sourceMtime, header.sourceSize)) {
+    return false;
+  }
+  header.vertexCount = mesh.vertices.size();
+  header.indexCount = mesh.indices.size();
+  for (int i = 0; i < 3; i++) {
+    header.boundsMin[i] = mesh.boundsMin[i];
+    header.boundsMax[i] = mesh.boundsMax[i];
+  }
+  header.vertexSize = sizeof(MeshVertex);
+  header.lodRatio = params.lodRatio;
+  header.targetTriangles = params.targetTriangles;
+  header.buildTag = _meshBuildTagHash(params.tag);
+
+  // write aside then rename, so that no reader sees a partial file
+  string tempPath = cachePath + ".tmp";
+  {
+    std::ofstream file(tempPath, ios::binary | ios::trunc);
+    file.write((const char *)&header, sizeof(header));
+    file.write((const char *)mesh.vertices.data(),
+               mesh.vertices.size() * sizeof(MeshVertex));
+    file.write((const char *)mesh.indices.data(),
+               mesh.indices.size() * sizeof(unsigned int));
+    if (!file.good()) {
+      file.close();
+      std::remove(tempPath.c_str());
+      return false;
+    }
+  }
+  std::remove(cachePath.c_str());
+  return std::rename(tempPath.c_str(), cachePath.c_str()) == 0;
+}
+
+// Load mesh derived from `objPath` with `params` from `cachePath`, or `build`
+// the mesh to be cached there.
+CachedMesh loadCachedMesh(const string &objPath,
+                          const std::function<IndexedMesh()> &build,
+                          const string &cachePath,
+                          const MeshBuildParams &params) {
+  std::unique_ptr<MappedFile> file = _mapMeshCache(objPath, cachePath, params);
+  if (file != nullptr) {
+    return CachedMesh(std::move(file));
+  }
+  IndexedMesh mesh = build();
+  if (!writeMeshCache(mesh, objPath, cachePath, params)) {
+    std::cout << "[MeshCache] Cannot write " << cachePath << std::endl;
+  }
+  return CachedMesh(std::move(mesh));
+}
+
+// Load mesh of `objPath` from its cache file (`objPath` + ".rnmesh" if
+// `cachePath` is empty), or parse it and `build` the mesh to be cached.
+// `buildTag` tells builds apart, so that a cache file of another one is not
+// used.
+CachedMesh loadCachedMesh(
+    const string &objPath,
+    const std::function<IndexedMesh(const OBJProcessor &)> &build,
+    const string &cachePath = "", const string &buildTag = "") {
+  MeshBuildParams params;
+  params.tag = buildTag;
+  return loadCachedMesh(
+      objPath,
+      std::function<IndexedMesh()>(
+          [&]() { return build(OBJProcessor::fromFile(objPath)); }),
+      cachePath.empty() ? objPath + ".rnmesh" : cachePath, params);
+}
+
+// Load up to `levels` levels of detail of `objPath`, level 0 loaded as by
+// loadCachedMesh with `build` and `buildTag`. Coarser ones are cached as
+// `objPath` + ".lod<i>.rnmesh", and built again if `ratio` or their size
+// changes.
+vector<CachedMesh> loadCachedMeshLODs(
+    const string &objPath,
+    const std::function<IndexedMesh(const OBJProcessor &)> &build, int levels,
+    float ratio = 0.25f, const string &buildTag = "") {
+  vector<CachedMesh> lods;
+  lods.reserve(levels);
+  lods.push_back(loadCachedMesh(objPath, build, "", buildTag));
+  for (int i = 1; i < levels; i++) {
+    size_t target = lodTargetTriangles(lods.back().indexCount() / 3, ratio);
+    if (target == 0) {
+      break;
+    }
+    const CachedMesh &finer = lods.back();
+    MeshBuildParams params;
+    params.tag = buildTag + ";simplify=" +
+                 std::to_string(MESH_SIMPLIFY_VERSION);
+    params.lodRatio = ratio;
+    params.targetTriangles = target;
+    lods.push_back(loadCachedMesh(
+        objPath,
+        std::function<IndexedMesh()>([&]() {
+          return buildNextLOD(finer.toIndexedMesh(), target);
+        }),
+        objPath + ".lod" + std::to_string(i) + ".rnmesh", params));
+  }
+  return lods;
+}
+
+} // namespace zx
+
+#endif
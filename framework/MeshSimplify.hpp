@@ -0,0 +1,385 @@
+#pragma once
+
+// Mesh simplification of ReNow Framework
+// by z0gSh1u (Zhuo Xu) @ https://github.com/z0gSh1u/seu-viz
+// See:
+// https://github.com/z0gSh1u/typed-webgl
+// https://github.com/z0gSh1u/renow-ts
+// https://github.com/z0gSh1u/renow-c
+
+#ifndef MESHSIMPLIFY_HPP_
+#define MESHSIMPLIFY_HPP_
+
+#include <glm/glm.hpp>
+#include <cmath>
+#include <queue>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+
+#include "Utils.hpp"
+#include "IndexedMesh.hpp"
+
+using glm::vec3;
+using std::vector;
+
+// bump when simplification changes its output, so that cached levels of
+// detail are rebuilt
+#define MESH_SIMPLIFY_VERSION 1
+
+namespace zx {
+
+// Error quadric of Garland & Heckbert, symmetric 4x4 kept as upper triangle:
+// a00 a01 a02 a03 a11 a12 a13 a22 a23 a33.
+struct _Quadric {
+  double a[10] = {};
+
+  // Add squared distance to plane n.p + d = 0 (n normalized), by `weight`.
+  void addPlane(const vec3 &n, double d, double weight) {
+    double p[4] = {n.x, n.y, n.z, d};
+    int k = 0;
+    for (int i = 0; i < 4; i++) {
+      for (int j = i; j < 4; j++) {
+        a[k++] += weight * p[i] * p[j];
+      }
+    }
+  }
+  _Quadric &operator+=(const _Quadric &other) {
+    for (int i = 0; i < 10; i++) {
+      a[i] += other.a[i];
+    }
+    return *this;
+  }
+  double error(const vec3 &v) const {
+    double x = v.x, y = v.y, z = v.z;
+    return a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z +
+           2 * a[3] * x + a[4] * y * y + 2 * a[5] * y * z + 2 * a[6] * y +
+           a[7] * z * z + 2 * a[8] * z + a[9];
+  }
+  // Position of least error, or false if it is ill-defined.
+  bool optimum(vec3 &v) const {
+    // solve [a00 a01 a02; a01 a11 a12; a02 a12 a22] v = -[a03 a13 a23]
+    double m00 = a[0], m01 = a[1], m02 = a[2], m11 = a[4], m12 = a[5],
+           m22 = a[7], b0 = -a[3], b1 = -a[6], b2 = -a[8];
+    double c00 = m11 * m22 - m12 * m12, c01 = m02 * m12 - m01 * m22,
+           c02 = m01 * m12 - m02 * m11;
+    double det = m00 * c00 + m01 * c01 + m02 * c02;
+    if (std::abs(det) < 1e-12) {
+      return false;
+    }
+    double c11 = m00 * m22 - m02 * m02, c12 = m01 * m02 - m00 * m12,
+           c22 = m00 * m11 - m01 * m01;
+    v = vec3(float((c00 * b0 + c01 * b1 + c02 * b2) / det),
+             float((c01 * b0 + c11 * b1 + c12 * b2) / det),
+             float((c02 * b0 + c12 * b1 + c22 * b2) / det));
+    return true;
+  }
+};
+
+// Simplify `mesh` to about `targetTriangles` triangles by collapsing the
+// edges of least quadric error one by one. Vertices of the same position
+// are collapsed together so that normal seams do not open; collapses that
+// flip a triangle are rejected, and boundaries are kept in place. Each
+// corner keeps the normal it had.
+IndexedMesh simplifyMesh(const IndexedMesh &mesh, size_t targetTriangles) {
+  const size_t nTri = mesh.indices.size() / 3;
+  if (nTri <= targetTriangles) {
+    return mesh;
+  }
+  const double BoundaryWeight = 100;
+  const float CreaseCos = 0.5f; // of faces sharing smooth normals
+
+  // weld vertices of the same position
+  struct PositionHash {
+    size_t operator()(const vec3 &p) const {
+      unsigned int bits[3];
+      std::memcpy(bits, &p[0], sizeof(bits));
+      return ((size_t)bits[0] * 73856093) ^ ((size_t)bits[1] * 19349663) ^
+             ((size_t)bits[2] * 83492791);
+    }
+  };
+  struct PositionEqual {
+    bool operator()(const vec3 &p, const vec3 &q) const {
+      return p.x == q.x && p.y == q.y && p.z == q.z;
+    }
+  };
+  std::unordered_map<vec3, int, PositionHash, PositionEqual> welded;
+  vector<int> weldOf(mesh.vertices.size());
+  vector<vec3> pos;
+  for (size_t i = 0; i < mesh.vertices.size(); i++) {
+    auto it = welded.emplace(mesh.vertices[i].position, (int)pos.size());
+    if (it.second) {
+      pos.push_back(mesh.vertices[i].position);
+    }
+    weldOf[i] = it.first->second;
+  }
+  const size_t nPos = pos.size();
+
+  // triangles on welded vertices, and their planes
+  vector<int> tri(nTri * 3);
+  vector<bool> removed(nTri, false);
+  vector<_Quadric> quadric(nPos);
+  vector<vector<int>> trisOf(nPos);
+  size_t live = 0;
+  auto triNormal = [&](const vec3 &a, const vec3 &b, const vec3 &c) {
+    return glm::cross(b - a, c - a);
+  };
+  for (size_t t = 0; t < nTri; t++) {
+    for (int k = 0; k < 3; k++) {
+      tri[t * 3 + k] = weldOf[mesh.indices[t * 3 + k]];
+    }
+    int *v = &tri[t * 3];
+    if (v[0] == v[1] || v[1] == v[2] || v[0] == v[2]) {
+      removed[t] = true;
+      continue;
+    }
+    live++;
+    vec3 n = triNormal(pos[v[0]], pos[v[1]], pos[v[2]]);
+    float area2 = glm::length(n);
+    if (area2 > 0) {
+      n /= area2;
+    }
+    for (int k = 0; k < 3; k++) {
+      quadric[v[k]].addPlane(n, -glm::dot(n, pos[v[0]]), area2 * 0.5);
+      trisOf[v[k]].push_back((int)t);
+    }
+  }
+
+  // keep boundaries by planes through boundary edges, normal to the face
+  std::unordered_map<unsigned long long, int> edgeUse;
+  auto edgeKey = [](int a, int b) {
+    return ((unsigned long long)(unsigned int)std::min(a, b) << 32) |
+           (unsigned int)std::max(a, b);
+  };
+  for (size_t t = 0; t < nTri; t++) {
+    for (int k = 0; !removed[t] && k < 3; k++) {
+      edgeUse[edgeKey(tri[t * 3 + k], tri[t * 3 + (k + 1) % 3])]++;
+    }
+  }
+  for (size_t t = 0; t < nTri; t++) {
+    for (int k = 0; !removed[t] && k < 3; k++) {
+      int a = tri[t * 3 + k], b = tri[t * 3 + (k + 1) % 3],
+          c = tri[t * 3 + (k + 2) % 3];
+      if (edgeUse[edgeKey(a, b)] != 1) {
+        continue;
+      }
+      vec3 edge = pos[b] - pos[a],
+           n = glm::cross(edge, triNormal(pos[a], pos[b], pos[c]));
+      float len = glm::length(n);
+      if (len > 0) {
+        n /= len;
+        double weight = BoundaryWeight * glm::dot(edge, edge);
+        quadric[a].addPlane(n, -glm::dot(n, pos[a]), weight);
+        quadric[b].addPlane(n, -glm::dot(n, pos[a]), weight);
+      }
+    }
+  }
+
+  // candidate collapses, invalid once either end has changed
+  struct Collapse {
+    double cost;
+    int u, v;
+    unsigned int versionU, versionV;
+    vec3 target;
+    bool operator<(const Collapse &other) const { return cost > other.cost; }
+  };
+  vector<unsigned int> version(nPos, 0);
+  vector<bool> alive(nPos, true);
+  std::priority_queue<Collapse> heap;
+  auto pushCollapse = [&](int u, int v) {
+    _Quadric q = quadric[u];
+    q += quadric[v];
+    vec3 candidates[4] = {pos[u], pos[v], (pos[u] + pos[v]) * 0.5f, vec3(0)};
+    int nCandidate = q.optimum(candidates[3]) ? 4 : 3;
+    Collapse c = {0, u, v, version[u], version[v], candidates[0]};
+    c.cost = q.error(candidates[0]);
+    for (int i = 1; i < nCandidate; i++) {
+      double cost = q.error(candidates[i]);
+      if (cost < c.cost) {
+        c.cost = cost, c.target = candidates[i];
+      }
+    }
+    heap.push(c);
+  };
+  for (size_t t = 0; t < nTri; t++) {
+    for (int k = 0; !removed[t] && k < 3; k++) {
+      int a = tri[t * 3 + k], b = tri[t * 3 + (k + 1) % 3];
+      if (a < b || edgeUse[edgeKey(a, b)] == 1) {
+        pushCollapse(a, b);
+      }
+    }
+  }
+
+  // whether moving `from` (and `other`) to `target` flips a triangle
+  auto flips = [&](int from, int other, const vec3 &target) {
+    for (int t : trisOf[from]) {
+      const int *v = &tri[t * 3];
+      if (removed[t] || v[0] == other || v[1] == other || v[2] == other) {
+        continue; // collapsed away
+      }
+      vec3 p[3], q[3];
+      for (int k = 0; k < 3; k++) {
+        p[k] = pos[v[k]], q[k] = v[k] == from ? target : pos[v[k]];
+      }
+      vec3 before = triNormal(p[0], p[1], p[2]),
+           after = triNormal(q[0], q[1], q[2]);
+      if (glm::dot(before, after) <= 0) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  vector<int> neighbors;
+  while (live > targetTriangles && !heap.empty()) {
+    Collapse c = heap.top();
+    heap.pop();
+    int u = c.u, v = c.v;
+    if (!alive[u] || !alive[v] || version[u] != c.versionU ||
+        version[v] != c.versionV) {
+      continue;
+    }
+    if (flips(u, v, c.target) || flips(v, u, c.target)) {
+      continue;
+    }
+    // collapse v into u
+    pos[u] = c.target;
+    quadric[u] += quadric[v];
+    alive[v] = false;
+    version[u]++;
+    for (int t : trisOf[v]) {
+      if (removed[t]) {
+        continue;
+      }
+      int *w = &tri[t * 3];
+      for (int k = 0; k < 3; k++) {
+        w[k] = w[k] == v ? u : w[k];
+      }
+      if (w[0] == w[1] || w[1] == w[2] || w[0] == w[2]) {
+        removed[t] = true;
+        live--;
+      } else {
+        trisOf[u].push_back(t);
+      }
+    }
+    trisOf[v].clear();
+    // drop gone triangles of u, and requeue its edges
+    vector<int> &ts = trisOf[u];
+    ts.erase(std::remove_if(ts.begin(), ts.end(),
+                            [&](int t) { return removed[t]; }),
+             ts.end());
+    std::sort(ts.begin(), ts.end());
+    ts.erase(std::unique(ts.begin(), ts.end()), ts.end());
+    neighbors.clear();
+    for (int t : ts) {
+      for (int k = 0; k < 3; k++) {
+        if (tri[t * 3 + k] != u) {
+          neighbors.push_back(tri[t * 3 + k]);
+        }
+      }
+    }
+    std::sort(neighbors.begin(), neighbors.end());
+    neighbors.erase(std::unique(neighbors.begin(), neighbors.end()),
+                    neighbors.end());
+    for (int w : neighbors) {
+      pushCollapse(u, w);
+    }
+  }
+
+  // rebuild, sharing vertices of the same position and normal
+  IndexedMesh res;
+  struct CornerHash {
+    size_t operator()(const std::pair<int, vec3> &c) const {
+      return PositionHash()(c.second) * 31 + (size_t)c.first;
+    }
+  };
+  struct CornerEqual {
+    bool operator()(const std::pair<int, vec3> &c,
+                    const std::pair<int, vec3> &d) const {
+      return c.first == d.first && PositionEqual()(c.second, d.second);
+    }
+  };
+  std::unordered_map<std::pair<int, vec3>, unsigned int, CornerHash,
+                     CornerEqual>
+      shared;
+  res.indices.reserve(live * 3);
+  vector<vec3> faceNormal(nTri, vec3(0)); // not normalized, area weighted
+  for (size_t t = 0; t < nTri; t++) {
+    if (!removed[t]) {
+      faceNormal[t] = triNormal(pos[tri[t * 3]], pos[tri[t * 3 + 1]],
+                                pos[tri[t * 3 + 2]]);
+    }
+  }
+  for (size_t t = 0; t < nTri; t++) {
+    vec3 n = removed[t] ? vec3(0) : glm::normalize(faceNormal[t]);
+    const MeshVertex *corners[3];
+    for (int k = 0; k < 3; k++) {
+      corners[k] = &mesh.vertices[mesh.indices[t * 3 + k]];
+    }
+    // flat shaded if all corners are given the same normal
+    bool flat = PositionEqual()(corners[0]->normal, corners[1]->normal) &&
+                PositionEqual()(corners[1]->normal, corners[2]->normal);
+    for (int k = 0; !removed[t] && k < 3; k++) {
+      int p = tri[t * 3 + k];
+      vec3 normal = corners[k]->normal;
+      if (glm::dot(normal, normal) == 0) {
+        // none given
+      } else if (flat) {
+        normal = n;
+      } else {
+        // smooth shaded, over faces around within the crease angle
+        normal = vec3(0);
+        for (int other : trisOf[p]) {
+          if (!removed[other] &&
+              glm::dot(glm::normalize(faceNormal[other]), n) > CreaseCos) {
+            normal += faceNormal[other];
+          }
+        }
+        normal = glm::normalize(normal);
+      }
+      auto it = shared.emplace(std::make_pair(p, normal),
+                               (unsigned int)res.vertices.size());
+      if (it.second) {
+        res.vertices.push_back({pos[p], normal});
+      }
+      res.indices.push_back(it.first->second);
+    }
+  }
+  updateMeshBounds(res);
+  return res;
+}
+
+// # triangles of the next level of detail of a mesh of `triangles`, reduced
+// to `ratio`, or 0 if it is too coarse to be worth one.
+size_t lodTargetTriangles(size_t triangles, float ratio = 0.25f) {
+  const size_t MinTriangles = 32;
+  size_t target = size_t(triangles * ratio);
+  return target < MinTriangles ? 0 : target;
+}
+
+// Next level of detail of `finer`, of `targetTriangles`.
+IndexedMesh buildNextLOD(const IndexedMesh &finer, size_t targetTriangles) {
+  IndexedMesh coarser = simplifyMesh(finer, targetTriangles);
+  optimizeVertexCache(coarser);
+  return coarser;
+}
+
+// Up to `levels` levels of detail of `mesh`, level 0 being itself and each
+// next one simplified from the previous to `ratio` of its triangles.
+vector<IndexedMesh> buildMeshLODs(const IndexedMesh &mesh, int levels,
+                                  float ratio = 0.25f) {
+  vector<IndexedMesh> lods = {mesh};
+  for (int i = 1; i < levels; i++) {
+    size_t target = lodTargetTriangles(lods.back().indices.size() / 3, ratio);
+    if (target == 0) {
+      break;
+    }
+    lods.push_back(buildNextLOD(lods.back(), target));
+  }
+  return lods;
+}
+
+} // namespace zx
+
+#endif
@@ -11,121 +11,282 @@
 #define OBJPROCESSOR_HPP_
 
 #include <glm/glm.hpp>
-#include <regex>
+#include <charconv>
 #include <string>
+#include <thread>
 #include <vector>
+#include <algorithm>
 
 #include "Utils.hpp"
+#include "MappedFile.hpp"
 
 using glm::vec2;
 using glm::vec3;
-using std::regex;
 using std::string;
 using std::vector;
 
 namespace zx {
 
-// .obj File Processor
+// .obj File Processor. Lines are parsed in place, by several threads over
+// line-aligned chunks of the file. Faces of more than 3 vertices are split
+// into triangle fans, and negative (relative) indices are resolved. Indices
+// kept are 1-based.
 class OBJProcessor {
 private:
-  string _objFileContent;
-  vector<string> _splitFileContent;
+  Vec3s _vs;   // vertices of mesh
+  IVec3s _fs;  // faces of mesh
+  Vec2s _vts;  // vertices of texture
+  IVec3s _fts; // faces of texture
+  Vec3s _vns;  // vertices of normal
+  IVec3s _fns; // faces of normal
 
-  Vec3s _vs;  // vertices of mesh
-  Vec3s _fs;  // faces of mesh
-  Vec2s _vts; // vertices of texture
-  Vec3s _fts; // faces of texture
-  Vec3s _vns; // vertices of normal
-  Vec3s _fns; // faces of normal
+  // What a chunk of file holds. Relative indices are resolved against the
+  // chunk only, and listed to be shifted once preceding chunks are known.
+  struct _Chunk {
+    Vec3s vs, vns;
+    Vec2s vts;
+    IVec3s fs, fts, fns;
+    vector<size_t> relFs, relFts, relFns; // index into fs * 3 + k, etc.
+    string error;                         // first error, if any
+  };
 
-public:
-  OBJProcessor(string objFileContent);
-  ~OBJProcessor();
+  static const char *_skipSpaces(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t')) {
+      p++;
+    }
+    return p;
+  }
 
-  // getters
-  const Vec3s &vs() const { return _vs; }
-  const Vec3s &fs() const { return _fs; }
-  const Vec2s &vts() const { return _vts; }
-  const Vec3s &fts() const { return _fts; }
-  const Vec3s &vns() const { return _vns; }
-  const Vec3s &fns() const { return _fns; }
+  // Parse `n` floats after `p` into `out`. Returns false if malformed.
+  static bool _parseFloats(const char *p, const char *end, int n, float *out) {
+    for (int i = 0; i < n; i++) {
+      p = _skipSpaces(p, end);
+      if (p < end && *p == '+') {
+        p++;
+      }
+      auto res = std::from_chars(p, end, out[i]);
+      if (res.ec != std::errc()) {
+        return false;
+      }
+      p = res.ptr;
+    }
+    return true;
+  }
 
-  const int getEffectiveVertexCount() {
-    return this->_fs.size() * 3; // as triangle
+  // Parse face line after "f" into `chunk`.
+  static bool _parseFace(const char *p, const char *end, _Chunk &chunk) {
+    // v, v/vt, v//vn or v/vt/vn per vertex
+    int idx[3][3];    // [corner][v, vt, vn] of fan: first, previous, current
+    bool has[3] = {}; // whether vt, vn present, decided by the first vertex
+    int count = 0;
+    while ((p = _skipSpaces(p, end)) < end) {
+      int corner = count < 3 ? count : 2;
+      if (count >= 3) {
+        // move current to previous
+        std::copy(idx[2], idx[2] + 3, idx[1]);
+      }
+      std::fill(idx[corner], idx[corner] + 3, 0);
+      for (int k = 0; k < 3; k++) {
+        if (k > 0) {
+          if (p >= end || *p != '/') {
+            break;
+          }
+          p++;
+          if (k == 1 && p < end && *p == '/') {
+            continue; // v//vn
+          }
+        }
+        auto res = std::from_chars(p, end, idx[corner][k]);
+        if (res.ec != std::errc() || idx[corner][k] == 0) {
+          return false;
+        }
+        p = res.ptr;
+      }
+      for (int k = 1; k < 3; k++) {
+        if (count == 0) {
+          has[k] = idx[0][k] != 0;
+        } else if (has[k] != (idx[corner][k] != 0)) {
+          return false; // mixed formats
+        }
+      }
+      if (++count >= 3) {
+        _emitTriangle(idx, has, chunk);
+      }
+    }
+    return count >= 3;
   }
-};
 
-OBJProcessor::OBJProcessor(string objFileContent) {
-  this->_objFileContent =
-      std::regex_replace(string(objFileContent), std::regex("\r\n"), "\n");
-  // split the file into lines
-  this->_splitFileContent =
-      stringSplit(this->_objFileContent, std::regex("\n"));
-
-  // regex to match various face line format
-  regex f123Regex = regex(R"(^f (\d+/\d+/\d+ ){2}(\d+/\d+/\d+)$)");
-  regex f12Regex = regex(R"(^f (\d+/\d+ ){2}(\d+/\d+)$)");
-  regex f13Regex = regex(R"("^f (\d+/\d+/\d+ ){2}(\d+/\d+/\d+)$)");
-
-  vector<string> lineSplit;
-  vector<float> vParsed;
-  vector<int> fParsed;
-
-  for (auto &line : this->_splitFileContent) {
-    lineSplit = stringSplit(line, regex(R"(\s+)"));
-    // mesh vertices
-    if (stringStartsWith(line, "v ")) {
-      vParsed = mapParseFloat(lineSplit, 1);
-      this->_vs.push_back(vec3(vParsed[0], vParsed[1], vParsed[2]));
+  static void _emitTriangle(int idx[3][3], const bool has[3], _Chunk &chunk) {
+    IVec3s *faces[3] = {&chunk.fs, &chunk.fts, &chunk.fns};
+    vector<size_t> *rels[3] = {&chunk.relFs, &chunk.relFts, &chunk.relFns};
+    size_t counts[3] = {chunk.vs.size(), chunk.vts.size(), chunk.vns.size()};
+    for (int k = 0; k < 3; k++) {
+      if (k > 0 && !has[k]) {
+        continue;
+      }
+      glm::ivec3 face;
+      for (int c = 0; c < 3; c++) {
+        face[c] = idx[c][k];
+        if (face[c] < 0) {
+          // relative to the end of this chunk so far
+          face[c] += (int)counts[k] + 1;
+          rels[k]->push_back(faces[k]->size() * 3 + c);
+        }
+      }
+      faces[k]->push_back(face);
     }
-    // texture vertices
-    else if (stringStartsWith(line, "vt ")) {
-      vParsed = mapParseFloat(lineSplit, 1);
-      this->_vts.push_back(vec2(vParsed[0], vParsed[1]));
+  }
+
+  // Parse lines in [begin, end) into `chunk`.
+  static void _parseChunk(const char *begin, const char *end, _Chunk &chunk) {
+    for (const char *line = begin; line < end && chunk.error.empty();) {
+      const char *lineEnd = std::find(line, end, '\n');
+      const char *p = _skipSpaces(line, lineEnd), *e = lineEnd;
+      // cut comment and CR
+      e = std::find(p, e, '#');
+      while (e > p && (e[-1] == '\r' || e[-1] == ' ' || e[-1] == '\t')) {
+        e--;
+      }
+      bool ok = true;
+      if (e - p >= 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+        vec3 v;
+        ok = _parseFloats(p + 2, e, 3, &v[0]);
+        chunk.vs.push_back(v);
+      } else if (e - p >= 3 && p[0] == 'v' && p[1] == 't' &&
+                 (p[2] == ' ' || p[2] == '\t')) {
+        vec2 vt;
+        ok = _parseFloats(p + 3, e, 2, &vt[0]);
+        chunk.vts.push_back(vt);
+      } else if (e - p >= 3 && p[0] == 'v' && p[1] == 'n' &&
+                 (p[2] == ' ' || p[2] == '\t')) {
+        vec3 vn;
+        ok = _parseFloats(p + 3, e, 3, &vn[0]);
+        chunk.vns.push_back(vn);
+      } else if (e - p >= 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+        ok = _parseFace(p + 2, e, chunk);
+      }
+      // do nothing for `usemtl`, `o` and so on
+      if (!ok) {
+        chunk.error = "Malformed line in .obj: " + string(line, e);
+      }
+      line = lineEnd + 1;
     }
-    // normal vertices
-    else if (stringStartsWith(line, "vn ")) {
-      vParsed = mapParseFloat(lineSplit, 1);
-      this->_vns.push_back(vec3(vParsed[0], vParsed[1], vParsed[2]));
+  }
+
+  // Parse [begin, end) by `nThreads` threads (all cores if 0).
+  void _parse(const char *begin, const char *end, int nThreads) {
+    const size_t MinChunkBytes = 1 << 20;
+    if (nThreads <= 0) {
+      nThreads = std::max(1, (int)std::thread::hardware_concurrency());
     }
-    // faces
-    else if (stringStartsWith(line, "f")) {
-      // f 1 1 1
-      if (line.find("/") == string::npos) {
-        fParsed = mapParseInt(lineSplit, 1);
-        this->_fs.push_back(vec3(fParsed[0], fParsed[1], fParsed[2]));
-      } else {
-        string newLine = std::regex_replace(line.substr(2), regex("/"), " ");
-        lineSplit = stringSplit(newLine, regex(R"(\s+)"));
-        fParsed = mapParseInt(lineSplit);
-        // f 3/3/3 3/3/3 3/3/3
-        if (std::regex_match(line, f123Regex)) {
-          this->_fs.push_back(vec3(fParsed[0], fParsed[3], fParsed[6]));
-          this->_fts.push_back(vec3(fParsed[1], fParsed[4], fParsed[7]));
-          this->_fns.push_back(vec3(fParsed[2], fParsed[5], fParsed[8]));
-        }
-        // f 2/2 2/2 2/2
-        else if (std::regex_match(line, f12Regex)) {
-          this->_fs.push_back(vec3(fParsed[0], fParsed[2], fParsed[4]));
-          this->_fts.push_back(vec3(fParsed[1], fParsed[3], fParsed[5]));
+    nThreads = (int)std::max<size_t>(
+        1, std::min<size_t>(nThreads, (end - begin) / MinChunkBytes));
 
-        }
-        // f x//x x//x x//x
-        else if (std::regex_match(line, f13Regex)) {
-          this->_fs.push_back(vec3(fParsed[0], fParsed[2], fParsed[4]));
-          this->_fns.push_back(vec3(fParsed[1], fParsed[3], fParsed[5]));
+    // split at line ends
+    vector<const char *> bounds = {begin};
+    for (int i = 1; i < nThreads; i++) {
+      const char *p = std::max(bounds.back(), begin + (end - begin) * i /
+                                                          nThreads);
+      p = std::find(p, end, '\n');
+      bounds.push_back(p == end ? end : p + 1);
+    }
+    bounds.push_back(end);
+
+    vector<_Chunk> chunks(nThreads);
+    vector<std::thread> workers;
+    for (int i = 1; i < nThreads; i++) {
+      workers.push_back(std::thread(_parseChunk, bounds[i], bounds[i + 1],
+                                    std::ref(chunks[i])));
+    }
+    _parseChunk(bounds[0], bounds[1], chunks[0]);
+    for (auto &t : workers) {
+      t.join();
+    }
+    for (const auto &chunk : chunks) {
+      ASSERT(chunk.error.empty(), chunk.error);
+    }
+    _merge(chunks);
+  }
+
+  // Concatenate `chunks`, shifting their relative indices.
+  void _merge(vector<_Chunk> &chunks) {
+    size_t nv = 0, nvt = 0, nvn = 0, nf = 0, nft = 0, nfn = 0;
+    for (const auto &c : chunks) {
+      nv += c.vs.size(), nvt += c.vts.size(), nvn += c.vns.size();
+      nf += c.fs.size(), nft += c.fts.size(), nfn += c.fns.size();
+    }
+    _vs.reserve(nv), _vts.reserve(nvt), _vns.reserve(nvn);
+    _fs.reserve(nf), _fts.reserve(nft), _fns.reserve(nfn);
+
+    for (auto &c : chunks) {
+      IVec3s *faces[3] = {&c.fs, &c.fts, &c.fns};
+      const vector<size_t> *rels[3] = {&c.relFs, &c.relFts, &c.relFns};
+      int offsets[3] = {(int)_vs.size(), (int)_vts.size(), (int)_vns.size()};
+      for (int k = 0; k < 3; k++) {
+        for (size_t r : *rels[k]) {
+          (*faces[k])[r / 3][r % 3] += offsets[k];
         }
       }
+      _vs.insert(_vs.end(), c.vs.begin(), c.vs.end());
+      _vts.insert(_vts.end(), c.vts.begin(), c.vts.end());
+      _vns.insert(_vns.end(), c.vns.begin(), c.vns.end());
+      _fs.insert(_fs.end(), c.fs.begin(), c.fs.end());
+      _fts.insert(_fts.end(), c.fts.begin(), c.fts.end());
+      _fns.insert(_fns.end(), c.fns.begin(), c.fns.end());
+      c = _Chunk(); // release early
     }
-    // do nothing for `usemtl`, `o` and so on
-    else {
-      {} // noop
+
+    // indices may refer to any chunk, so they are checked once merged
+    const IVec3s *faces[3] = {&_fs, &_fts, &_fns};
+    const int counts[3] = {(int)_vs.size(), (int)_vts.size(),
+                           (int)_vns.size()};
+    const char *names[3] = {"vertex", "texture vertex", "normal"};
+    for (int k = 0; k < 3; k++) {
+      for (size_t i = 0; i < faces[k]->size(); i++) {
+        const glm::ivec3 &face = (*faces[k])[i];
+        for (int c = 0; c < 3; c++) {
+          if (face[c] < 1 || face[c] > counts[k]) {
+            ASSERT(false, "Malformed line in .obj: triangle " +
+                              std::to_string(i + 1) + " refers to " +
+                              names[k] + " " + std::to_string(face[c]) +
+                              " (resolved) of " +
+                              std::to_string(counts[k]) + ".");
+          }
+        }
+      }
     }
   }
-}
 
-OBJProcessor::~OBJProcessor() {}
+  OBJProcessor() {}
+
+public:
+  // Parse .obj file content.
+  OBJProcessor(const string &objFileContent, int nThreads = 0) {
+    _parse(objFileContent.data(),
+           objFileContent.data() + objFileContent.size(), nThreads);
+  }
+
+  // Parse .obj file at `path`, mapped instead of read into memory.
+  static OBJProcessor fromFile(const string &path, int nThreads = 0) {
+    MappedFile file(path);
+    OBJProcessor proc;
+    proc._parse(file.data(), file.data() + file.size(), nThreads);
+    return proc;
+  }
+
+  // getters
+  const Vec3s &vs() const { return _vs; }
+  const IVec3s &fs() const { return _fs; }
+  const Vec2s &vts() const { return _vts; }
+  const IVec3s &fts() const { return _fts; }
+  const Vec3s &vns() const { return _vns; }
+  const IVec3s &fns() const { return _fns; }
+
+  const int getEffectiveVertexCount() {
+    return this->_fs.size() * 3; // as triangle
+  }
+};
 
 } // namespace zx
 
-#endif
\ No newline at end of file
+#endif
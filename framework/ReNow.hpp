@@ -20,9 +20,18 @@
 #include <string>
 #include <vector>
 #include <cassert>
+#include <algorithm>
+#include <cstddef>
 #include <iostream>
+#include <unordered_map>
 
 #include "OBJProcessor.hpp"
+#include "IndexedMesh.hpp"
+#include "MeshSimplify.hpp"
+#include "MeshCache.hpp"
+#include "InstanceBuffer.hpp"
+#include "Scene.hpp"
+#include "FrameProfiler.hpp"
 #include "Utils.hpp"
 
 using glm::mat2;
@@ -119,10 +128,12 @@ struct UPrepInfo {
   };
 };
 
-// Initialize GL window, return the handle.
+// Initialize GL window, return the handle. An invisible window only serves
+// as GL context, e.g. to render offscreen.
 GLFWwindow *initGLWindow(const string &windowName, int canvasWidth,
-                         int canvasHeight) {
+                         int canvasHeight, bool visible = true) {
   glfwInit();
+  glfwWindowHint(GLFW_VISIBLE, visible ? GLFW_TRUE : GLFW_FALSE);
   GLFWwindow *window = glfwCreateWindow(canvasWidth, canvasHeight,
                                         windowName.c_str(), NULL, NULL);
   ASSERT(window != NULL, "Window creation failed: " + windowName + ".");
@@ -135,18 +146,60 @@ GLFWwindow *initGLWindow(const string &windowName, int canvasWidth,
 class ReNowHelper {
 
 private:
+  // locations of active variables of a program, resolved once linked
+  struct _ProgramLocations {
+    std::unordered_map<string, GL_UNIFORM_LOC> uniforms;
+    std::unordered_map<string, GL_ATTRIB_LOC> attributes;
+  };
+
   // maintainings
   GLFWwindow *_window;
   GL_PROGRAM_ID _currentProgram;
+  GL_OBJECT_ID _currentVAO, _currentVBO; // bound, to skip redundant binds
+  std::unordered_map<GL_PROGRAM_ID, _ProgramLocations> _locations;
   vector<GL_OBJECT_ID> _allocatedVAOs;
   vector<GL_OBJECT_ID> _allocatedVBOs;
   bool _alreadyInitTexParams;
+  FrameProfiler _profiler;
+
+  // Resolve locations of active uniforms and attributes of `program`.
+  void _resolveLocations(GL_PROGRAM_ID program) {
+    _ProgramLocations &locations = _locations[program];
+    GLint count = 0, maxLength = 0, size;
+    GLsizei length;
+    GLenum type;
+    glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+    vector<GLchar> name(std::max(maxLength, 1));
+    glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+    for (GLint i = 0; i < count; i++) {
+      glGetActiveUniform(program, i, (GLsizei)name.size(), &length, &size,
+                         &type, name.data());
+      string varName(name.data(), length);
+      // arrays are reported as `name[0]`
+      if (varName.size() > 3 &&
+          varName.compare(varName.size() - 3, 3, "[0]") == 0) {
+        varName.resize(varName.size() - 3);
+      }
+      locations.uniforms[varName] = glGetUniformLocation(program, name.data());
+    }
+    glGetProgramiv(program, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &maxLength);
+    name.resize(std::max(maxLength, 1));
+    glGetProgramiv(program, GL_ACTIVE_ATTRIBUTES, &count);
+    for (GLint i = 0; i < count; i++) {
+      glGetActiveAttrib(program, i, (GLsizei)name.size(), &length, &size,
+                        &type, name.data());
+      locations.attributes[string(name.data(), length)] =
+          glGetAttribLocation(program, name.data());
+    }
+  }
 
 public:
   ReNowHelper()
-      : _window(nullptr), _currentProgram(-1), _alreadyInitTexParams(false) {}
+      : _window(nullptr), _currentProgram(-1), _currentVAO(-1),
+        _currentVBO(-1), _alreadyInitTexParams(false) {}
   ReNowHelper(GLFWwindow *window)
-      : _window(window), _currentProgram(-1), _alreadyInitTexParams(false) {}
+      : _window(window), _currentProgram(-1), _currentVAO(-1),
+        _currentVBO(-1), _alreadyInitTexParams(false) {}
 
   // Create a program.
   GL_PROGRAM_ID
@@ -164,6 +217,7 @@ public:
     glGetProgramiv(program, GL_LINK_STATUS, &status);
     ASSERT(status == GL_TRUE, "Program link failed.");
 
+    _resolveLocations(program);
     return program;
   }
 
@@ -190,25 +244,62 @@ public:
 
   // Switch to a program.
   void switchProgram(GL_PROGRAM_ID program) {
-    this->_currentProgram = program;
-    glUseProgram(program);
+    if (program != this->_currentProgram) {
+      this->_currentProgram = program;
+      glUseProgram(program);
+      _profiler.countStateChange();
+    }
   }
 
-  // Get Uniform location in shader.
+  // Get Uniform location in shader. Resolve it once and keep it instead of
+  // calling per frame.
   GL_UNIFORM_LOC
   getUniformLocation(const string &varName) {
-    GL_UNIFORM_LOC loc =
-        glGetUniformLocation(this->_currentProgram, varName.c_str());
-    ASSERT(loc != -1, "Invalid Uniform location for `" + varName + "`.");
-    return loc;
+    auto program = _locations.find(this->_currentProgram);
+    if (program != _locations.end()) {
+      auto it = program->second.uniforms.find(varName);
+      if (it != program->second.uniforms.end() && it->second != -1) {
+        return it->second;
+      }
+    }
+    // message is built only when failed
+    ASSERT(false, "Invalid Uniform location for `" + varName + "`.");
+    return -1;
   }
 
   // Get attribute location in shader.
   GL_ATTRIB_LOC getAttributeLocation(const string &varName) {
-    GL_ATTRIB_LOC loc =
-        glGetAttribLocation(this->_currentProgram, varName.c_str());
-    ASSERT(loc != -1, "Invalid Attribute location for `" + varName + "`.");
-    return loc;
+    auto program = _locations.find(this->_currentProgram);
+    if (program != _locations.end()) {
+      auto it = program->second.attributes.find(varName);
+      if (it != program->second.attributes.end() && it->second != -1) {
+        return it->second;
+      }
+    }
+    ASSERT(false, "Invalid Attribute location for `" + varName + "`.");
+    return -1;
+  }
+
+  // Set Uniform at `loc` of current program, typed by `data`.
+  void setUniform(GL_UNIFORM_LOC loc, float data) { glUniform1f(loc, data); }
+  void setUniform(GL_UNIFORM_LOC loc, int data) { glUniform1i(loc, data); }
+  void setUniform(GL_UNIFORM_LOC loc, const vec2 &data) {
+    glUniform2fv(loc, 1, &data[0]);
+  }
+  void setUniform(GL_UNIFORM_LOC loc, const vec3 &data) {
+    glUniform3fv(loc, 1, &data[0]);
+  }
+  void setUniform(GL_UNIFORM_LOC loc, const vec4 &data) {
+    glUniform4fv(loc, 1, &data[0]);
+  }
+  void setUniform(GL_UNIFORM_LOC loc, const mat2 &data) {
+    glUniformMatrix2fv(loc, 1, GL_FALSE, &data[0][0]);
+  }
+  void setUniform(GL_UNIFORM_LOC loc, const mat3 &data) {
+    glUniformMatrix3fv(loc, 1, GL_FALSE, &data[0][0]);
+  }
+  void setUniform(GL_UNIFORM_LOC loc, const mat4 &data) {
+    glUniformMatrix4fv(loc, 1, GL_FALSE, &data[0][0]);
   }
 
   // Set Uniforms in shader.
@@ -265,7 +356,10 @@ public:
   }
 
   // Bind Texture 2D.
-  void bindTexture2D(GL_OBJECT_ID tex) { glBindTexture(GL_TEXTURE_2D, tex); }
+  void bindTexture2D(GL_OBJECT_ID tex) {
+    glBindTexture(GL_TEXTURE_2D, tex);
+    _profiler.countStateChange();
+  }
 
   // Check if user is pressing `keyCode` key.
   bool nowPressing(int keyCode) {
@@ -273,10 +367,22 @@ public:
   }
 
   // Switch current VAO.
-  void switchVAO(GL_OBJECT_ID VAO) { glBindVertexArray(VAO); }
+  void switchVAO(GL_OBJECT_ID VAO) {
+    if (VAO != _currentVAO) {
+      _currentVAO = VAO;
+      glBindVertexArray(VAO);
+      _profiler.countStateChange();
+    }
+  }
 
   // Switch current VBO.
-  void switchVBO(GL_OBJECT_ID VBO) { glBindBuffer(GL_ARRAY_BUFFER, VBO); }
+  void switchVBO(GL_OBJECT_ID VBO) {
+    if (VBO != _currentVBO) {
+      _currentVBO = VBO;
+      glBindBuffer(GL_ARRAY_BUFFER, VBO);
+      _profiler.countStateChange();
+    }
+  }
 
   // Create new VAO.
   GL_OBJECT_ID createVAO() {
@@ -294,21 +400,24 @@ public:
     return res;
   }
 
-  // Free allocated VAOs and VBOs.
+  // Free allocated VAOs, VBOs and profiler queries.
   void freeAllocatedObjects() {
+    _profiler.finish();
     for (const auto &id : _allocatedVAOs) {
       glDeleteVertexArrays(1, &id);
     }
     for (const auto &id : _allocatedVBOs) {
       glDeleteBuffers(1, &id);
     }
+    // deleted ones are unbound
+    _currentVAO = _currentVBO = -1;
   }
 
   // Set Attributes in shader.
   void prepareAttributes(const vector<APrepInfo> &attributes,
                          bool useVAO = false, GL_OBJECT_ID VAO = -1) {
     if (useVAO) {
-      glBindVertexArray(VAO);
+      switchVAO(VAO);
     }
     for (const auto &attribute : attributes) {
       // change buffer
@@ -326,12 +435,107 @@ public:
       }
     }
   }
+
+  // Upload interleaved `vertices` to `VBO` and `indices` to `EBO` for
+  // glDrawElements, and point attributes `positionName` and `normalName` into
+  // it. Current VAO keeps the EBO binding.
+  void prepareIndexedMesh(GL_OBJECT_ID VBO, GL_OBJECT_ID EBO,
+                          const MeshVertex *vertices, size_t vertexCount,
+                          const unsigned int *indices, size_t indexCount,
+                          const string &positionName = "aPosition",
+                          const string &normalName = "aNormal") {
+    switchVBO(VBO);
+    glBufferData(GL_ARRAY_BUFFER,
+                 (GLsizeiptr)(vertexCount * sizeof(MeshVertex)), vertices,
+                 GL_STATIC_DRAW);
+    GL_ATTRIB_LOC posLoc = getAttributeLocation(positionName),
+                  normalLoc = getAttributeLocation(normalName);
+    glVertexAttribPointer(posLoc, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex),
+                          (void *)offsetof(MeshVertex, position));
+    glEnableVertexAttribArray(posLoc);
+    glVertexAttribPointer(normalLoc, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex),
+                          (void *)offsetof(MeshVertex, normal));
+    glEnableVertexAttribArray(normalLoc);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+    _profiler.countStateChange();
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                 (GLsizeiptr)(indexCount * sizeof(unsigned int)), indices,
+                 GL_STATIC_DRAW);
+  }
+  void prepareIndexedMesh(GL_OBJECT_ID VBO, GL_OBJECT_ID EBO,
+                          const IndexedMesh &mesh,
+                          const string &positionName = "aPosition",
+                          const string &normalName = "aNormal") {
+    prepareIndexedMesh(VBO, EBO, mesh.vertices.data(), mesh.vertices.size(),
+                       mesh.indices.data(), mesh.indices.size(), positionName,
+                       normalName);
+  }
+  // Upload straight from the mapped cache file if it is.
+  void prepareIndexedMesh(GL_OBJECT_ID VBO, GL_OBJECT_ID EBO,
+                          const CachedMesh &mesh,
+                          const string &positionName = "aPosition",
+                          const string &normalName = "aNormal") {
+    prepareIndexedMesh(VBO, EBO, mesh.vertices(), mesh.vertexCount(),
+                       mesh.indices(), mesh.indexCount(), positionName,
+                       normalName);
+  }
+
+  // Point per-instance attributes `modelName` (mat4, 4 locations) and
+  // `colorName` of current VAO into `VBO` of InstanceData.
+  void prepareInstanceAttributes(GL_OBJECT_ID VBO,
+                                 const string &modelName = "aModelMatrix",
+                                 const string &colorName = "aColor") {
+    switchVBO(VBO);
+    GL_ATTRIB_LOC modelLoc = getAttributeLocation(modelName),
+                  colorLoc = getAttributeLocation(colorName);
+    for (int i = 0; i < 4; i++) {
+      glVertexAttribPointer(
+          modelLoc + i, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+          (void *)(offsetof(InstanceData, model) + sizeof(vec4) * i));
+      glEnableVertexAttribArray(modelLoc + i);
+      glVertexAttribDivisor(modelLoc + i, 1);
+    }
+    glVertexAttribPointer(colorLoc, 4, GL_FLOAT, GL_FALSE,
+                          sizeof(InstanceData),
+                          (void *)offsetof(InstanceData, color));
+    glEnableVertexAttribArray(colorLoc);
+    glVertexAttribDivisor(colorLoc, 1);
+  }
+
+  // Upload dirty ones of `instances` to `VBO`.
+  void updateInstances(GL_OBJECT_ID VBO, InstanceBuffer &instances) {
+    if (instances.dirty()) {
+      switchVBO(VBO);
+      instances.upload();
+    }
+  }
+
+  // Draw calls, counted by the profiler.
+  void drawArrays(GLenum mode, GLint first, GLsizei count) {
+    glDrawArrays(mode, first, count);
+    _profiler.countDrawCall();
+  }
+  void drawElements(GLenum mode, size_t indexCount) {
+    glDrawElements(mode, (GLsizei)indexCount, GL_UNSIGNED_INT, 0);
+    _profiler.countDrawCall();
+  }
+  void drawElementsInstanced(GLenum mode, size_t indexCount,
+                             size_t instanceCount) {
+    glDrawElementsInstanced(mode, (GLsizei)indexCount, GL_UNSIGNED_INT, 0,
+                            (GLsizei)instanceCount);
+    _profiler.countDrawCall();
+  }
+
+  // Profiler of the render loop, see FrameProfiler.
+  FrameProfiler &profiler() { return _profiler; }
 };
 
 // Convert faces to vectices sequence.
 vector<float> analyzeFtoV(const OBJProcessor &proc, const string &kind) {
   vector<float> mesh; // xyzxyz
-  Vec3s faces, vertices;
+  IVec3s faces;
+  Vec3s vertices;
   if (kind == "fs") {
     faces = proc.fs();
     vertices = proc.vs();
@@ -346,7 +550,7 @@ vector<float> analyzeFtoV(const OBJProcessor &proc, const string &kind) {
   //   faces = proc.fts();
   //   vertices = proc.vts();
   // }
-  for (const vec3 &face : faces) {
+  for (const glm::ivec3 &face : faces) {
     auto &v1 = vertices.at(face.x - 1), &v2 = vertices.at(face.y - 1),
          &v3 = vertices.at(face.z - 1);
     mesh.insert(mesh.end(),
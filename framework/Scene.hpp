@@ -0,0 +1,305 @@
+#pragma once
+
+// Scene of ReNow Framework
+// by z0gSh1u (Zhuo Xu) @ https://github.com/z0gSh1u/seu-viz
+// See:
+// https://github.com/z0gSh1u/typed-webgl
+// https://github.com/z0gSh1u/renow-ts
+// https://github.com/z0gSh1u/renow-c
+
+#ifndef SCENE_HPP_
+#define SCENE_HPP_
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <algorithm>
+
+#include "Utils.hpp"
+#include "InstanceBuffer.hpp"
+
+using glm::mat4;
+using glm::vec3;
+using glm::vec4;
+using std::vector;
+
+namespace zx {
+
+// Axis-aligned bounding box.
+struct AABB {
+  vec3 min = vec3(0), max = vec3(0);
+
+  vec3 center() const { return (min + max) * 0.5f; }
+  void merge(const AABB &other) {
+    min = glm::min(min, other.min), max = glm::max(max, other.max);
+  }
+  // Bounds of this box transformed by `m`.
+  AABB transformed(const mat4 &m) const {
+    // by Arvo: extent along each axis from the matrix entries
+    AABB res;
+    res.min = res.max = vec3(m[3]);
+    for (int col = 0; col < 3; col++) {
+      for (int row = 0; row < 3; row++) {
+        float a = m[col][row] * min[col], b = m[col][row] * max[col];
+        res.min[row] += std::min(a, b), res.max[row] += std::max(a, b);
+      }
+    }
+    return res;
+  }
+};
+
+// View frustum as 6 planes, inside where dot(plane, (p, 1)) >= 0.
+class Frustum {
+private:
+  vec4 _planes[6];
+
+public:
+  // Frustum of `viewProjection`, e.g. perspective * lookAt, in GL clip space.
+  Frustum(const mat4 &viewProjection) {
+    // by Gribb & Hartmann: planes from rows of the matrix
+    vec4 rows[4];
+    for (int r = 0; r < 4; r++) {
+      rows[r] = vec4(viewProjection[0][r], viewProjection[1][r],
+                     viewProjection[2][r], viewProjection[3][r]);
+    }
+    for (int i = 0; i < 3; i++) {
+      _planes[i * 2] = rows[3] + rows[i];
+      _planes[i * 2 + 1] = rows[3] - rows[i];
+    }
+  }
+
+  // Test `box` against planes in `mask` (bit per plane). Returns -1 if
+  // outside, or the planes it still crosses, i.e. 0 if fully inside.
+  int test(const AABB &box, int mask = 0x3F) const {
+    int crossing = 0;
+    for (int i = 0; i < 6; i++) {
+      if (!(mask & (1 << i))) {
+        continue;
+      }
+      const vec4 &p = _planes[i];
+      // the corners farthest along and against the normal
+      vec3 along(p.x >= 0 ? box.max.x : box.min.x,
+                 p.y >= 0 ? box.max.y : box.min.y,
+                 p.z >= 0 ? box.max.z : box.min.z),
+          against(p.x >= 0 ? box.min.x : box.max.x,
+                  p.y >= 0 ? box.min.y : box.max.y,
+                  p.z >= 0 ? box.min.z : box.max.z);
+      if (p.x * along.x + p.y * along.y + p.z * along.z + p.w < 0) {
+        return -1;
+      }
+      if (p.x * against.x + p.y * against.y + p.z * against.z + p.w < 0) {
+        crossing |= 1 << i;
+      }
+    }
+    return crossing;
+  }
+};
+
+// Instances of meshes in world, with a bounding volume hierarchy over them
+// to collect the visible ones. A mesh may have levels of detail, chosen per
+// instance by its size on screen.
+class Scene {
+private:
+  static const int LeafSize = 4; // max # instances in a leaf
+  // fraction a size must pass a threshold by to switch level, against
+  // popping back and forth
+  static constexpr float LODHysteresis = 0.15f;
+
+  struct _Instance {
+    size_t mesh;
+    InstanceData data;
+    AABB bounds; // in world
+    vec3 center; // of bounds
+    int lod;     // level of detail chosen last
+  };
+  struct _Node {
+    AABB bounds;
+    int left = -1, right = -1; // children, or -1 if leaf
+    int first = 0, count = 0;  // of _order, if leaf
+  };
+
+  vector<AABB> _meshBounds;        // local
+  vector<vector<float>> _lodSizes; // thresholds of each mesh
+  vector<size_t> _lodOffset = {0}; // first buffer of each mesh in cull
+  vector<_Instance> _instances;
+  vector<int> _order; // instance indices, grouped by leaves
+  vector<_Node> _nodes;
+  bool _dirty = false;
+
+  // reused for culling
+  vector<std::pair<int, int>> _stack; // (node, planes still crossed)
+  vector<size_t> _counts;             // # visible of each buffer
+
+  // Build node over _order[first, first + count), returns its index.
+  int _build(int first, int count) {
+    int index = (int)_nodes.size();
+    _nodes.push_back(_Node());
+    AABB bounds = _instances[_order[first]].bounds, centers;
+    centers.min = centers.max = _instances[_order[first]].center;
+    for (int i = first + 1; i < first + count; i++) {
+      const _Instance &ins = _instances[_order[i]];
+      bounds.merge(ins.bounds);
+      centers.min = glm::min(centers.min, ins.center);
+      centers.max = glm::max(centers.max, ins.center);
+    }
+    _nodes[index].bounds = bounds;
+    if (count <= LeafSize) {
+      _nodes[index].first = first, _nodes[index].count = count;
+      return index;
+    }
+    // split at median along the longest axis of centers
+    vec3 extent = centers.max - centers.min;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2)
+                                   : (extent.y > extent.z ? 1 : 2);
+    int half = count / 2;
+    std::nth_element(_order.begin() + first, _order.begin() + first + half,
+                     _order.begin() + first + count, [&](int a, int b) {
+                       return _instances[a].center[axis] <
+                              _instances[b].center[axis];
+                     });
+    int left = _build(first, half), right = _build(first + half, count - half);
+    _nodes[index].left = left, _nodes[index].right = right;
+    return index;
+  }
+
+  // Level of detail of `ins` by its size on screen, moving away from its
+  // current level only past a threshold by the hysteresis.
+  int _selectLOD(const _Instance &ins, const vec4 &rowW,
+                 float pixelScale) const {
+    const vector<float> &sizes = _lodSizes[ins.mesh];
+    float w = glm::dot(rowW, vec4(ins.center, 1)),
+          diameter = glm::length(ins.bounds.max - ins.bounds.min);
+    if (w <= diameter * 0.5f) {
+      return 0; // too near to measure
+    }
+    float size = diameter * pixelScale / (2 * w); // across, in pixels
+    int coarser = 0, finer = 0; // levels if moving so
+    for (float threshold : sizes) {
+      coarser += size < threshold * (1 - LODHysteresis);
+      finer += size < threshold * (1 + LODHysteresis);
+    }
+    return std::min(std::max(ins.lod, coarser), finer);
+  }
+
+  void _rebuild() {
+    _nodes.clear();
+    _order.resize(_instances.size());
+    for (size_t i = 0; i < _order.size(); i++) {
+      _order[i] = (int)i;
+    }
+    if (!_instances.empty()) {
+      _nodes.reserve(_instances.size() * 2 / LeafSize + 1);
+      _build(0, (int)_instances.size());
+    }
+    _dirty = false;
+  }
+
+public:
+  // Add a mesh of local bounds, returns its index. Level i + 1 of detail
+  // is for instances smaller than `lodSizes[i]` pixels across on screen,
+  // sizes descending; none for a single level.
+  size_t addMesh(const vec3 &boundsMin, const vec3 &boundsMax,
+                 const vector<float> &lodSizes = {}) {
+    AABB bounds;
+    bounds.min = boundsMin, bounds.max = boundsMax;
+    _meshBounds.push_back(bounds);
+    _lodSizes.push_back(lodSizes);
+    _lodOffset.push_back(_lodOffset.back() + lodSizes.size() + 1);
+    return _meshBounds.size() - 1;
+  }
+
+  // Index in `visible` of cull for `level` of `mesh`.
+  size_t visibleIndex(size_t mesh, int level = 0) const {
+    return _lodOffset[mesh] + level;
+  }
+
+  // Add an instance of `mesh`, returns its index.
+  size_t addInstance(size_t mesh, const mat4 &model, const vec4 &color) {
+    ASSERT(mesh < _meshBounds.size(), "Invalid mesh in scene.");
+    AABB bounds = _meshBounds[mesh].transformed(model);
+    _instances.push_back({mesh, {model, color}, bounds, bounds.center(), 0});
+    _dirty = true;
+    return _instances.size() - 1;
+  }
+
+  void setModel(size_t instance, const mat4 &model) {
+    _Instance &ins = _instances.at(instance);
+    ins.data.model = model;
+    ins.bounds = _meshBounds[ins.mesh].transformed(model);
+    ins.center = ins.bounds.center();
+    _dirty = true;
+  }
+  void setColor(size_t instance, const vec4 &color) {
+    _instances.at(instance).data.color = color;
+  }
+
+  size_t meshCount() const { return _meshBounds.size(); }
+  size_t instanceCount() const { return _instances.size(); }
+
+  // Put instances in the frustum of `viewProjection` to `visible`, the one
+  // of its mesh and level (see visibleIndex). Levels are chosen for a
+  // viewport of `viewportHeight` pixels, or always 0 if it is 0. Returns #
+  // visible instances.
+  size_t cull(const mat4 &viewProjection, vector<InstanceBuffer> &visible,
+              float viewportHeight = 0) {
+    if (_dirty) {
+      _rebuild();
+    }
+    visible.resize(_lodOffset.back());
+    _counts.assign(_lodOffset.back(), 0);
+    Frustum frustum(viewProjection);
+    // pixels across per unit size at clip w = 1, and row giving clip w
+    vec4 rowW(viewProjection[0][3], viewProjection[1][3],
+              viewProjection[2][3], viewProjection[3][3]);
+    float pixelScale =
+        viewportHeight * glm::length(vec3(viewProjection[0][1],
+                                          viewProjection[1][1],
+                                          viewProjection[2][1]));
+    _stack.clear();
+    if (!_nodes.empty()) {
+      _stack.push_back({0, 0x3F});
+    }
+    while (!_stack.empty()) {
+      int index = _stack.back().first, mask = _stack.back().second;
+      _stack.pop_back();
+      const _Node &node = _nodes[index];
+      // children fully inside need no more tests
+      int crossing = mask == 0 ? 0 : frustum.test(node.bounds, mask);
+      if (crossing < 0) {
+        continue;
+      }
+      if (node.left >= 0) {
+        _stack.push_back({node.left, crossing});
+        _stack.push_back({node.right, crossing});
+        continue;
+      }
+      for (int i = node.first; i < node.first + node.count; i++) {
+        _Instance &ins = _instances[_order[i]];
+        if (crossing != 0 && frustum.test(ins.bounds, crossing) < 0) {
+          continue;
+        }
+        // level 0 without a viewport, even if a former cull chose another
+        ins.lod = viewportHeight > 0 && !_lodSizes[ins.mesh].empty()
+                      ? _selectLOD(ins, rowW, pixelScale)
+                      : 0;
+        size_t index = _lodOffset[ins.mesh] + ins.lod;
+        InstanceBuffer &buffer = visible[index];
+        size_t k = _counts[index]++;
+        if (k < buffer.size()) {
+          buffer.set(k, ins.data.model, ins.data.color);
+        } else {
+          buffer.add(ins.data.model, ins.data.color);
+        }
+      }
+    }
+    size_t total = 0;
+    for (size_t m = 0; m < visible.size(); m++) {
+      visible[m].resize(_counts[m]);
+      total += _counts[m];
+    }
+    return total;
+  }
+};
+
+} // namespace zx
+
+#endif
@@ -44,6 +44,7 @@ typedef unsigned char uint8;
 typedef unsigned short uint16;
 typedef vector<vec2> Vec2s;
 typedef vector<vec3> Vec3s;
+typedef vector<glm::ivec3> IVec3s;
 typedef vec3 RGBColor;
 typedef vec4 RGBAColor;
 